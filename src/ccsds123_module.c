@@ -0,0 +1,921 @@
+#include "module.h"
+#include "util.h"
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Define custom error codes */
+enum ERROR_CODE {
+    MALLOC_ERR = 1,
+    INVALID_INPUT = 2,
+    INVALID_PARAM = 3,
+    THREAD_ERR = 4,
+};
+
+/*
+ * Low-complexity predictive compression of multi-band images following CCSDS 123.0.
+ *
+ * The channels of the image are treated as spectral bands, stored band interleaved by
+ * pixel (BIP) as they come in the batch. Every sample is predicted by the adaptive linear
+ * predictor of CCSDS 123.0-B-1 in full prediction mode with neighbour-oriented local sums:
+ * a weighted sum of the three directional local differences of the band and the central
+ * local differences of up to prediction_bands previous bands, with the weights adapted
+ * by the sign algorithm. The mapped residuals are coded by the sample-adaptive entropy
+ * coder, with one accumulator and counter per band, in BIP order.
+ *
+ * With max_error > 0 the residuals are quantized as in CCSDS 123.0-B-2 (near-lossless,
+ * absolute error limit), and the reconstructed samples are used for prediction.
+ *
+ * The image is processed in chunks of CHUNK_ROWS rows. Within a chunk every band is
+ * predicted row by row, which gives the same residuals as a sample by sample BIP pass.
+ * For lossless compression the prediction of a band only depends on the input samples,
+ * so with band_threads the bands of every chunk are shared out to a pool of band workers,
+ * started once per image.
+ *
+ * The stream is a CCSDS 123.0-B-2 header (image, predictor, quantization when max_error > 0,
+ * and entropy coder metadata) followed by the body, padded to a whole byte. The image is
+ * described as band interleaved with a sub-frame interleaving depth of all bands (BIP),
+ * unsigned samples of `bits` bits. As the standard prescribes, the first sample of every band
+ * is coded losslessly and its mapped residual is sent uncoded on `bits` bits.
+ */
+
+#define CHUNK_ROWS 32
+#define MAX_PREDICTION_BANDS 15
+#define MAX_DIMENSION 65536    /* image sizes are coded modulo 2^16 in the header */
+#define REGISTER_SIZE 64       /* the high resolution prediction is computed on 64 bits */
+
+/* Predictor parameters (CCSDS 123.0-B-1 section 4) */
+#define OMEGA 13               /* weight resolution */
+#define NU_MIN (-1)            /* weight update scaling exponent limits */
+#define NU_MAX 3
+#define T_INC_LOG 6            /* scaling exponent change interval 2^6 */
+
+/* Sample-adaptive entropy coder parameters (CCSDS 123.0-B-1 section 5.4.3.2) */
+#define U_MAX 18               /* unary length limit */
+#define GAMMA_0 1              /* initial count exponent */
+#define GAMMA_STAR 6           /* rescaling counter size */
+#define ACC_INIT_K 3           /* accumulator initialization constant */
+
+typedef struct BandState {
+    int32_t weights[3 + MAX_PREDICTION_BANDS];
+    uint32_t accumulator;
+    uint32_t counter;
+} BandState;
+
+typedef struct Coder {
+    int width;
+    int height;
+    int bands;
+    int bits;
+    int prediction_bands;
+    int max_error;
+    int32_t s_max;
+    int32_t s_mid;
+    BandState *state;
+    uint16_t *samples;   /* CHUNK_ROWS + 1 BIP rows, row 0 is the last row of the previous chunk */
+    uint16_t *mapped;    /* mapped residuals of the chunk, band sequential so band threads do not share cache lines */
+    int chunk_y;         /* image row of samples row 1 */
+    int chunk_rows;
+} Coder;
+
+typedef struct BitWriter {
+    uint8_t *buf;
+    size_t size;
+    size_t capacity;
+    uint64_t acc;
+    int nbits;
+} BitWriter;
+
+/* Make room for n more bytes */
+static void reserve_bytes(BitWriter *bw, size_t n)
+{
+    size_t needed = bw->size + n + 8;
+    if (needed <= bw->capacity)
+        return;
+    size_t capacity = bw->capacity * 2 > needed ? bw->capacity * 2 : needed;
+    uint8_t *tmp = (uint8_t *)realloc(bw->buf, capacity);
+    if (tmp == NULL)
+        signal_error_and_exit(MALLOC_ERR);
+    bw->buf = tmp;
+    bw->capacity = capacity;
+}
+
+static void put_bits(BitWriter *bw, uint32_t value, int n)
+{
+    bw->acc = (bw->acc << n) | value;
+    bw->nbits += n;
+    while (bw->nbits >= 8)
+    {
+        bw->nbits -= 8;
+        bw->buf[bw->size++] = (uint8_t)(bw->acc >> bw->nbits);
+    }
+}
+
+static void flush_bits(BitWriter *bw)
+{
+    if (bw->nbits > 0)
+        put_bits(bw, 0, 8 - bw->nbits);
+}
+
+static inline int32_t clip(int32_t v, int32_t lo, int32_t hi)
+{
+    return v < lo ? lo : (v > hi ? hi : v);
+}
+
+/* Floor division for the non-negative divisor 2m + 1 */
+static inline int32_t floor_div(int32_t a, int32_t b)
+{
+    return a >= 0 ? a / b : -((-a + b - 1) / b);
+}
+
+static void init_coder_state(Coder *c)
+{
+    for (int z = 0; z < c->bands; ++z)
+    {
+        BandState *s = &c->state[z];
+        memset(s->weights, 0, sizeof(s->weights));
+
+        /* Directional weights start at 0, spectral weights at 7/8 decaying by 1/8 per band */
+        int p = z < c->prediction_bands ? z : c->prediction_bands;
+        if (p > 0)
+            s->weights[3] = (7 << OMEGA) / 8;
+        for (int i = 1; i < p; ++i)
+            s->weights[3 + i] = s->weights[2 + i] / 8;
+
+        s->counter = 1u << GAMMA_0;
+        s->accumulator = ((3u << (ACC_INIT_K + 6)) - 49) * s->counter >> 7;
+    }
+}
+
+/* Neighbour-oriented local sum of band z at column x, from the current and previous BIP rows */
+static inline int32_t local_sum(const Coder *c, const uint16_t *prev, const uint16_t *cur, int z, int x, int y)
+{
+    int n = c->bands;
+    if (y == 0)
+        return 4 * cur[(x - 1) * n + z];
+    if (c->width == 1)
+        return 4 * prev[z];
+    if (x == 0)
+        return 2 * (prev[z] + prev[n + z]);
+    if (x == c->width - 1)
+        return cur[(x - 1) * n + z] + prev[(x - 1) * n + z] + 2 * prev[x * n + z];
+    return cur[(x - 1) * n + z] + prev[(x - 1) * n + z] + prev[x * n + z] + prev[(x + 1) * n + z];
+}
+
+/*
+ * Double resolution predicted sample of band z at (x, y). The local difference vector is
+ * written to u (directional differences, then central differences of the previous bands).
+ */
+static int32_t predict(const Coder *c, const uint16_t *prev, const uint16_t *cur, int z, int x, int y, int32_t *u)
+{
+    int n = c->bands;
+    int p = z < c->prediction_bands ? z : c->prediction_bands;
+
+    if (x == 0 && y == 0)
+        return p > 0 ? 2 * cur[z - 1] : 2 * c->s_mid;
+
+    int32_t sigma = local_sum(c, prev, cur, z, x, y);
+    if (y > 0)
+    {
+        int32_t north = prev[x * n + z];
+        u[0] = 4 * north - sigma;
+        u[1] = 4 * (x > 0 ? cur[(x - 1) * n + z] : north) - sigma;
+        u[2] = 4 * (x > 0 ? prev[(x - 1) * n + z] : north) - sigma;
+    }
+    else
+        u[0] = u[1] = u[2] = 0;
+
+    for (int i = 1; i <= p; ++i)
+        u[2 + i] = 4 * cur[x * n + z - i] - local_sum(c, prev, cur, z - i, x, y);
+
+    const int32_t *w = c->state[z].weights;
+    int64_t d = 0;
+    for (int i = 0; i < 3 + p; ++i)
+        d += (int64_t)w[i] * u[i];
+
+    int64_t scaled = ((d + ((int64_t)(sigma - 4 * c->s_mid) << OMEGA)) >> (OMEGA + 1)) + 2 * c->s_mid + 1;
+    return scaled < 0 ? 0 : (scaled > 2 * c->s_max + 1 ? 2 * c->s_max + 1 : (int32_t)scaled);
+}
+
+/* Sign algorithm weight update after coding sample t of band z */
+static void update_weights(const Coder *c, int z, const int32_t *u, int32_t error, int64_t t)
+{
+    int p = z < c->prediction_bands ? z : c->prediction_bands;
+    int rho = NU_MIN;
+    if (t >= c->width)
+    {
+        int64_t steps = NU_MIN + ((t - c->width) >> T_INC_LOG);
+        rho = steps > NU_MAX ? NU_MAX : (int)steps;
+    }
+    rho += c->bits - OMEGA;
+
+    int32_t *w = c->state[z].weights;
+    for (int i = 0; i < 3 + p; ++i)
+    {
+        int32_t v = error >= 0 ? u[i] : -u[i];
+        int32_t delta = rho > 0 ? (v + (1 << rho)) >> (rho + 1) : (v * (1 << -rho) + 1) >> 1;
+        w[i] = clip(w[i] + delta, -(1 << (OMEGA + 2)), (1 << (OMEGA + 2)) - 1);
+    }
+}
+
+/*
+ * Predict, quantize and map one row of band z of the current chunk. In near-lossless mode
+ * the sample is replaced by its reconstruction, which is what the decoder will predict from.
+ * The first sample of a band is always quantized losslessly.
+ */
+static void predict_row(Coder *c, int z, int row)
+{
+    int n = c->bands;
+    int y = c->chunk_y + row;
+    uint16_t *prev = c->samples + (size_t)row * c->width * n;
+    uint16_t *cur = prev + (size_t)c->width * n;
+    uint16_t *mapped = c->mapped + ((size_t)z * CHUNK_ROWS + row) * c->width;
+    int32_t u[3 + MAX_PREDICTION_BANDS];
+
+    for (int x = 0; x < c->width; ++x)
+    {
+        int32_t s_tilde = predict(c, prev, cur, z, x, y, u);
+        int32_t s_hat = s_tilde >> 1;
+        int32_t s = cur[x * n + z];
+        int32_t m = x > 0 || y > 0 ? c->max_error : 0;
+        int32_t step = 2 * m + 1;
+
+        int32_t q = s - s_hat;
+        if (m > 0)
+            q = q >= 0 ? (q + m) / step : -((-q + m) / step);
+        int32_t theta = m > 0
+            ? (floor_div(s_hat + m, step) < floor_div(c->s_max - s_hat + m, step)
+               ? floor_div(s_hat + m, step) : floor_div(c->s_max - s_hat + m, step))
+            : (s_hat < c->s_max - s_hat ? s_hat : c->s_max - s_hat);
+
+        int32_t magnitude = q < 0 ? -q : q;
+        int32_t signed_q = (s_tilde & 1) ? -q : q;
+        if (magnitude > theta)
+            mapped[x] = magnitude + theta;
+        else
+            mapped[x] = signed_q >= 0 ? 2 * magnitude : 2 * magnitude - 1;
+
+        if (m > 0)
+        {
+            s = clip(s_hat + q * step, 0, c->s_max);
+            cur[x * n + z] = s;
+        }
+
+        if (x > 0 || y > 0)
+            update_weights(c, z, u, 2 * s - s_tilde, (int64_t)y * c->width + x);
+    }
+}
+
+/* Band workers, started once per image. Worker w predicts bands w, w + count, ... of every chunk */
+typedef struct BandWorkers {
+    Coder *coder;
+    int count;
+    int stop;
+    pthread_barrier_t start;  /* a chunk is loaded, or the workers must stop */
+    pthread_barrier_t done;   /* all bands of the chunk are predicted */
+    pthread_t *threads;
+    struct BandJob *jobs;
+} BandWorkers;
+
+typedef struct BandJob {
+    BandWorkers *workers;
+    int first_band;
+} BandJob;
+
+static void *band_worker(void *arg)
+{
+    BandJob *job = (BandJob *)arg;
+    BandWorkers *w = job->workers;
+    for (;;)
+    {
+        pthread_barrier_wait(&w->start);
+        if (w->stop)
+            return NULL;
+        Coder *c = w->coder;
+        for (int z = job->first_band; z < c->bands; z += w->count)
+            for (int row = 0; row < c->chunk_rows; ++row)
+                predict_row(c, z, row);
+        pthread_barrier_wait(&w->done);
+    }
+}
+
+/* Start one worker per band, at most one per online CPU */
+static void start_band_workers(BandWorkers *w, Coder *c)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    w->coder = c;
+    w->count = cpus > 0 && cpus < c->bands ? (int)cpus : c->bands;
+    w->stop = 0;
+    w->threads = (pthread_t *)malloc(sizeof(pthread_t) * w->count);
+    w->jobs = (BandJob *)malloc(sizeof(BandJob) * w->count);
+    if (w->threads == NULL || w->jobs == NULL)
+        signal_error_and_exit(MALLOC_ERR);
+    if (pthread_barrier_init(&w->start, NULL, w->count + 1) != 0
+        || pthread_barrier_init(&w->done, NULL, w->count + 1) != 0)
+        signal_error_and_exit(THREAD_ERR);
+
+    for (int k = 0; k < w->count; ++k)
+    {
+        w->jobs[k] = (BandJob){w, k};
+        if (pthread_create(&w->threads[k], NULL, band_worker, &w->jobs[k]) != 0)
+            signal_error_and_exit(THREAD_ERR);
+    }
+}
+
+static void stop_band_workers(BandWorkers *w)
+{
+    w->stop = 1;
+    pthread_barrier_wait(&w->start);
+    for (int k = 0; k < w->count; ++k)
+        pthread_join(w->threads[k], NULL);
+    pthread_barrier_destroy(&w->start);
+    pthread_barrier_destroy(&w->done);
+    free(w->threads);
+    free(w->jobs);
+}
+
+/* Predict all bands of the chunk, on the band workers if there are any */
+static void predict_chunk(Coder *c, BandWorkers *workers)
+{
+    if (workers == NULL)
+    {
+        for (int row = 0; row < c->chunk_rows; ++row)
+            for (int z = 0; z < c->bands; ++z)
+                predict_row(c, z, row);
+        return;
+    }
+
+    pthread_barrier_wait(&workers->start);
+    pthread_barrier_wait(&workers->done);
+}
+
+static inline int entropy_k(const Coder *c, const BandState *s)
+{
+    uint32_t limit = s->accumulator + ((49 * s->counter) >> 7);
+    int k_max = c->bits > 2 ? c->bits - 2 : 0;
+    if (2 * s->counter > limit)
+        return 0;
+    int k = 0;
+    while (k < k_max && (s->counter << (k + 1)) <= limit)
+        k++;
+    return k;
+}
+
+static inline void update_entropy(BandState *s, uint32_t delta)
+{
+    if (s->counter < (1u << GAMMA_STAR) - 1)
+    {
+        s->accumulator += delta;
+        s->counter++;
+    }
+    else
+    {
+        s->accumulator = (s->accumulator + delta + 1) >> 1;
+        s->counter = (s->counter + 1) >> 1;
+    }
+}
+
+/* Code the mapped residuals of the chunk in BIP order with the sample-adaptive coder */
+static void encode_chunk(Coder *c, BitWriter *bw)
+{
+    int n = c->bands;
+    reserve_bytes(bw, (size_t)c->chunk_rows * c->width * n * (U_MAX + c->bits + 7) / 8);
+
+    for (int row = 0; row < c->chunk_rows; ++row)
+    {
+        for (int x = 0; x < c->width; ++x)
+            for (int z = 0; z < n; ++z)
+            {
+                uint32_t delta = c->mapped[((size_t)z * CHUNK_ROWS + row) * c->width + x];
+
+                /* The first mapped residual of every band is sent uncoded */
+                if (c->chunk_y + row == 0 && x == 0)
+                {
+                    put_bits(bw, delta, c->bits);
+                    continue;
+                }
+
+                BandState *s = &c->state[z];
+                int k = entropy_k(c, s);
+                uint32_t u = delta >> k;
+                if (u < U_MAX)
+                {
+                    put_bits(bw, 1, u + 1);
+                    if (k > 0)
+                        put_bits(bw, delta & ((1u << k) - 1), k);
+                }
+                else
+                {
+                    put_bits(bw, 0, U_MAX);
+                    put_bits(bw, delta, c->bits);
+                }
+                update_entropy(s, delta);
+            }
+    }
+}
+
+/* Load image rows [y, y + rows) from the BIP input view into the chunk sample buffer. Samples above
+   s_max would be truncated by the bits wide escape and uncoded first samples, so they are rejected. */
+static void load_chunk(Coder *c, const unsigned char *data)
+{
+    size_t row_samples = (size_t)c->width * c->bands;
+    uint16_t any = 0;
+    for (int row = 0; row < c->chunk_rows; ++row)
+    {
+        uint16_t *dst = c->samples + (row + 1) * row_samples;
+        size_t first = (size_t)(c->chunk_y + row) * row_samples;
+        if (c->bits > 8)
+        {
+            const uint16_t *src = (const uint16_t *)data + first;
+            for (size_t i = 0; i < row_samples; ++i)
+            {
+                dst[i] = src[i];
+                any |= src[i];
+            }
+        }
+        else
+            for (size_t i = 0; i < row_samples; ++i)
+            {
+                dst[i] = data[first + i];
+                any |= data[first + i];
+            }
+    }
+    if (any > c->s_max)
+        signal_error_and_exit(INVALID_INPUT);
+}
+
+static void init_coder(Coder *c, int width, int height, int bands, int bits, int prediction_bands, int max_error)
+{
+    c->width = width;
+    c->height = height;
+    c->bands = bands;
+    c->bits = bits;
+    c->prediction_bands = prediction_bands;
+    c->max_error = max_error;
+    c->s_max = (1 << bits) - 1;
+    c->s_mid = 1 << (bits - 1);
+
+    size_t row_samples = (size_t)width * bands;
+    c->state = (BandState *)malloc(sizeof(BandState) * bands);
+    c->samples = (uint16_t *)malloc(sizeof(uint16_t) * row_samples * (CHUNK_ROWS + 1));
+    c->mapped = (uint16_t *)malloc(sizeof(uint16_t) * row_samples * CHUNK_ROWS);
+    if (c->state == NULL || c->samples == NULL || c->mapped == NULL)
+        signal_error_and_exit(MALLOC_ERR);
+    init_coder_state(c);
+}
+
+static void free_coder(Coder *c)
+{
+    free(c->state);
+    free(c->samples);
+    free(c->mapped);
+}
+
+/* Number of bits of the absolute error limit, at least 1 */
+static int error_limit_bits(int max_error)
+{
+    int n = 1;
+    while ((max_error >> n) > 0)
+        n++;
+    return n;
+}
+
+/* CCSDS 123.0-B-2 header (section 5.3): image metadata, predictor metadata with the quantization
+   subpart in near-lossless mode, and sample-adaptive entropy coder metadata. Every subpart ends
+   on a byte boundary. */
+static void write_header(BitWriter *bw, const Coder *c)
+{
+    reserve_bytes(bw, 32);
+
+    /* Image metadata, essential subpart */
+    put_bits(bw, 0, 8);                              //user-defined data
+    put_bits(bw, c->width % MAX_DIMENSION, 16);
+    put_bits(bw, c->height % MAX_DIMENSION, 16);
+    put_bits(bw, c->bands % MAX_DIMENSION, 16);
+    put_bits(bw, 0, 1);                              //unsigned samples
+    put_bits(bw, 0, 1);                              //reserved
+    put_bits(bw, 0, 1);                              //dynamic range of at most 16 bits
+    put_bits(bw, c->bits % 16, 4);
+    put_bits(bw, 0, 1);                              //band-interleaved order
+    put_bits(bw, c->bands % MAX_DIMENSION, 16);      //sub-frame interleaving depth: all bands, i.e. BIP
+    put_bits(bw, 0, 2);                              //reserved
+    put_bits(bw, 1, 3);                              //output word size of 1 byte
+    put_bits(bw, 0, 2);                              //sample-adaptive entropy coder
+    put_bits(bw, 0, 1);                              //reserved
+    put_bits(bw, c->max_error > 0 ? 1 : 0, 2);       //lossless, or absolute error limit only
+    put_bits(bw, 0, 2);                              //reserved
+    put_bits(bw, 0, 4);                              //no supplementary information tables
+
+    /* Predictor metadata, primary subpart */
+    put_bits(bw, 0, 1);                              //reserved
+    put_bits(bw, 0, 1);                              //no sample representative subpart
+    put_bits(bw, c->prediction_bands, 4);
+    put_bits(bw, 0, 1);                              //full prediction mode
+    put_bits(bw, 0, 1);                              //no weight exponent offsets
+    put_bits(bw, 0, 2);                              //wide neighbour-oriented local sums
+    put_bits(bw, REGISTER_SIZE % 64, 6);
+    put_bits(bw, OMEGA - 4, 4);
+    put_bits(bw, T_INC_LOG - 4, 4);
+    put_bits(bw, NU_MIN + 6, 4);
+    put_bits(bw, NU_MAX + 6, 4);
+    put_bits(bw, 0, 1);                              //no weight exponent offset table
+    put_bits(bw, 0, 1);                              //default weight initialization
+    put_bits(bw, 0, 1);                              //no weight initialization table
+    put_bits(bw, 0, 5);                              //weight initialization resolution
+
+    /* Quantization subpart: one absolute error limit for all bands, never updated */
+    if (c->max_error > 0)
+    {
+        int limit_bits = error_limit_bits(c->max_error);
+        put_bits(bw, 0, 1);                          //reserved
+        put_bits(bw, 0, 1);                          //no periodic error limit updating
+        put_bits(bw, 0, 2);                          //reserved
+        put_bits(bw, 0, 4);                          //error limit update period exponent
+        put_bits(bw, 0, 1);                          //reserved
+        put_bits(bw, 0, 1);                          //band-independent absolute error limit
+        put_bits(bw, 0, 2);                          //reserved
+        put_bits(bw, limit_bits % 16, 4);
+        put_bits(bw, c->max_error, limit_bits);
+        flush_bits(bw);
+    }
+
+    /* Entropy coder metadata, sample-adaptive */
+    put_bits(bw, U_MAX % 32, 5);
+    put_bits(bw, GAMMA_STAR - 4, 3);
+    put_bits(bw, GAMMA_0 % 8, 3);
+    put_bits(bw, ACC_INIT_K, 4);
+    put_bits(bw, 0, 1);                              //no accumulator initialization table
+}
+
+/* Encode a BIP image, returns the size of the stream */
+static size_t c123_encode(const unsigned char *data, int width, int height, int bands, int bits, int prediction_bands,
+                          int max_error, int band_threads, uint8_t **out)
+{
+    Coder c;
+    init_coder(&c, width, height, bands, bits, prediction_bands, max_error);
+
+    BitWriter bw = {0};
+    write_header(&bw, &c);
+
+    /* Near-lossless prediction depends on the reconstructed previous bands, so it stays sequential */
+    BandWorkers workers;
+    int use_workers = band_threads && max_error == 0 && bands > 1;
+    if (use_workers)
+        start_band_workers(&workers, &c);
+
+    size_t row_bytes = sizeof(uint16_t) * width * bands;
+    for (c.chunk_y = 0; c.chunk_y < height; c.chunk_y += CHUNK_ROWS)
+    {
+        c.chunk_rows = height - c.chunk_y < CHUNK_ROWS ? height - c.chunk_y : CHUNK_ROWS;
+        load_chunk(&c, data);
+        predict_chunk(&c, use_workers ? &workers : NULL);
+        encode_chunk(&c, &bw);
+
+        /* The last (reconstructed) row is the previous row of the next chunk */
+        memcpy(c.samples, (uint8_t *)c.samples + c.chunk_rows * row_bytes, row_bytes);
+    }
+    flush_bits(&bw);
+
+    if (use_workers)
+        stop_band_workers(&workers);
+    free_coder(&c);
+    *out = bw.buf;
+    return bw.size;
+}
+
+static double elapsed_ms(const struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1e3 + (now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+/* START MODULE IMPLEMENTATION */
+void module()
+{
+    /* Get number of images in input batch */
+    int num_images = get_input_num_images();
+
+    int prediction_bands = get_param_int("prediction_bands");
+    int max_error = get_param_int("max_error");
+    int band_threads = get_param_bool("band_threads");
+
+    if (prediction_bands < 0 || prediction_bands > MAX_PREDICTION_BANDS || max_error < 0 || max_error > 0xffff)
+        signal_error_and_exit(INVALID_PARAM);
+
+    for (int i = 0; i < num_images; ++i)
+    {
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        Metadata *input_meta = get_metadata(i);
+        int width = input_meta->width;
+        int height = input_meta->height;
+        int bands = input_meta->channels;
+        int bits = input_meta->bits_pixel;
+
+        if (width <= 0 || height <= 0 || bands <= 0 || bits < 2 || bits > 16
+            || width > MAX_DIMENSION || height > MAX_DIMENSION || bands > MAX_DIMENSION)
+            signal_error_and_exit(INVALID_INPUT);
+
+        /* The absolute error limit is coded on at most bits - 1 bits */
+        if (max_error >= 1 << (bits - 1))
+            signal_error_and_exit(INVALID_PARAM);
+
+        const unsigned char *input_image_data;
+        size_t size = get_image_view(i, &input_image_data);
+        if (size != (size_t)width * height * bands * (bits > 8 ? 2 : 1))
+            signal_error_and_exit(INVALID_INPUT);
+
+        uint8_t *output_buffer;
+        size_t enc_size = c123_encode(input_image_data, width, height, bands, bits, prediction_bands, max_error,
+                                      band_threads, &output_buffer);
+
+        /* Create image metadata before appending */
+        Metadata new_meta = METADATA__INIT;
+        new_meta.size = enc_size;
+        new_meta.width = width;
+        new_meta.height = height;
+        new_meta.channels = bands;
+        new_meta.timestamp = input_meta->timestamp;
+        new_meta.bits_pixel = bits;
+        new_meta.camera = input_meta->camera;
+        new_meta.obid = input_meta->obid;
+        add_custom_metadata_string(&new_meta, "enc", "ccsds123");
+        add_custom_metadata_float(&new_meta, "encode_ms", elapsed_ms(&start));
+
+        /* Append the image to the result batch */
+        append_result_image(output_buffer, enc_size, &new_meta);
+
+        /* Remember to free any allocated memory */
+        free(output_buffer);
+    }
+}
+/* END MODULE IMPLEMENTATION */
+
+/* Main function of module (NO NEED TO MODIFY) */
+ImageBatch run(ImageBatch *input_batch, ModuleParameterList *module_parameter_list, int *ipc_error_pipe)
+{
+    ImageBatch result_batch;
+    result = &result_batch;
+    input = input_batch;
+    config = module_parameter_list;
+    error_pipe = ipc_error_pipe;
+    initialize();
+
+    module();
+
+    finalize();
+
+    return result_batch;
+}
+
+#ifdef TESTING_MODULE_STANDALONE
+
+typedef struct BitReader {
+    const uint8_t *buf;
+    size_t size;
+    size_t pos;
+    uint64_t acc;
+    int nbits;
+} BitReader;
+
+static uint32_t get_bits(BitReader *br, int n)
+{
+    while (br->nbits < n)
+    {
+        uint8_t byte = br->pos < br->size ? br->buf[br->pos] : 0;
+        br->pos++;
+        br->acc = (br->acc << 8) | byte;
+        br->nbits += 8;
+    }
+    br->nbits -= n;
+    return (uint32_t)(br->acc >> br->nbits) & (uint32_t)((1ull << n) - 1);
+}
+
+/* Read the header fields written by write_header, returns -1 for anything else */
+static int read_header(BitReader *br, int *width, int *height, int *bands, int *bits, int *prediction_bands, int *max_error)
+{
+    get_bits(br, 8);
+    *width = get_bits(br, 16);
+    *height = get_bits(br, 16);
+    *bands = get_bits(br, 16);
+    *width = *width == 0 ? MAX_DIMENSION : *width;
+    *height = *height == 0 ? MAX_DIMENSION : *height;
+    *bands = *bands == 0 ? MAX_DIMENSION : *bands;
+    int sample_type = get_bits(br, 2);
+    int large_range = get_bits(br, 1);
+    *bits = get_bits(br, 4);
+    *bits = *bits == 0 ? 16 : *bits;
+    int bsq = get_bits(br, 1);
+    int depth = get_bits(br, 16);
+    get_bits(br, 2);
+    int word_size = get_bits(br, 3);
+    int coder_type = get_bits(br, 2);
+    get_bits(br, 1);
+    int fidelity = get_bits(br, 2);
+    get_bits(br, 2);
+    int tables = get_bits(br, 4);
+    if (sample_type != 0 || large_range || *bits < 2 || bsq || depth != *bands % MAX_DIMENSION || word_size != 1
+        || coder_type != 0 || fidelity > 1 || tables != 0)
+        return -1;
+
+    int representative = get_bits(br, 2);
+    *prediction_bands = get_bits(br, 4);
+    int reduced = get_bits(br, 1);
+    int exponent_offsets = get_bits(br, 1);
+    int local_sums = get_bits(br, 2);
+    int register_size = get_bits(br, 6);
+    int omega = get_bits(br, 4) + 4;
+    int t_inc_log = get_bits(br, 4) + 4;
+    int nu_min = (int)get_bits(br, 4) - 6;
+    int nu_max = (int)get_bits(br, 4) - 6;
+    int weight_tables = get_bits(br, 8);
+    if (representative || *prediction_bands > MAX_PREDICTION_BANDS || reduced || exponent_offsets || local_sums
+        || register_size != REGISTER_SIZE % 64 || omega != OMEGA || t_inc_log != T_INC_LOG || nu_min != NU_MIN
+        || nu_max != NU_MAX || weight_tables)
+        return -1;
+
+    *max_error = 0;
+    if (fidelity == 1)
+    {
+        int periodic = get_bits(br, 8);
+        int assignment = get_bits(br, 4);
+        int limit_bits = get_bits(br, 4);
+        limit_bits = limit_bits == 0 ? 16 : limit_bits;
+        *max_error = get_bits(br, limit_bits);
+        br->nbits -= br->nbits % 8;
+        if (periodic || assignment || *max_error == 0)
+            return -1;
+    }
+
+    int u_max = get_bits(br, 5);
+    int gamma_star = get_bits(br, 3) + 4;
+    int gamma_0 = get_bits(br, 3);
+    int acc_init_k = get_bits(br, 4);
+    int acc_table = get_bits(br, 1);
+    if (u_max != U_MAX || gamma_star != GAMMA_STAR || gamma_0 != GAMMA_0 || acc_init_k != ACC_INIT_K || acc_table)
+        return -1;
+    return 0;
+}
+
+/* Decode a stream produced by c123_encode sample by sample in BIP order. Returns the number of bytes written, 0 on error. */
+static size_t c123_decode(const uint8_t *stream, size_t size, unsigned char **out, int *width_out, int *height_out, int *bands_out)
+{
+    BitReader br = {stream, size, 0, 0, 0};
+    int width, height, bands, bits, prediction_bands, max_error;
+    if (read_header(&br, &width, &height, &bands, &bits, &prediction_bands, &max_error) != 0)
+        return 0;
+
+    Coder c;
+    init_coder(&c, width, height, bands, bits, prediction_bands, max_error);
+
+    size_t row_samples = (size_t)width * bands;
+    size_t out_size = row_samples * height * (bits > 8 ? 2 : 1);
+    *out = (unsigned char *)malloc(out_size);
+    if (*out == NULL)
+        signal_error_and_exit(MALLOC_ERR);
+
+    uint16_t *prev = c.samples;
+    uint16_t *cur = c.samples + row_samples;
+    int32_t u[3 + MAX_PREDICTION_BANDS];
+
+    for (int y = 0; y < height; ++y)
+    {
+        for (int x = 0; x < width; ++x)
+            for (int z = 0; z < bands; ++z)
+            {
+                int first = y == 0 && x == 0;
+                uint32_t delta;
+                if (first)
+                {
+                    delta = get_bits(&br, bits);
+                }
+                else
+                {
+                    BandState *s = &c.state[z];
+                    int k = entropy_k(&c, s);
+                    uint32_t q_u = 0;
+                    while (q_u < U_MAX && !get_bits(&br, 1))
+                        q_u++;
+                    delta = q_u < U_MAX ? (q_u << k) | (k > 0 ? get_bits(&br, k) : 0) : get_bits(&br, bits);
+                    update_entropy(s, delta);
+                }
+
+                int32_t m = first ? 0 : c.max_error;
+                int32_t step = 2 * m + 1;
+                int32_t s_tilde = predict(&c, prev, cur, z, x, y, u);
+                int32_t s_hat = s_tilde >> 1;
+                int32_t theta_low = m > 0 ? floor_div(s_hat + m, step) : s_hat;
+                int32_t theta_high = m > 0 ? floor_div(c.s_max - s_hat + m, step) : c.s_max - s_hat;
+                int32_t theta = theta_low < theta_high ? theta_low : theta_high;
+
+                int32_t q;
+                if ((int32_t)delta > 2 * theta)
+                    q = theta == theta_low ? (int32_t)delta - theta : -((int32_t)delta - theta);
+                else
+                {
+                    int32_t signed_q = (delta & 1) ? -(int32_t)((delta + 1) >> 1) : (int32_t)(delta >> 1);
+                    q = (s_tilde & 1) ? -signed_q : signed_q;
+                }
+
+                int32_t sample = clip(s_hat + q * step, 0, c.s_max);
+                cur[x * bands + z] = sample;
+                if (!first)
+                    update_weights(&c, z, u, 2 * sample - s_tilde, (int64_t)y * width + x);
+            }
+
+        if (bits > 8)
+            memcpy((uint16_t *)*out + y * row_samples, cur, row_samples * sizeof(uint16_t));
+        else
+            for (size_t i = 0; i < row_samples; ++i)
+                (*out)[y * row_samples + i] = (unsigned char)cur[i];
+
+        uint16_t *tmp = prev;
+        prev = cur;
+        cur = tmp;
+    }
+
+    free_coder(&c);
+    *width_out = width;
+    *height_out = height;
+    *bands_out = bands;
+    return out_size;
+}
+
+/* Host-side round trip: lossless must decode bit-exact, near-lossless within max_error, with and without band threads */
+int main(int argc, char **argv)
+{
+    if (argc != 8)
+    {
+        printf("Usage: %s <raw_image_file> <width> <height> <bands> <bits> <prediction_bands> <max_error>\n", argv[0]);
+        return 1;
+    }
+
+    int width = atoi(argv[2]);
+    int height = atoi(argv[3]);
+    int bands = atoi(argv[4]);
+    int bits = atoi(argv[5]);
+    int prediction_bands = atoi(argv[6]);
+    int max_error = atoi(argv[7]);
+    size_t samples = (size_t)width * height * bands;
+    size_t image_size = samples * (bits > 8 ? 2 : 1);
+
+    FILE *f = fopen(argv[1], "rb");
+    if (!f)
+    {
+        perror("Error opening input file");
+        return 1;
+    }
+
+    unsigned char *image_data = malloc(image_size);
+    if (!image_data || fread(image_data, 1, image_size, f) != image_size)
+    {
+        printf("Error: could not read %zu bytes\n", image_size);
+        fclose(f);
+        return 1;
+    }
+    fclose(f);
+
+    /* Samples above the nominal bit depth are outside the coder's dynamic range */
+    if (bits > 8)
+        for (size_t i = 0; i < samples; ++i)
+            ((uint16_t *)image_data)[i] &= (1 << bits) - 1;
+
+    int failed = 0;
+    for (int band_threads = 0; band_threads <= 1; ++band_threads)
+    {
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        uint8_t *stream;
+        size_t stream_size = c123_encode(image_data, width, height, bands, bits, prediction_bands, max_error, band_threads, &stream);
+        double encode_ms = elapsed_ms(&start);
+
+        unsigned char *decoded = NULL;
+        int dec_width, dec_height, dec_bands;
+        size_t decoded_size = c123_decode(stream, stream_size, &decoded, &dec_width, &dec_height, &dec_bands);
+
+        int worst = decoded_size == image_size ? 0 : -1;
+        for (size_t i = 0; i < samples && worst >= 0; ++i)
+        {
+            int a = bits > 8 ? ((uint16_t *)image_data)[i] : image_data[i];
+            int b = bits > 8 ? ((uint16_t *)decoded)[i] : decoded[i];
+            int d = a > b ? a - b : b - a;
+            worst = d > worst ? d : worst;
+        }
+
+        int ok = worst >= 0 && worst <= max_error;
+        printf("band_threads %d: %zu -> %zu bytes (%.2f bits/sample), max error %d, encode %.1f MB/s, %s\n",
+               band_threads, image_size, stream_size, 8.0 * stream_size / samples, worst,
+               image_size / encode_ms / 1e3, ok ? (max_error == 0 ? "bit-exact" : "ok") : "MISMATCH");
+        failed |= !ok;
+
+        free(stream);
+        free(decoded);
+    }
+
+    free(image_data);
+    return failed;
+}
+
+#endif
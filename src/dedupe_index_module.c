@@ -0,0 +1,442 @@
+#include "module.h"
+#include "util.h"
+#include "phash.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* Define custom error codes */
+enum ERROR_CODE {
+    MALLOC_ERR = 1,
+    INVALID_INPUT = 2,
+    INVALID_PARAM = 3,
+    INDEX_OPEN_ERR = 4,
+    INDEX_FORMAT_ERR = 5,
+    INDEX_SYNC_ERR = 6,
+};
+
+/*
+ * On-disk index of the perceptual hashes of frames that were passed on before.
+ *
+ * The file has a fixed size for a given capacity and is memory mapped:
+ *   header (64 bytes) | chunk tables (4 x 65536 chain heads, u32) | entries (capacity x 32 bytes)
+ *
+ * Multi-index hashing: the 64-bit hash is split into four 16-bit chunks, each with its own
+ * table of chains. Two hashes within distance d have at least one chunk within d / 4, so a
+ * lookup only probes the chunk values within that radius of the query chunks.
+ *
+ * Entries are only ever appended, and chains always point to older (lower) entries. The
+ * committed count in the header is written and synced after the entries and chain heads.
+ * After a crash the uncommitted entries may not have reached the file even where a chain
+ * head pointing to them did, so on open the chains are rebuilt from the committed entries.
+ */
+#define INDEX_MAGIC "DIDX"
+#define INDEX_VERSION 1
+#define INDEX_CHUNKS 4
+#define INDEX_CHUNK_BITS 16
+#define INDEX_TABLE_SIZE (1 << INDEX_CHUNK_BITS)
+#define INDEX_END 0xFFFFFFFFu
+/* Largest supported max_distance, probes per chunk grow quickly with the chunk radius */
+#define INDEX_MAX_DISTANCE 15
+
+typedef struct IndexHeader {
+    char magic[4];
+    uint8_t version;
+    uint8_t hash_type;
+    uint8_t reserved[2];
+    uint32_t capacity;
+    uint32_t count;
+    uint8_t padding[48];
+} IndexHeader;
+
+typedef struct IndexEntry {
+    uint64_t hash;
+    int32_t timestamp;
+    uint32_t next[INDEX_CHUNKS];
+    uint32_t reserved;
+} IndexEntry;
+
+typedef struct DedupeIndex {
+    int fd;
+    size_t map_size;
+    unsigned char *map;
+    IndexHeader *header;
+    uint32_t *heads;
+    IndexEntry *entries;
+    /* Entries written so far, header->count only advances when they are committed */
+    uint32_t num_entries;
+} DedupeIndex;
+
+static size_t index_file_size(uint32_t capacity)
+{
+    return sizeof(IndexHeader) + sizeof(uint32_t) * INDEX_CHUNKS * INDEX_TABLE_SIZE + sizeof(IndexEntry) * (size_t)capacity;
+}
+
+static inline uint16_t hash_chunk(uint64_t hash, int chunk)
+{
+    return (uint16_t)(hash >> (chunk * INDEX_CHUNK_BITS));
+}
+
+static void map_index(DedupeIndex *index, size_t size)
+{
+    index->map = (unsigned char *)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, index->fd, 0);
+    if (index->map == MAP_FAILED)
+        signal_error_and_exit(INDEX_OPEN_ERR);
+    index->map_size = size;
+    index->header = (IndexHeader *)index->map;
+    index->heads = (uint32_t *)(index->map + sizeof(IndexHeader));
+    index->entries = (IndexEntry *)(index->heads + INDEX_CHUNKS * INDEX_TABLE_SIZE);
+}
+
+static void close_index(DedupeIndex *index)
+{
+    munmap(index->map, index->map_size);
+    close(index->fd);
+}
+
+/* Create an empty index file of the given capacity, replacing any file at path */
+static void create_index(DedupeIndex *index, const char *path, uint32_t capacity, int hash_type)
+{
+    index->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (index->fd < 0)
+        signal_error_and_exit(INDEX_OPEN_ERR);
+    size_t size = index_file_size(capacity);
+    if (ftruncate(index->fd, size) != 0)
+        signal_error_and_exit(INDEX_OPEN_ERR);
+    map_index(index, size);
+
+    memset(index->heads, 0xFF, sizeof(uint32_t) * INDEX_CHUNKS * INDEX_TABLE_SIZE);
+    memcpy(index->header->magic, INDEX_MAGIC, 4);
+    index->header->version = INDEX_VERSION;
+    index->header->hash_type = hash_type;
+    index->header->capacity = capacity;
+    index->header->count = 0;
+    index->num_entries = 0;
+}
+
+/* Push entry e onto the chains of its chunks */
+static void link_entry(DedupeIndex *index, uint32_t e)
+{
+    IndexEntry *entry = &index->entries[e];
+    for (int c = 0; c < INDEX_CHUNKS; ++c)
+    {
+        uint32_t *head = &index->heads[c * INDEX_TABLE_SIZE + hash_chunk(entry->hash, c)];
+        entry->next[c] = *head;
+        *head = e;
+    }
+}
+
+/* Rebuild every chain from the entries below num_entries, oldest first */
+static void rebuild_chains(DedupeIndex *index)
+{
+    memset(index->heads, 0xFF, sizeof(uint32_t) * INDEX_CHUNKS * INDEX_TABLE_SIZE);
+    for (uint32_t e = 0; e < index->num_entries; ++e)
+        link_entry(index, e);
+}
+
+/* Open an existing index file, returns 0 if there is none */
+static int open_index(DedupeIndex *index, const char *path)
+{
+    index->fd = open(path, O_RDWR);
+    if (index->fd < 0)
+        return 0;
+
+    struct stat st;
+    IndexHeader header;
+    if (fstat(index->fd, &st) != 0 || pread(index->fd, &header, sizeof(header), 0) != sizeof(header)
+        || memcmp(header.magic, INDEX_MAGIC, 4) != 0 || header.version != INDEX_VERSION
+        || header.count > header.capacity || (size_t)st.st_size != index_file_size(header.capacity))
+        signal_error_and_exit(INDEX_FORMAT_ERR);
+    map_index(index, st.st_size);
+    index->num_entries = index->header->count;
+
+    /* A head past the count points to an entry that was never committed, whose links may be
+       zeros or stale: the committed entries were synced before the count, so rebuild from them */
+    for (int t = 0; t < INDEX_CHUNKS * INDEX_TABLE_SIZE; ++t)
+        if (index->heads[t] != INDEX_END && index->heads[t] >= index->num_entries)
+        {
+            rebuild_chains(index);
+            break;
+        }
+    return 1;
+}
+
+static void insert_entry(DedupeIndex *index, uint64_t hash, int32_t timestamp)
+{
+    uint32_t e = index->num_entries++;
+    IndexEntry *entry = &index->entries[e];
+    entry->hash = hash;
+    entry->timestamp = timestamp;
+    entry->reserved = 0;
+    link_entry(index, e);
+}
+
+/* Make the entries written so far durable, then publish them with the header count */
+static void commit_index(DedupeIndex *index)
+{
+    if (index->header->count == index->num_entries)
+        return;
+    if (msync(index->map, index->map_size, MS_SYNC) != 0)
+        signal_error_and_exit(INDEX_SYNC_ERR);
+    index->header->count = index->num_entries;
+    if (msync(index->map, sizeof(IndexHeader), MS_SYNC) != 0)
+        signal_error_and_exit(INDEX_SYNC_ERR);
+}
+
+/* Rewrite the index with only its newest keep entries at the given capacity. The new file is
+   written next to the old one and renamed over it, so a crash leaves one of the two intact. */
+static void compact_index(DedupeIndex *index, const char *path, uint32_t capacity, uint32_t keep, int hash_type)
+{
+    char tmp_path[4096];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+    DedupeIndex compacted;
+    create_index(&compacted, tmp_path, capacity, hash_type);
+    uint32_t first = index->num_entries > keep ? index->num_entries - keep : 0;
+    for (uint32_t e = first; e < index->num_entries; ++e)
+        insert_entry(&compacted, index->entries[e].hash, index->entries[e].timestamp);
+    commit_index(&compacted);
+    if (fsync(compacted.fd) != 0 || rename(tmp_path, path) != 0)
+        signal_error_and_exit(INDEX_SYNC_ERR);
+
+    close_index(index);
+    *index = compacted;
+}
+
+static void search_chain(DedupeIndex *index, int chunk, uint16_t key, uint64_t hash, int *best, int *best_distance)
+{
+    uint32_t e = index->heads[chunk * INDEX_TABLE_SIZE + key];
+    while (e != INDEX_END && e < index->num_entries)
+    {
+        int distance = hash_distance(hash, index->entries[e].hash);
+        if (distance < *best_distance)
+        {
+            *best_distance = distance;
+            *best = e;
+        }
+        uint32_t next = index->entries[e].next[chunk];
+        /* Chains only point to older entries, anything else is a damaged file */
+        if (next != INDEX_END && next >= e)
+            break;
+        e = next;
+    }
+}
+
+/* Visit every chunk value within radius bits of key, flipping bits from start upwards */
+static void probe_chunk(DedupeIndex *index, int chunk, uint16_t key, int radius, int start, uint64_t hash,
+                        int *best, int *best_distance)
+{
+    search_chain(index, chunk, key, hash, best, best_distance);
+    if (radius == 0)
+        return;
+    for (int b = start; b < INDEX_CHUNK_BITS; ++b)
+        probe_chunk(index, chunk, key ^ (uint16_t)(1u << b), radius - 1, b + 1, hash, best, best_distance);
+}
+
+/* Closest indexed entry within max_distance, -1 if there is none */
+static int lookup_index(DedupeIndex *index, uint64_t hash, int max_distance, int *distance)
+{
+    int best = -1;
+    *distance = max_distance + 1;
+    for (int c = 0; c < INDEX_CHUNKS; ++c)
+        probe_chunk(index, c, hash_chunk(hash, c), max_distance / INDEX_CHUNKS, 0, hash, &best, distance);
+    return best;
+}
+
+static PerceptualHashType parse_hash_type(const char *name)
+{
+    if (strcmp(name, "dhash") == 0)
+        return HASH_DHASH;
+    if (strcmp(name, "phash") == 0)
+        return HASH_PHASH;
+    signal_error_and_exit(INVALID_PARAM);
+    return HASH_DHASH;
+}
+
+/* START MODULE IMPLEMENTATION */
+void module()
+{
+    /* Get number of images in input batch */
+    int num_images = get_input_num_images();
+
+    const char *index_path = get_param_string("index_path");
+    int capacity = get_param_int("index_capacity");
+    PerceptualHashType hash_type = parse_hash_type(get_param_string("hash_type"));
+    int max_distance = get_param_int("max_distance");
+    int drop_repeats = get_param_bool("drop_repeats");
+    if (index_path[0] == '\0' || capacity < 2 || max_distance < 0 || max_distance > INDEX_MAX_DISTANCE)
+        signal_error_and_exit(INVALID_PARAM);
+
+    DedupeIndex index;
+    if (!open_index(&index, index_path))
+    {
+        create_index(&index, index_path, capacity, hash_type);
+        commit_index(&index);
+    }
+    else if (index.header->hash_type != hash_type)
+        signal_error_and_exit(INDEX_FORMAT_ERR);
+    else if (index.header->capacity != (uint32_t)capacity)
+        compact_index(&index, index_path, capacity, capacity, hash_type);
+
+    for (int i = 0; i < num_images; ++i)
+    {
+        Metadata *input_meta = get_metadata(i);
+        int bytes_per_sample = input_meta->bits_pixel > 8 ? 2 : 1;
+        if (input_meta->width <= 0 || input_meta->height <= 0 || input_meta->channels <= 0
+            || input_meta->bits_pixel < 1 || input_meta->bits_pixel > 16)
+            signal_error_and_exit(INVALID_INPUT);
+
+        const unsigned char *input_image_data;
+        size_t size = get_image_view(i, &input_image_data);
+        if (size != (size_t)input_meta->width * input_meta->height * input_meta->channels * bytes_per_sample)
+            signal_error_and_exit(INVALID_INPUT);
+
+        uint64_t hash = compute_perceptual_hash(input_image_data, input_meta->width, input_meta->height,
+                                                input_meta->channels, input_meta->bits_pixel, hash_type);
+        int distance;
+        int match = lookup_index(&index, hash, max_distance, &distance);
+
+        if (match >= 0 && drop_repeats)
+            continue;
+
+        /* Only new scenes are indexed, a full index keeps its newest half */
+        if (match < 0)
+        {
+            if (index.num_entries == index.header->capacity)
+            {
+                commit_index(&index);
+                compact_index(&index, index_path, capacity, capacity / 2, hash_type);
+            }
+            insert_entry(&index, hash, input_meta->timestamp);
+        }
+
+        /* Create image metadata before appending */
+        Metadata new_meta = METADATA__INIT;
+        new_meta.size = size;
+        new_meta.width = input_meta->width;
+        new_meta.height = input_meta->height;
+        new_meta.channels = input_meta->channels;
+        new_meta.timestamp = input_meta->timestamp;
+        new_meta.bits_pixel = input_meta->bits_pixel;
+        new_meta.camera = input_meta->camera;
+        new_meta.obid = input_meta->obid;
+        if (match >= 0)
+        {
+            add_custom_metadata_int(&new_meta, "repeat_of", index.entries[match].timestamp);
+            add_custom_metadata_int(&new_meta, "repeat_distance", distance);
+        }
+        copy_custom_metadata(&new_meta, input_meta, NULL);
+
+        /* Append the image to the result batch */
+        append_result_image((unsigned char *)input_image_data, size, &new_meta);
+    }
+
+    commit_index(&index);
+    close_index(&index);
+}
+/* END MODULE IMPLEMENTATION */
+
+/* Main function of module (NO NEED TO MODIFY) */
+ImageBatch run(ImageBatch *input_batch, ModuleParameterList *module_parameter_list, int *ipc_error_pipe)
+{
+    ImageBatch result_batch;
+    result = &result_batch;
+    input = input_batch;
+    config = module_parameter_list;
+    error_pipe = ipc_error_pipe;
+    initialize();
+
+    module();
+
+    finalize();
+
+    return result_batch;
+}
+
+#ifdef TESTING_MODULE_STANDALONE
+
+static uint64_t random_hash(void)
+{
+    return ((uint64_t)rand() << 62) ^ ((uint64_t)rand() << 31) ^ (uint64_t)rand();
+}
+
+static uint64_t flip_bits(uint64_t hash, int count)
+{
+    for (int k = 0; k < count; ++k)
+        hash ^= 1ull << (rand() % 64);
+    return hash;
+}
+
+/* Host-side check: lookups against a brute force scan, reopening, uncommitted entries and compaction */
+int main(int argc, char **argv)
+{
+    if (argc != 2)
+    {
+        printf("Usage: %s <index_file>\n", argv[0]);
+        return 1;
+    }
+    const char *path = argv[1];
+    const uint32_t capacity = 4096;
+    const int max_distance = 10;
+    int failures = 0;
+    unlink(path);
+
+    DedupeIndex index;
+    create_index(&index, path, capacity, HASH_PHASH);
+    uint64_t *hashes = malloc(sizeof(uint64_t) * capacity);
+    for (uint32_t e = 0; e < 3000; ++e)
+    {
+        hashes[e] = random_hash();
+        insert_entry(&index, hashes[e], e);
+    }
+    commit_index(&index);
+
+    for (int q = 0; q < 2000; ++q)
+    {
+        uint64_t query = q % 2 ? random_hash() : flip_bits(hashes[rand() % 3000], rand() % (max_distance + 4));
+        int expected = max_distance + 1;
+        for (uint32_t e = 0; e < 3000; ++e)
+            if (hash_distance(query, hashes[e]) < expected)
+                expected = hash_distance(query, hashes[e]);
+        int distance;
+        lookup_index(&index, query, max_distance, &distance);
+        failures += distance != expected;
+    }
+    printf("lookups: %s\n", failures == 0 ? "match brute force" : "MISMATCH");
+
+    /* Entries written after the last commit must be gone after reopening */
+    insert_entry(&index, ~hashes[0], -1);
+    close_index(&index);
+    open_index(&index, path);
+    int distance;
+    int reopened = index.num_entries == 3000 && lookup_index(&index, hashes[1234], 0, &distance) == 1234
+                   && lookup_index(&index, ~hashes[0], 0, &distance) < 0;
+    printf("reopen: %s\n", reopened ? "ok" : "FAILED");
+    failures += !reopened;
+
+    /* A crash where the chain heads reached the file but the uncommitted entry did not: the entry
+       reads as zeros, and every committed entry on its chains must still be found */
+    insert_entry(&index, hashes[1234], -1);
+    memset(&index.entries[3000], 0, sizeof(IndexEntry));
+    close_index(&index);
+    open_index(&index, path);
+    int recovered = index.num_entries == 3000;
+    for (uint32_t e = 0; e < 3000; ++e)
+        recovered &= lookup_index(&index, hashes[e], 0, &distance) >= 0 && distance == 0;
+    recovered &= lookup_index(&index, hashes[1234], 0, &distance) == 1234;
+    printf("lost entry: %s\n", recovered ? "ok" : "FAILED");
+    failures += !recovered;
+
+    compact_index(&index, path, capacity, 1000, HASH_PHASH);
+    int compacted = index.num_entries == 1000 && lookup_index(&index, hashes[2999], 0, &distance) == 999
+                    && lookup_index(&index, hashes[0], 0, &distance) < 0;
+    printf("compact: %s, file %zu bytes\n", compacted ? "ok" : "FAILED", index.map_size);
+    failures += !compacted;
+
+    close_index(&index);
+    free(hashes);
+    return failures != 0;
+}
+
+#endif
@@ -0,0 +1,142 @@
+#include "module.h"
+#include "util.h"
+#include "phash.h"
+#include <inttypes.h>
+
+/* Define custom error codes */
+enum ERROR_CODE {
+    MALLOC_ERR = 1,
+    INVALID_INPUT = 2,
+    INVALID_PARAM = 3,
+};
+
+static PerceptualHashType parse_hash_type(const char *name)
+{
+    if (strcmp(name, "dhash") == 0)
+        return HASH_DHASH;
+    if (strcmp(name, "phash") == 0)
+        return HASH_PHASH;
+    signal_error_and_exit(INVALID_PARAM);
+    return HASH_DHASH;
+}
+
+/* Sharpness from the quality gate module if it ran earlier in the pipeline, otherwise all frames are equal */
+static float frame_sharpness(Metadata *meta)
+{
+    return has_custom_metadata(meta, "quality_sharpness") ? get_custom_metadata_float(meta, "quality_sharpness") : 0.0f;
+}
+
+/* START MODULE IMPLEMENTATION */
+void module()
+{
+    /* Get number of images in input batch */
+    int num_images = get_input_num_images();
+
+    PerceptualHashType hash_type = parse_hash_type(get_param_string("hash_type"));
+    int max_distance = get_param_int("max_distance");
+    int drop_duplicates = get_param_bool("drop_duplicates");
+    if (max_distance < 0 || max_distance > 64)
+        signal_error_and_exit(INVALID_PARAM);
+    if (num_images <= 0)
+        return;
+
+    uint64_t *hashes = (uint64_t *)malloc(sizeof(uint64_t) * num_images);
+    int *cluster = (int *)malloc(sizeof(int) * num_images);
+    /* Hash of the first frame of each cluster, every frame is compared against these */
+    uint64_t *leaders = (uint64_t *)malloc(sizeof(uint64_t) * num_images);
+    int *representative = (int *)malloc(sizeof(int) * num_images);
+    if (hashes == NULL || cluster == NULL || leaders == NULL || representative == NULL)
+        signal_error_and_exit(MALLOC_ERR);
+
+    int num_clusters = 0;
+    for (int i = 0; i < num_images; ++i)
+    {
+        Metadata *input_meta = get_metadata(i);
+        int bytes_per_sample = input_meta->bits_pixel > 8 ? 2 : 1;
+        if (input_meta->width <= 0 || input_meta->height <= 0 || input_meta->channels <= 0
+            || input_meta->bits_pixel < 1 || input_meta->bits_pixel > 16)
+            signal_error_and_exit(INVALID_INPUT);
+
+        const unsigned char *input_image_data;
+        size_t size = get_image_view(i, &input_image_data);
+        if (size != (size_t)input_meta->width * input_meta->height * input_meta->channels * bytes_per_sample)
+            signal_error_and_exit(INVALID_INPUT);
+
+        hashes[i] = compute_perceptual_hash(input_image_data, input_meta->width, input_meta->height,
+                                            input_meta->channels, input_meta->bits_pixel, hash_type);
+
+        int distance;
+        int nearest = nearest_hash(hashes[i], leaders, num_clusters, &distance);
+        if (nearest >= 0 && distance <= max_distance)
+        {
+            cluster[i] = nearest;
+            if (frame_sharpness(input_meta) > frame_sharpness(get_metadata(representative[nearest])))
+                representative[nearest] = i;
+        }
+        else
+        {
+            leaders[num_clusters] = hashes[i];
+            representative[num_clusters] = i;
+            cluster[i] = num_clusters++;
+        }
+    }
+
+    for (int i = 0; i < num_images; ++i)
+    {
+        int rep = representative[cluster[i]];
+        if (rep != i && drop_duplicates)
+            continue;
+
+        Metadata *input_meta = get_metadata(i);
+        const unsigned char *input_image_data;
+        size_t size = get_image_view(i, &input_image_data);
+
+        char hash_hex[17];
+        snprintf(hash_hex, sizeof(hash_hex), "%016" PRIx64, hashes[i]);
+
+        /* Create image metadata before appending */
+        Metadata new_meta = METADATA__INIT;
+        new_meta.size = size;
+        new_meta.width = input_meta->width;
+        new_meta.height = input_meta->height;
+        new_meta.channels = input_meta->channels;
+        new_meta.timestamp = input_meta->timestamp;
+        new_meta.bits_pixel = input_meta->bits_pixel;
+        new_meta.camera = input_meta->camera;
+        new_meta.obid = input_meta->obid;
+        add_custom_metadata_string(&new_meta, "phash", hash_hex);
+        if (rep != i)
+        {
+            add_custom_metadata_int(&new_meta, "duplicate_of", get_metadata(rep)->timestamp);
+            add_custom_metadata_int(&new_meta, "duplicate_distance", hash_distance(hashes[i], hashes[rep]));
+        }
+        copy_custom_metadata(&new_meta, input_meta, NULL);
+
+        /* Append the image to the result batch */
+        append_result_image((unsigned char *)input_image_data, size, &new_meta);
+    }
+
+    /* Remember to free any allocated memory */
+    free(hashes);
+    free(cluster);
+    free(leaders);
+    free(representative);
+}
+/* END MODULE IMPLEMENTATION */
+
+/* Main function of module (NO NEED TO MODIFY) */
+ImageBatch run(ImageBatch *input_batch, ModuleParameterList *module_parameter_list, int *ipc_error_pipe)
+{
+    ImageBatch result_batch;
+    result = &result_batch;
+    input = input_batch;
+    config = module_parameter_list;
+    error_pipe = ipc_error_pipe;
+    initialize();
+
+    module();
+
+    finalize();
+
+    return result_batch;
+}
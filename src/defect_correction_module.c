@@ -0,0 +1,311 @@
+#include "module.h"
+#include "util.h"
+#include "defect_map.h"
+
+/* Define custom error codes */
+enum ERROR_CODE {
+    MALLOC_ERR = 1,
+    INVALID_INPUT = 2,
+    INVALID_PARAM = 3,
+    DEFECT_MAP_ERR = 4,
+};
+
+/* Hits saturate here, so a pixel that heals leaves the map after at most this many updates */
+#define DEFECT_MAX_HITS 8
+/* A detection round with more candidates than this fraction of the frame is a busy scene, not defects */
+#define DEFECT_MAX_FRACTION 0.001
+
+static inline uint32_t get_sample(const unsigned char *data, int wide, size_t index)
+{
+    return wide ? ((const uint16_t *)data)[index] : data[index];
+}
+
+static inline void set_sample(unsigned char *data, int wide, size_t index, uint32_t value)
+{
+    if (wide)
+        ((uint16_t *)data)[index] = (uint16_t)value;
+    else
+        data[index] = (unsigned char)value;
+}
+
+/*
+ * Find pixels that differ from their four same-colour neighbours by more than threshold.
+ * Edges in the scene are found too, but they move from batch to batch, while a defect is found every
+ * time, so only entries that keep their hits over several updates are corrected.
+ * Returns the number of candidates written to *out, sorted by position.
+ */
+static uint32_t detect_defects(const unsigned char *data, int width, int height, int bits, int step,
+                               float threshold, DefectEntry **out)
+{
+    int wide = bits > 8;
+    int32_t limit = (int32_t)(threshold * ((1u << bits) - 1));
+    uint32_t max_candidates = (uint32_t)(DEFECT_MAX_FRACTION * width * height) + 1;
+    uint32_t count = 0;
+
+    *out = (DefectEntry *)malloc(sizeof(DefectEntry) * max_candidates);
+    if (*out == NULL)
+        signal_error_and_exit(MALLOC_ERR);
+
+    for (int y = step; y < height - step; ++y)
+    {
+        size_t row = (size_t)y * width;
+        for (int x = step; x < width - step; ++x)
+        {
+            size_t index = row + x;
+            int32_t a = get_sample(data, wide, index - step);
+            int32_t b = get_sample(data, wide, index + step);
+            int32_t c = get_sample(data, wide, index - (size_t)step * width);
+            int32_t d = get_sample(data, wide, index + (size_t)step * width);
+            /* Mean of the two middle neighbours, so a defect does not also flag the pixels next to it */
+            int32_t lo = a < b ? a : b, hi = a < b ? b : a;
+            int32_t lo2 = c < d ? c : d, hi2 = c < d ? d : c;
+            int32_t reference = a + b + c + d - (lo < lo2 ? lo : lo2) - (hi > hi2 ? hi : hi2);
+            int32_t deviation = 2 * (int32_t)get_sample(data, wide, index) - reference;
+            if (deviation <= 2 * limit && deviation >= -2 * limit)
+                continue;
+
+            if (count == max_candidates)
+            {
+                free(*out);
+                *out = NULL;
+                return 0;
+            }
+            DefectEntry *entry = &(*out)[count++];
+            entry->position = (uint32_t)index;
+            entry->hits = 0;
+            entry->kind = deviation > 0 ? DEFECT_HOT : DEFECT_DEAD;
+            entry->reserved = 0;
+        }
+    }
+    return count;
+}
+
+static inline int is_confirmed(const DefectMap *map, uint32_t position, int confirm_hits)
+{
+    int k = defect_map_find(map, position);
+    return k >= 0 && map->entries[k].hits >= confirm_hits;
+}
+
+/* Replace the confirmed defects of a frame by the mean of their good same-colour neighbours.
+   Returns the number of corrected pixels, the cost depends on the map size only. Which pixels can be
+   corrected depends on the map and frame size only, so with dst NULL they are just counted. */
+static int correct_defects(const unsigned char *src, unsigned char *dst, int width, int height, int bits, int step,
+                           const DefectMap *map, int confirm_hits)
+{
+    int wide = bits > 8;
+    int corrected = 0;
+    const int dx[4] = {-step, step, 0, 0};
+    const int dy[4] = {0, 0, -step, step};
+
+    for (uint32_t k = 0; k < map->count; ++k)
+    {
+        const DefectEntry *entry = &map->entries[k];
+        if (entry->hits < confirm_hits)
+            continue;
+
+        int x = entry->position % width;
+        int y = entry->position / width;
+        uint32_t sum = 0;
+        int count = 0;
+        for (int n = 0; n < 4; ++n)
+        {
+            int nx = x + dx[n];
+            int ny = y + dy[n];
+            if (nx < 0 || nx >= width || ny < 0 || ny >= height)
+                continue;
+            uint32_t neighbour = (uint32_t)ny * width + nx;
+            if (is_confirmed(map, neighbour, confirm_hits))
+                continue;
+            if (dst != NULL)
+                sum += get_sample(src, wide, neighbour);
+            count++;
+        }
+
+        if (count > 0)
+        {
+            if (dst != NULL)
+                set_sample(dst, wide, entry->position, (sum + count / 2) / count);
+            corrected++;
+        }
+    }
+    return corrected;
+}
+
+/* START MODULE IMPLEMENTATION */
+void module()
+{
+    /* Get number of images in input batch */
+    int num_images = get_input_num_images();
+
+    const char *map_path = get_param_string("defect_map");
+    int step = get_param_bool("cfa") ? 2 : 1;
+    int update_map = get_param_bool("update_map");
+    float threshold = get_param_float("defect_threshold");
+    int confirm_hits = get_param_int("confirm_hits");
+    if (map_path[0] == '\0' || threshold <= 0.0f || confirm_hits < 1 || confirm_hits > DEFECT_MAX_HITS)
+        signal_error_and_exit(INVALID_PARAM);
+    if (num_images <= 0)
+        return;
+
+    Metadata *first_meta = get_metadata(0);
+    DefectMap map;
+    int status = defect_map_load(map_path, &map);
+    if (status == -1)
+        defect_map_init(&map, first_meta->width, first_meta->height);
+    else if (status < 0)
+        signal_error_and_exit(DEFECT_MAP_ERR);
+    int num_corrected = 0;
+
+    for (int i = 0; i < num_images; ++i)
+    {
+        Metadata *input_meta = get_metadata(i);
+        int width = input_meta->width;
+        int height = input_meta->height;
+        int bits = input_meta->bits_pixel;
+        int bytes_per_sample = bits > 8 ? 2 : 1;
+
+        if (width <= 2 * step || height <= 2 * step || input_meta->channels != 1 || bits < 1 || bits > 16)
+            signal_error_and_exit(INVALID_INPUT);
+        if ((uint32_t)width != map.width || (uint32_t)height != map.height)
+            signal_error_and_exit(DEFECT_MAP_ERR);
+
+        const unsigned char *input_image_data;
+        size_t size = get_image_view(i, &input_image_data);
+        if (size != (size_t)width * height * bytes_per_sample)
+            signal_error_and_exit(INVALID_INPUT);
+
+        /* The map changes over months, one detection round per batch is enough to follow it */
+        if (update_map && i == 0)
+        {
+            DefectEntry *detected;
+            uint32_t num_detected = detect_defects(input_image_data, width, height, bits, step, threshold, &detected);
+            if (detected != NULL)
+            {
+                defect_map_update(&map, detected, num_detected, DEFECT_MAX_HITS);
+                free(detected);
+                if (defect_map_save(map_path, &map) != 0)
+                    signal_error_and_exit(DEFECT_MAP_ERR);
+            }
+        }
+        /* The metadata is packed before the frame is patched, every frame of the batch has the same count */
+        if (i == 0)
+            num_corrected = correct_defects(NULL, NULL, width, height, bits, step, &map, confirm_hits);
+
+        /* Create image metadata before appending */
+        Metadata new_meta = METADATA__INIT;
+        new_meta.size = size;
+        new_meta.width = width;
+        new_meta.height = height;
+        new_meta.channels = input_meta->channels;
+        new_meta.timestamp = input_meta->timestamp;
+        new_meta.bits_pixel = bits;
+        new_meta.camera = input_meta->camera;
+        new_meta.obid = input_meta->obid;
+        add_custom_metadata_int(&new_meta, "defects_corrected", num_corrected);
+        add_custom_metadata_int(&new_meta, "defect_map_generation", map.generation);
+        copy_custom_metadata(&new_meta, input_meta, NULL);
+
+        /* Only the listed pixels differ from the input, so the frame is copied once and patched */
+        unsigned char *output_image_data = reserve_result_image(size, &new_meta);
+        if (output_image_data == NULL)
+            signal_error_and_exit(MALLOC_ERR);
+        memcpy(output_image_data, input_image_data, size);
+        correct_defects(input_image_data, output_image_data, width, height, bits, step, &map, confirm_hits);
+    }
+
+    defect_map_free(&map);
+}
+/* END MODULE IMPLEMENTATION */
+
+/* Main function of module (NO NEED TO MODIFY) */
+ImageBatch run(ImageBatch *input_batch, ModuleParameterList *module_parameter_list, int *ipc_error_pipe)
+{
+    ImageBatch result_batch;
+    result = &result_batch;
+    input = input_batch;
+    config = module_parameter_list;
+    error_pipe = ipc_error_pipe;
+    initialize();
+
+    module();
+
+    finalize();
+
+    return result_batch;
+}
+
+#ifdef TESTING_MODULE_STANDALONE
+
+/* Smooth random scene with fixed defects, each call gives a different scene */
+static void make_frame(uint16_t *frame, int width, int height, const uint32_t *defects, int num_defects)
+{
+    int fx = 20 + rand() % 200, fy = 20 + rand() % 200, offset = rand() % 1000;
+    for (int y = 0; y < height; ++y)
+        for (int x = 0; x < width; ++x)
+            frame[(size_t)y * width + x] = 1500 + offset + (x * 700 / fx + y * 500 / fy) % 700 / 4 + rand() % 16;
+    for (int k = 0; k < num_defects; ++k)
+        frame[defects[k]] = k % 2 ? 4095 : 0;
+}
+
+/* Host-side check: the map converges to the injected defects over several batches and survives a reload */
+int main(int argc, char **argv)
+{
+    if (argc != 2)
+    {
+        printf("Usage: %s <defect_map_file>\n", argv[0]);
+        return 1;
+    }
+    const int width = 2464, height = 2056, num_defects = 300;
+    const char *path = argv[1];
+    remove(path);
+
+    uint32_t defects[num_defects];
+    for (int k = 0; k < num_defects; ++k)
+        defects[k] = (uint32_t)(rand() % (height - 8) + 4) * width + rand() % (width - 8) + 4;
+
+    uint16_t *frame = malloc(sizeof(uint16_t) * width * height);
+    uint16_t *fixed = malloc(sizeof(uint16_t) * width * height);
+    DefectMap map;
+    defect_map_init(&map, width, height);
+
+    for (int batch = 0; batch < 6; ++batch)
+    {
+        make_frame(frame, width, height, defects, num_defects);
+        DefectEntry *detected;
+        uint32_t num_detected = detect_defects((unsigned char *)frame, width, height, 12, 2, 0.1f, &detected);
+        defect_map_update(&map, detected, num_detected, DEFECT_MAX_HITS);
+        free(detected);
+        defect_map_save(path, &map);
+        defect_map_free(&map);
+        defect_map_load(path, &map);
+    }
+
+    int confirmed = 0, missing = 0;
+    for (uint32_t k = 0; k < map.count; ++k)
+        confirmed += map.entries[k].hits >= 3;
+    for (int k = 0; k < num_defects; ++k)
+        missing += !is_confirmed(&map, defects[k], 3);
+
+    make_frame(frame, width, height, defects, num_defects);
+    memcpy(fixed, frame, sizeof(uint16_t) * width * height);
+    int corrected = correct_defects((unsigned char *)frame, (unsigned char *)fixed, width, height, 12, 2, &map, 3);
+    int counted = correct_defects(NULL, NULL, width, height, 12, 2, &map, 3);
+    int worst = 0;
+    for (int k = 0; k < num_defects; ++k)
+    {
+        size_t p = defects[k];
+        int expected = (frame[p - 2] + frame[p + 2] + frame[p - 2 * width] + frame[p + 2 * width]) / 4;
+        if (abs(fixed[p] - expected) > worst)
+            worst = abs(fixed[p] - expected);
+    }
+
+    printf("generation %u: %u entries, %d confirmed, %d defects missing, %d corrected (%d counted), worst error %d\n",
+           map.generation, map.count, confirmed, missing, corrected, counted, worst);
+
+    defect_map_free(&map);
+    free(frame);
+    free(fixed);
+    return missing != 0 || worst > 2 || counted != corrected;
+}
+
+#endif
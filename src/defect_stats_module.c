@@ -0,0 +1,433 @@
+#include "module.h"
+#include "util.h"
+#include "defect_map.h"
+
+#ifdef __ARM_NEON
+#include <arm_neon.h>
+#endif
+
+/* Define custom error codes */
+enum ERROR_CODE {
+    MALLOC_ERR = 1,
+    INVALID_INPUT = 2,
+    INVALID_PARAM = 3,
+    DEFECT_MAP_ERR = 4,
+};
+
+/* Same bound as the defect correction module, which reads the map */
+#define DEFECT_MAX_HITS 8
+/* Stuck pixels are found by comparing consecutive frames, so a batch needs at least two */
+#define MIN_FRAMES 2
+/* A round with more defects than this fraction of the frame is a static or busy scene, not defects */
+#define DEFECT_MAX_FRACTION 0.001
+
+/*
+ * Per-pixel counters, one byte each, saturating at 255 frames: the memory is three bytes per
+ * pixel whatever the batch size, and frames are read one at a time through zero-copy views.
+ */
+typedef struct DefectStats {
+    int width;
+    int height;
+    int step;
+    int frames;
+    uint8_t *hot;    /* Frames where the pixel was above its neighbours by more than the limit */
+    uint8_t *dead;   /* Frames where it was below them by more than the limit */
+    uint8_t *stuck;  /* Frames where it held exactly the value of the previous frame, inside the range */
+} DefectStats;
+
+static void init_stats(DefectStats *stats, int width, int height, int step)
+{
+    size_t num_pixels = (size_t)width * height;
+    stats->width = width;
+    stats->height = height;
+    stats->step = step;
+    stats->frames = 0;
+    stats->hot = (uint8_t *)calloc(num_pixels, 3);
+    if (stats->hot == NULL)
+        signal_error_and_exit(MALLOC_ERR);
+    stats->dead = stats->hot + num_pixels;
+    stats->stuck = stats->dead + num_pixels;
+}
+
+static void free_stats(DefectStats *stats)
+{
+    free(stats->hot);
+}
+
+static inline uint8_t add_saturate(uint8_t count, int flag)
+{
+    return count + (flag && count < 255);
+}
+
+/*
+ * The neighbour reference is the mean of the two middle of the four same-colour neighbours,
+ * so one defect does not flag the pixels next to it (see the defect correction module).
+ * With a, b and c, d as pairs, the middle two are max(min(a, b), min(c, d)) and min(max(a, b), max(c, d)).
+ */
+#define ACCUMULATE_ROW(type)                                                                                \
+    do {                                                                                                    \
+        const type *cur = (const type *)frame + row;                                                        \
+        const type *up = cur - (size_t)step * width;                                                        \
+        const type *down = cur + (size_t)step * width;                                                      \
+        const type *last = (const type *)previous + row;                                                    \
+        for (; x < width - step; ++x)                                                                       \
+        {                                                                                                   \
+            uint32_t a = cur[x - step], b = cur[x + step], c = up[x], d = down[x];                          \
+            uint32_t lo = a < b ? a : b, hi = a < b ? b : a;                                                \
+            uint32_t lo2 = c < d ? c : d, hi2 = c < d ? d : c;                                              \
+            uint32_t reference = ((lo > lo2 ? lo : lo2) + (hi < hi2 ? hi : hi2)) >> 1;                      \
+            uint32_t v = cur[x];                                                                            \
+            hot[x] = add_saturate(hot[x], v > reference + limit);                                           \
+            dead[x] = add_saturate(dead[x], v + limit < reference);                                         \
+            if (previous != NULL)                                                                           \
+                stuck[x] = add_saturate(stuck[x], v == last[x] && v != 0 && v < max_value);                 \
+        }                                                                                                   \
+    } while (0)
+
+/* Add one frame to the counters, previous is the frame before it or NULL for the first one. Samples at 0 or
+   full scale hold their value in black or saturated regions of any scene, so they never count as stuck. */
+static void accumulate_frame(DefectStats *stats, const unsigned char *frame, const unsigned char *previous, int bits,
+                             float threshold)
+{
+    int width = stats->width;
+    int step = stats->step;
+    uint32_t max_value = (1u << bits) - 1;
+    uint32_t limit = (uint32_t)(threshold * max_value);
+
+    for (int y = step; y < stats->height - step; ++y)
+    {
+        size_t row = (size_t)y * width;
+        uint8_t *hot = stats->hot + row;
+        uint8_t *dead = stats->dead + row;
+        uint8_t *stuck = stats->stuck + row;
+        int x = step;
+
+        if (bits > 8)
+        {
+#ifdef __ARM_NEON
+            /* Eight pixels per iteration: the compares give 0xFFFF lanes, narrowed to bytes and masked to one */
+            const uint16_t *cur = (const uint16_t *)frame + row;
+            const uint16_t *up = cur - (size_t)step * width;
+            const uint16_t *down = cur + (size_t)step * width;
+            const uint16_t *last = previous != NULL ? (const uint16_t *)previous + row : NULL;
+            uint16x8_t limit_v = vdupq_n_u16((uint16_t)limit);
+            uint16x8_t max_v = vdupq_n_u16((uint16_t)max_value);
+            uint8x8_t one = vdup_n_u8(1);
+            for (; x + 8 <= width - step; x += 8)
+            {
+                uint16x8_t a = vld1q_u16(cur + x - step), b = vld1q_u16(cur + x + step);
+                uint16x8_t c = vld1q_u16(up + x), d = vld1q_u16(down + x);
+                uint16x8_t v = vld1q_u16(cur + x);
+                uint16x8_t reference = vhaddq_u16(vmaxq_u16(vminq_u16(a, b), vminq_u16(c, d)),
+                                                  vminq_u16(vmaxq_u16(a, b), vmaxq_u16(c, d)));
+                uint8x8_t is_hot = vmovn_u16(vcgtq_u16(v, vqaddq_u16(reference, limit_v)));
+                uint8x8_t is_dead = vmovn_u16(vcltq_u16(vqaddq_u16(v, limit_v), reference));
+                vst1_u8(hot + x, vqadd_u8(vld1_u8(hot + x), vand_u8(is_hot, one)));
+                vst1_u8(dead + x, vqadd_u8(vld1_u8(dead + x), vand_u8(is_dead, one)));
+                if (last != NULL)
+                {
+                    uint16x8_t in_range = vandq_u16(vtstq_u16(v, v), vcltq_u16(v, max_v));
+                    uint8x8_t is_stuck = vmovn_u16(vandq_u16(vceqq_u16(v, vld1q_u16(last + x)), in_range));
+                    vst1_u8(stuck + x, vqadd_u8(vld1_u8(stuck + x), vand_u8(is_stuck, one)));
+                }
+            }
+#endif
+            ACCUMULATE_ROW(uint16_t);
+        }
+        else
+            ACCUMULATE_ROW(uint8_t);
+    }
+    stats->frames++;
+}
+
+/* Pixels flagged in at least min_fraction of the frames, sorted by position. Stuck wins over hot and dead,
+   as a stuck pixel is usually also far from its neighbours. *out is NULL if there are more than
+   DEFECT_MAX_FRACTION of the frame, so such a round does not flood the map. */
+static uint32_t classify_defects(const DefectStats *stats, float min_fraction, DefectEntry **out)
+{
+    size_t num_pixels = (size_t)stats->width * stats->height;
+    int frames = stats->frames < 255 ? stats->frames : 255;
+    uint8_t min_count = (uint8_t)(min_fraction * frames + 0.5f);
+    if (min_count < 1)
+        min_count = 1;
+    /* Stuck counts come from comparisons with the previous frame, one fewer than the frames */
+    uint8_t min_stuck = (uint8_t)(min_fraction * (frames - 1) + 0.5f);
+    if (min_stuck < 1)
+        min_stuck = 1;
+
+    uint32_t max_defects = (uint32_t)(DEFECT_MAX_FRACTION * num_pixels) + 1;
+    uint32_t count = 0, capacity = 1024;
+    *out = (DefectEntry *)malloc(sizeof(DefectEntry) * capacity);
+    if (*out == NULL)
+        signal_error_and_exit(MALLOC_ERR);
+
+    for (size_t p = 0; p < num_pixels; ++p)
+    {
+        /* Most pixels are good, one test on the largest counter skips them */
+        uint8_t most = stats->hot[p] | stats->dead[p] | stats->stuck[p];
+        if (most < min_stuck)
+            continue;
+
+        uint8_t kind = stats->stuck[p] >= min_stuck ? DEFECT_STUCK
+                     : stats->hot[p] >= min_count ? DEFECT_HOT
+                     : stats->dead[p] >= min_count ? DEFECT_DEAD : 0;
+        if (kind == 0)
+            continue;
+
+        if (count == max_defects)
+        {
+            free(*out);
+            *out = NULL;
+            return 0;
+        }
+        if (count == capacity)
+        {
+            capacity *= 2;
+            DefectEntry *tmp = (DefectEntry *)realloc(*out, sizeof(DefectEntry) * capacity);
+            if (tmp == NULL)
+                signal_error_and_exit(MALLOC_ERR);
+            *out = tmp;
+        }
+        DefectEntry *entry = &(*out)[count++];
+        entry->position = (uint32_t)p;
+        entry->hits = 0;
+        entry->kind = kind;
+        entry->reserved = 0;
+    }
+    return count;
+}
+
+/* START MODULE IMPLEMENTATION */
+void module()
+{
+    /* Get number of images in input batch */
+    int num_images = get_input_num_images();
+
+    const char *map_path = get_param_string("defect_map");
+    int step = get_param_bool("cfa") ? 2 : 1;
+    float threshold = get_param_float("defect_threshold");
+    float min_fraction = get_param_float("min_defect_fraction");
+    if (map_path[0] == '\0' || threshold <= 0.0f || min_fraction <= 0.0f || min_fraction > 1.0f)
+        signal_error_and_exit(INVALID_PARAM);
+    if (num_images <= 0)
+        return;
+
+    Metadata *first_meta = get_metadata(0);
+    int width = first_meta->width;
+    int height = first_meta->height;
+    int bits = first_meta->bits_pixel;
+    if (width <= 2 * step || height <= 2 * step || bits < 1 || bits > 16)
+        signal_error_and_exit(INVALID_INPUT);
+
+    DefectStats stats;
+    init_stats(&stats, width, height, step);
+
+    const unsigned char *previous = NULL;
+    for (int i = 0; i < num_images; ++i)
+    {
+        Metadata *input_meta = get_metadata(i);
+        if (input_meta->width != width || input_meta->height != height || input_meta->bits_pixel != bits
+            || input_meta->channels != 1)
+            signal_error_and_exit(INVALID_INPUT);
+
+        const unsigned char *input_image_data;
+        size_t size = get_image_view(i, &input_image_data);
+        if (size != (size_t)width * height * (bits > 8 ? 2 : 1))
+            signal_error_and_exit(INVALID_INPUT);
+
+        accumulate_frame(&stats, input_image_data, previous, bits, threshold);
+        previous = input_image_data;
+    }
+
+    /* One merge per batch, as the defect correction module does with its own detection */
+    DefectMap map;
+    int num_defects = -1;
+    int status = defect_map_load(map_path, &map);
+    if (status == -1)
+        defect_map_init(&map, width, height);
+    else if (status < 0 || map.width != (uint32_t)width || map.height != (uint32_t)height)
+        signal_error_and_exit(DEFECT_MAP_ERR);
+
+    if (stats.frames >= MIN_FRAMES)
+    {
+        DefectEntry *detected;
+        uint32_t num_detected = classify_defects(&stats, min_fraction, &detected);
+        if (detected != NULL)
+        {
+            defect_map_update(&map, detected, num_detected, DEFECT_MAX_HITS);
+            free(detected);
+            if (defect_map_save(map_path, &map) != 0)
+                signal_error_and_exit(DEFECT_MAP_ERR);
+            num_defects = num_detected;
+        }
+    }
+    free_stats(&stats);
+
+    /* The frames are passed on unchanged */
+    for (int i = 0; i < num_images; ++i)
+    {
+        Metadata *input_meta = get_metadata(i);
+        const unsigned char *input_image_data;
+        size_t size = get_image_view(i, &input_image_data);
+
+        /* Create image metadata before appending */
+        Metadata new_meta = METADATA__INIT;
+        new_meta.size = size;
+        new_meta.width = input_meta->width;
+        new_meta.height = input_meta->height;
+        new_meta.channels = input_meta->channels;
+        new_meta.timestamp = input_meta->timestamp;
+        new_meta.bits_pixel = input_meta->bits_pixel;
+        new_meta.camera = input_meta->camera;
+        new_meta.obid = input_meta->obid;
+        if (num_defects >= 0)
+            add_custom_metadata_int(&new_meta, "defects_detected", num_defects);
+        add_custom_metadata_int(&new_meta, "defect_map_generation", map.generation);
+        copy_custom_metadata(&new_meta, input_meta, NULL);
+
+        /* Append the image to the result batch */
+        append_result_image((unsigned char *)input_image_data, size, &new_meta);
+    }
+
+    defect_map_free(&map);
+}
+/* END MODULE IMPLEMENTATION */
+
+/* Main function of module (NO NEED TO MODIFY) */
+ImageBatch run(ImageBatch *input_batch, ModuleParameterList *module_parameter_list, int *ipc_error_pipe)
+{
+    ImageBatch result_batch;
+    result = &result_batch;
+    input = input_batch;
+    config = module_parameter_list;
+    error_pipe = ipc_error_pipe;
+    initialize();
+
+    module();
+
+    finalize();
+
+    return result_batch;
+}
+
+#ifdef TESTING_MODULE_STANDALONE
+
+#include <time.h>
+
+static double elapsed_ms(const struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1e3 + (now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+/* Classify a 12-bit burst at the thresholds used by the checks */
+static uint32_t classify_burst(const uint16_t *burst, int width, int height, int frames, DefectEntry **detected)
+{
+    size_t num_pixels = (size_t)width * height;
+    DefectStats stats;
+    init_stats(&stats, width, height, 2);
+    for (int f = 0; f < frames; ++f)
+        accumulate_frame(&stats, (const unsigned char *)(burst + num_pixels * f),
+                         f > 0 ? (const unsigned char *)(burst + num_pixels * (f - 1)) : NULL, 12, 0.1f);
+    uint32_t num_detected = classify_defects(&stats, 0.75f, detected);
+    free_stats(&stats);
+    return num_detected;
+}
+
+/* A burst with a saturated left third and a black right third: clipped samples hold their value in every
+   frame, only the stuck pixels injected in the middle are defects. Without noise the whole frame holds
+   its value, and the round is ignored. */
+static int check_clipped(void)
+{
+    const int width = 512, height = 512, frames = 8, num_stuck = 5;
+    size_t num_pixels = (size_t)width * height;
+    uint16_t *burst = malloc(sizeof(uint16_t) * num_pixels * frames);
+    uint32_t positions[5];
+    for (int k = 0; k < num_stuck; ++k)
+        positions[k] = (uint32_t)(100 + 60 * k) * width + width / 3 + 20 + 30 * k;
+
+    for (int f = 0; f < frames; ++f)
+    {
+        uint16_t *frame = burst + num_pixels * f;
+        for (size_t p = 0; p < num_pixels; ++p)
+        {
+            int x = p % width;
+            frame[p] = x < width / 3 ? 4095 : x >= 2 * width / 3 ? 0 : 1500 + rand() % 64;
+        }
+        for (int k = 0; k < num_stuck; ++k)
+            frame[positions[k]] = 1777;
+    }
+
+    DefectEntry *detected;
+    uint32_t num_detected = classify_burst(burst, width, height, frames, &detected);
+    int wrong = detected == NULL || num_detected != (uint32_t)num_stuck;
+    for (uint32_t e = 0; e < num_detected && !wrong; ++e)
+        wrong = detected[e].kind != DEFECT_STUCK;
+    free(detected);
+
+    /* A static scene: every sample holds its value */
+    for (int f = 1; f < frames; ++f)
+        memcpy(burst + num_pixels * f, burst, sizeof(uint16_t) * num_pixels);
+    classify_burst(burst, width, height, frames, &detected);
+    int flooded = detected != NULL;
+    free(detected);
+
+    printf("clipped regions: %u defects detected (%d injected), static scene %s\n", num_detected, num_stuck,
+           flooded ? "flooded the map" : "ignored");
+    free(burst);
+    return wrong || flooded;
+}
+
+/* Host-side check: noisy hot and dead pixels and constant stuck pixels injected into a burst of changing frames */
+int main(void)
+{
+    const int width = 2464, height = 2056, frames = 16, per_kind = 100;
+    size_t num_pixels = (size_t)width * height;
+    uint16_t *burst = malloc(sizeof(uint16_t) * num_pixels * frames);
+    uint32_t positions[3 * per_kind];
+    for (int k = 0; k < 3 * per_kind; ++k)
+        positions[k] = (uint32_t)(rand() % (height - 8) + 4) * width + rand() % (width - 8) + 4;
+
+    for (int f = 0; f < frames; ++f)
+    {
+        uint16_t *frame = burst + num_pixels * f;
+        int offset = rand() % 800;
+        for (size_t p = 0; p < num_pixels; ++p)
+            frame[p] = 1200 + offset + (p % width + p / width) % 300 + rand() % 32;
+        for (int k = 0; k < 3 * per_kind; ++k)
+            frame[positions[k]] = k < per_kind ? 3600 + rand() % 400 : k < 2 * per_kind ? rand() % 40 : 1777;
+    }
+
+    DefectStats stats;
+    init_stats(&stats, width, height, 2);
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int f = 0; f < frames; ++f)
+        accumulate_frame(&stats, (unsigned char *)(burst + num_pixels * f),
+                         f > 0 ? (unsigned char *)(burst + num_pixels * (f - 1)) : NULL, 12, 0.1f);
+    double ms = elapsed_ms(&start) / frames;
+
+    DefectEntry *detected;
+    uint32_t num_detected = classify_defects(&stats, 0.75f, &detected);
+    int wrong = 0;
+    for (int k = 0; k < 3 * per_kind; ++k)
+    {
+        uint8_t expected = k < per_kind ? DEFECT_HOT : k < 2 * per_kind ? DEFECT_DEAD : DEFECT_STUCK;
+        int found = 0;
+        for (uint32_t e = 0; e < num_detected; ++e)
+            found |= detected[e].position == positions[k] && detected[e].kind == expected;
+        wrong += !found;
+    }
+
+    printf("%u defects detected (%d injected), %d missed or misclassified, %.1f ms per frame\n",
+           num_detected, 3 * per_kind, wrong, ms);
+
+    free(detected);
+    free_stats(&stats);
+    free(burst);
+    int clipped_failed = check_clipped();
+    return wrong != 0 || num_detected != 3 * per_kind || clipped_failed;
+}
+
+#endif
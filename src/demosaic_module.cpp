@@ -1,6 +1,7 @@
 #include "module.h"
 #include "util.h"
 #include "globals.h"
+#include "flat_field.h"
 #include <opencv2/opencv.hpp>
 
 /* Define custom error codes */
@@ -13,6 +14,7 @@ enum ERROR_CODE {
     OPENCV_NORM_ERR = 6,
     INVALID_INPUT = 7,
     INVALID_INPUT_VALUES = 8,
+    CALIBRATION_ERR = 9,
     
 };
 
@@ -25,6 +27,26 @@ void module()
     if (num_images <= 0){
         signal_error_and_exit(INVALID_INPUT);
     }
+
+    int rotate = get_param_bool("demosaic_rotate");
+
+    /* Optional flat-field correction of the raw frame, see the flat-field module */
+    int flat_field = get_param_bool("demosaic_flat_field");
+    CalibrationFile calibration_file;
+    const uint16_t *gains = NULL;
+    uint32_t gain_rows = 0, gain_cols = 0;
+    FlatField flat;
+    memset(&flat, 0, sizeof(flat));
+    std::vector<uint16_t> line;
+    if (flat_field)
+    {
+        gains = flat_field_load(&calibration_file, get_param_string("calibration"), get_param_string("flat_field"),
+                                get_param_int("flat_field_rows"), get_param_int("flat_field_cols"), &gain_rows,
+                                &gain_cols);
+        if (gains == NULL){
+            signal_error_and_exit(CALIBRATION_ERR);
+        }
+    }
     
     /* Process each image in the batch */
     for (int i = 0; i < num_images; ++i)
@@ -46,6 +68,27 @@ void module()
         /* Get input image data */
         unsigned char *input_image_data;
         size_t input_size = get_image_data(i, &input_image_data);
+
+        /* The raw rows are flat-fielded in place in the copy that demosaicing reads, so the correction
+           costs no extra frame buffer and no separate pass through the batch */
+        if (flat_field)
+        {
+            if (width != flat.width || height != flat.height)
+            {
+                flat_field_free(&flat);
+                int status = flat_field_init(&flat, gains, gain_rows, gain_cols, width, height, 1, 2);
+                if (status != 0){
+                    signal_error_and_exit(status == -1 ? CALIBRATION_ERR : MALLOC_ERR);
+                }
+                line.resize(width);
+            }
+            int flat_bits = bits_pixel > 8 && bits_pixel <= 16 ? bits_pixel : 16;
+            for (int y = 0; y < height; ++y)
+            {
+                uint16_t *row = (uint16_t *)input_image_data + (size_t)y * width;
+                flat_field_apply_row(&flat, y, row, row, flat_bits, line.data());
+            }
+        }
         
         /* Create OpenCV Mat for raw image (12-bit data in 16-bit container) */
         cv::Mat rawImage(height, width, CV_16UC1, (uint16_t*)input_image_data);
@@ -66,20 +109,28 @@ void module()
         //cv::Mat finalImage;
         //cv::flip(demosaicedImage, finalImage, 0);  // 0 means vertical flip
         
-        cv::Point2f center(width / 2.0f, height / 2.0f);
-        double angle = 180;
-        double scale = 1.0;
+        /* The rotation can be left to the geometry module, which folds it into its single remap */
+        cv::Mat rotated_image;
+        if (rotate)
+        {
+            cv::Point2f center(width / 2.0f, height / 2.0f);
+            double angle = 180;
+            double scale = 1.0;
 
-        cv::Mat rotation_matrix = cv::getRotationMatrix2D(center, angle, scale);
+            cv::Mat rotation_matrix = cv::getRotationMatrix2D(center, angle, scale);
 
-        if (rotation_matrix.empty()){
-            signal_error_and_exit(OPNECV_MAT_ERR);
-        }
-        cv::Mat rotated_image;
-        cv::warpAffine(demosaicedImage, rotated_image, rotation_matrix, cv::Size(width, height));
+            if (rotation_matrix.empty()){
+                signal_error_and_exit(OPNECV_MAT_ERR);
+            }
+            cv::warpAffine(demosaicedImage, rotated_image, rotation_matrix, cv::Size(width, height));
 
-        if (rotated_image.empty() || rotated_image.data == NULL){
-            signal_error_and_exit(OPENCV_ROT_ERR);
+            if (rotated_image.empty() || rotated_image.data == NULL){
+                signal_error_and_exit(OPENCV_ROT_ERR);
+            }
+        }
+        else
+        {
+            rotated_image = demosaicedImage;
         }
 
         cv::Mat normalized_Image;
@@ -118,7 +169,9 @@ void module()
         /* Add custom metadata for demosaicing info */
         add_custom_metadata_string(&new_meta, "processing", "demosaiced");
         add_custom_metadata_int(&new_meta, "output_channels", 3);
-        add_custom_metadata_string(&new_meta, "orientation", "flipped_vertical");
+        if (rotate)
+            add_custom_metadata_string(&new_meta, "orientation", "flipped_vertical");
+        add_custom_metadata_string(&new_meta, "channel_order", "bgr");
         
         /* Append the processed image to the result batch */
         append_result_image(output_image_data, output_size, &new_meta);
@@ -127,6 +180,12 @@ void module()
         free(input_image_data);
         free(output_image_data);
     }
+
+    if (flat_field)
+    {
+        flat_field_free(&flat);
+        calibration_close(&calibration_file);
+    }
 }
 
 /* END MODULE IMPLEMENTATION */
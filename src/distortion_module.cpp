@@ -0,0 +1,166 @@
+#include "module.h"
+#include "util.h"
+#include "cache.h"
+#include "calibration.h"
+#include <opencv2/opencv.hpp>
+
+/* Define custom error codes */
+enum ERROR_CODE {
+    MALLOC_ERR = 1,
+    INVALID_INPUT = 2,
+    CALIBRATION_ERR = 3,
+    CACHE_ERR = 4,
+    OPENCV_ERR = 5,
+};
+
+/* Part of the cache key, bump it when the layout or the meaning of the cached tables changes */
+#define REMAP_TABLE_VERSION 1
+
+/* Fixed-point remap tables for one frame size: map1 holds the integer source coordinates (CV_16SC2)
+   and map2 the interpolation table index (CV_16UC1), both inside the mapped cache file */
+typedef struct RemapTables {
+    int width;
+    int height;
+    CacheFile cache;
+    cv::Mat map1;
+    cv::Mat map2;
+} RemapTables;
+
+/* Map the tables for a frame size from the cache, building and caching them on a miss */
+static void load_remap_tables(RemapTables *tables, const CameraCalibration *calibration, const char *cache_dir,
+                              int width, int height)
+{
+    int32_t version = REMAP_TABLE_VERSION;
+    int32_t size[2] = {width, height};
+    uint64_t key = cache_hash(calibration, sizeof(*calibration), 0);
+    key = cache_hash(size, sizeof(size), key);
+    key = cache_hash(&version, sizeof(version), key);
+
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/undistort_%dx%d_%016llx.map", cache_dir, width, height, (unsigned long long)key);
+
+    size_t map1_size = (size_t)width * height * 2 * sizeof(int16_t);
+    size_t map2_size = (size_t)width * height * sizeof(uint16_t);
+    int status = cache_open(&tables->cache, path, key, map1_size + map2_size);
+    if (status < 0)
+        signal_error_and_exit(CACHE_ERR);
+
+    unsigned char *data = (unsigned char *)tables->cache.data;
+    tables->width = width;
+    tables->height = height;
+    tables->map1 = cv::Mat(height, width, CV_16SC2, data);
+    tables->map2 = cv::Mat(height, width, CV_16UC1, data + map1_size);
+
+    if (status == 0)
+    {
+        try
+        {
+            cv::Mat K(3, 3, CV_64F, (void *)calibration->K);
+            cv::Mat D(1, 5, CV_64F, (void *)calibration->D);
+            cv::Mat map1, map2;
+            /* Same mapping as cv::undistort with the default new camera matrix (K) */
+            cv::initUndistortRectifyMap(K, D, cv::Mat(), K, cv::Size(width, height), CV_16SC2, map1, map2);
+            map1.copyTo(tables->map1);
+            map2.copyTo(tables->map2);
+        }
+        catch (const cv::Exception &)
+        {
+            signal_error_and_exit(OPENCV_ERR);
+        }
+        if (cache_commit(&tables->cache) != 0)
+            signal_error_and_exit(CACHE_ERR);
+    }
+}
+
+/* START MODULE IMPLEMENTATION */
+void module()
+{
+    /* Get number of images in input batch */
+    int num_images = get_input_num_images();
+
+    CameraCalibration calibration;
+    if (calibration_load_camera(&calibration, get_param_string("calibration"), get_param_string("camera_matrix"),
+                                get_param_string("distortion_coeffs")) != 0)
+        signal_error_and_exit(CALIBRATION_ERR);
+    const char *cache_dir = get_param_string("remap_cache");
+
+    RemapTables tables;
+    tables.width = tables.height = 0;
+
+    for (int i = 0; i < num_images; ++i)
+    {
+        Metadata *input_meta = get_metadata(i);
+        int height = input_meta->height;
+        int width = input_meta->width;
+        int channels = input_meta->channels;
+        int bits_pixel = input_meta->bits_pixel;
+        int bytes_per_sample = bits_pixel > 8 ? 2 : 1;
+
+        if (width <= 0 || height <= 0 || channels < 1 || channels > 4 || bits_pixel < 1 || bits_pixel > 16)
+            signal_error_and_exit(INVALID_INPUT);
+
+        const unsigned char *input_image_data;
+        size_t size = get_image_view(i, &input_image_data);
+        if (size != (size_t)width * height * channels * bytes_per_sample)
+            signal_error_and_exit(INVALID_INPUT);
+
+        /* The tables only depend on the calibration and the frame size, a batch normally needs one set */
+        if (width != tables.width || height != tables.height)
+        {
+            if (tables.width > 0)
+                cache_close(&tables.cache);
+            load_remap_tables(&tables, &calibration, cache_dir, width, height);
+        }
+
+        /* Create image metadata before appending */
+        Metadata new_meta = METADATA__INIT;
+        new_meta.size = size;
+        new_meta.width = width;
+        new_meta.height = height;
+        new_meta.channels = channels;
+        new_meta.timestamp = input_meta->timestamp;
+        new_meta.bits_pixel = bits_pixel;
+        new_meta.camera = input_meta->camera;
+        new_meta.obid = input_meta->obid;
+        add_custom_metadata_bool(&new_meta, "distortion_corrected", 1);
+        copy_custom_metadata(&new_meta, input_meta, NULL);
+
+        /* The remap writes straight into the result batch */
+        unsigned char *output_image_data = reserve_result_image(size, &new_meta);
+        if (output_image_data == NULL)
+            signal_error_and_exit(MALLOC_ERR);
+
+        int type = CV_MAKETYPE(bytes_per_sample == 2 ? CV_16U : CV_8U, channels);
+        try
+        {
+            cv::Mat input_image(height, width, type, (void *)input_image_data);
+            cv::Mat output_image(height, width, type, output_image_data);
+            cv::remap(input_image, output_image, tables.map1, tables.map2, cv::INTER_LINEAR, cv::BORDER_CONSTANT);
+        }
+        catch (const cv::Exception &)
+        {
+            signal_error_and_exit(OPENCV_ERR);
+        }
+    }
+
+    if (tables.width > 0)
+        cache_close(&tables.cache);
+}
+/* END MODULE IMPLEMENTATION */
+
+/* Main function of module (NO NEED TO MODIFY) */
+extern "C" ImageBatch run(ImageBatch *input_batch, ModuleParameterList *module_parameter_list, int *ipc_error_pipe)
+{
+    ImageBatch result_batch;
+    result = &result_batch;
+    input = input_batch;
+    config = module_parameter_list;
+    error_pipe = ipc_error_pipe;
+    initialize();
+
+    module();
+
+    finalize();
+
+    return result_batch;
+}
@@ -0,0 +1,229 @@
+#include "module.h"
+#include "util.h"
+#include "flat_field.h"
+
+/* Define custom error codes */
+enum ERROR_CODE {
+    MALLOC_ERR = 1,
+    INVALID_INPUT = 2,
+    INVALID_PARAM = 3,
+    CALIBRATION_ERR = 4,
+};
+
+/* START MODULE IMPLEMENTATION */
+void module()
+{
+    /* Get number of images in input batch */
+    int num_images = get_input_num_images();
+
+    int cfa = get_param_bool("cfa");
+    int text_rows = get_param_int("flat_field_rows");
+    int text_cols = get_param_int("flat_field_cols");
+    if (text_rows < 0 || text_cols < 0)
+        signal_error_and_exit(INVALID_PARAM);
+    if (num_images <= 0)
+        return;
+
+    CalibrationFile file;
+    uint32_t rows, cols;
+    const uint16_t *gains = flat_field_load(&file, get_param_string("calibration"), get_param_string("flat_field"),
+                                            text_rows, text_cols, &rows, &cols);
+    if (gains == NULL)
+        signal_error_and_exit(CALIBRATION_ERR);
+
+    FlatField flat;
+    memset(&flat, 0, sizeof(flat));
+    uint16_t *line = NULL;
+
+    for (int i = 0; i < num_images; ++i)
+    {
+        Metadata *input_meta = get_metadata(i);
+        int width = input_meta->width;
+        int height = input_meta->height;
+        int channels = input_meta->channels;
+        int bits = input_meta->bits_pixel;
+        int bytes_per_sample = bits > 8 ? 2 : 1;
+        /* Only single channel frames are CFA mosaics */
+        int step = cfa && channels == 1 ? 2 : 1;
+
+        if (width <= 0 || height <= 0 || channels < 1 || bits < 1 || bits > 16)
+            signal_error_and_exit(INVALID_INPUT);
+
+        const unsigned char *input_image_data;
+        size_t size = get_image_view(i, &input_image_data);
+        if (size != (size_t)width * height * channels * bytes_per_sample)
+            signal_error_and_exit(INVALID_INPUT);
+
+        /* The upsampling tables are built once for each frame geometry */
+        if (width != flat.width || height != flat.height || channels != flat.channels || step != flat.step)
+        {
+            flat_field_free(&flat);
+            free(line);
+            int status = flat_field_init(&flat, gains, rows, cols, width, height, channels, step);
+            if (status == -1)
+                signal_error_and_exit(CALIBRATION_ERR);
+            line = (uint16_t *)malloc(sizeof(uint16_t) * width * channels);
+            if (status != 0 || line == NULL)
+                signal_error_and_exit(MALLOC_ERR);
+        }
+
+        /* Create image metadata before appending */
+        Metadata new_meta = METADATA__INIT;
+        new_meta.size = size;
+        new_meta.width = width;
+        new_meta.height = height;
+        new_meta.channels = channels;
+        new_meta.timestamp = input_meta->timestamp;
+        new_meta.bits_pixel = bits;
+        new_meta.camera = input_meta->camera;
+        new_meta.obid = input_meta->obid;
+        add_custom_metadata_bool(&new_meta, "flat_field_corrected", 1);
+        copy_custom_metadata(&new_meta, input_meta, NULL);
+
+        /* Rows are corrected from the input view straight into the result batch */
+        unsigned char *output_image_data = reserve_result_image(size, &new_meta);
+        if (output_image_data == NULL)
+            signal_error_and_exit(MALLOC_ERR);
+        size_t stride = (size_t)width * channels * bytes_per_sample;
+        for (int y = 0; y < height; ++y)
+            flat_field_apply_row(&flat, y, input_image_data + y * stride, output_image_data + y * stride, bits, line);
+    }
+
+    flat_field_free(&flat);
+    free(line);
+    calibration_close(&file);
+}
+/* END MODULE IMPLEMENTATION */
+
+/* Main function of module (NO NEED TO MODIFY) */
+ImageBatch run(ImageBatch *input_batch, ModuleParameterList *module_parameter_list, int *ipc_error_pipe)
+{
+    ImageBatch result_batch;
+    result = &result_batch;
+    input = input_batch;
+    config = module_parameter_list;
+    error_pipe = ipc_error_pipe;
+    initialize();
+
+    module();
+
+    finalize();
+
+    return result_batch;
+}
+
+#ifdef TESTING_MODULE_STANDALONE
+
+#include <math.h>
+#include <time.h>
+
+/* Host-side check against a floating point correction: smooth vignetting on a 12-bit CFA frame, with a
+   low resolution and a full resolution gain map, in place, and saturation on an 8-bit frame */
+static int check_gains(const uint16_t *gains, uint32_t rows, uint32_t cols, int step, const uint16_t *frame,
+                       int width, int height, const double *reference)
+{
+    FlatField flat;
+    uint16_t *line = malloc(sizeof(uint16_t) * width);
+    uint16_t *out = malloc(sizeof(uint16_t) * width * height);
+    if (flat_field_init(&flat, gains, rows, cols, width, height, 1, step) != 0)
+        return 1000;
+    for (int y = 0; y < height; ++y)
+        flat_field_apply_row(&flat, y, frame + (size_t)y * width, out + (size_t)y * width, 12, line);
+
+    double worst = 0;
+    for (size_t k = 0; k < (size_t)width * height; ++k)
+        worst = fmax(worst, fabs(out[k] - reference[k]));
+
+    /* In place on a copy of a row gives the same result */
+    uint16_t *row = malloc(sizeof(uint16_t) * width);
+    memcpy(row, frame, sizeof(uint16_t) * width);
+    flat_field_apply_row(&flat, 0, row, row, 12, line);
+    int same = memcmp(row, out, sizeof(uint16_t) * width) == 0;
+    free(row);
+
+    flat_field_free(&flat);
+    free(line);
+    free(out);
+    return same ? (int)ceil(worst) : 1000;
+}
+
+/* Vignetting gain of each colour of a 2x2 CFA at pixel (x, y) */
+static double vignetting_gain(int x, int y, int width, int height)
+{
+    double dx = (x - width / 2.0) / (width / 2.0);
+    double dy = (y - height / 2.0) / (height / 2.0);
+    return (1.0 + 0.6 * (dx * dx + dy * dy)) * (1.0 + 0.05 * (x % 2) + 0.03 * (y % 2));
+}
+
+int main(void)
+{
+    const int width = 2464, height = 2056, grid = 33;
+    uint16_t *frame = malloc(sizeof(uint16_t) * width * height);
+    double *reference = malloc(sizeof(double) * width * height);
+    uint16_t *full = malloc(sizeof(uint16_t) * width * height);
+    uint16_t *low = malloc(sizeof(uint16_t) * grid * 2 * grid * 2);
+
+    for (int y = 0; y < height; ++y)
+        for (int x = 0; x < width; ++x)
+        {
+            size_t k = (size_t)y * width + x;
+            frame[k] = 200 + (x * 7 + y * 3) % 2000;
+            full[k] = (uint16_t)lround(vignetting_gain(x, y, width, height) * FLAT_FIELD_ONE);
+            reference[k] = fmin(frame[k] * (double)full[k] / FLAT_FIELD_ONE, 4095);
+        }
+    int full_error = check_gains(full, height, width, 2, frame, width, height, reference);
+
+    /* Nodes of the low resolution map sit on the pixels of their colour at the frame corners */
+    for (int j = 0; j < grid; ++j)
+        for (int i = 0; i < grid; ++i)
+            for (int dy = 0; dy < 2; ++dy)
+                for (int dx = 0; dx < 2; ++dx)
+                {
+                    int x = (int)lround((double)i * (width / 2 - 1) / (grid - 1)) * 2 + dx;
+                    int y = (int)lround((double)j * (height / 2 - 1) / (grid - 1)) * 2 + dy;
+                    low[(j * 2 + dy) * grid * 2 + i * 2 + dx] =
+                        (uint16_t)lround(vignetting_gain(x, y, width, height) * FLAT_FIELD_ONE);
+                }
+    for (int y = 0; y < height; ++y)
+        for (int x = 0; x < width; ++x)
+        {
+            size_t k = (size_t)y * width + x;
+            reference[k] = fmin(frame[k] * vignetting_gain(x, y, width, height), 4095);
+        }
+    int low_error = check_gains(low, grid * 2, grid * 2, 2, frame, width, height, reference);
+
+    /* 8-bit saturation */
+    FlatField flat;
+    uint16_t gains8[2] = {3 * FLAT_FIELD_ONE, 3 * FLAT_FIELD_ONE};
+    uint8_t in8[40], out8[40];
+    uint16_t line8[40];
+    for (int k = 0; k < 40; ++k)
+        in8[k] = (uint8_t)(k * 6);
+    flat_field_init(&flat, gains8, 1, 2, 40, 1, 1, 1);
+    flat_field_apply_row(&flat, 0, in8, out8, 8, line8);
+    int saturation_errors = 0;
+    for (int k = 0; k < 40; ++k)
+        saturation_errors += out8[k] != (k * 18 > 255 ? 255 : k * 18);
+    flat_field_free(&flat);
+
+    clock_t start = clock();
+    uint16_t *line = malloc(sizeof(uint16_t) * width);
+    flat_field_init(&flat, low, grid * 2, grid * 2, width, height, 1, 2);
+    for (int y = 0; y < height; ++y)
+        flat_field_apply_row(&flat, y, frame + (size_t)y * width, full + (size_t)y * width, 12, line);
+    double ms = 1000.0 * (clock() - start) / CLOCKS_PER_SEC;
+    flat_field_free(&flat);
+
+    printf("full map worst error %d, low resolution map worst error %d, 8-bit saturation errors %d, %.1f ms/frame\n",
+           full_error, low_error, saturation_errors, ms);
+
+    free(frame);
+    free(reference);
+    free(full);
+    free(low);
+    free(line);
+    /* The low resolution map adds the bilinear interpolation error of the vignetting, 0.25 % of full scale */
+    return full_error > 1 || low_error > 10 || saturation_errors != 0;
+}
+
+#endif
@@ -0,0 +1,341 @@
+#include "module.h"
+#include "util.h"
+#include "cache.h"
+#include "calibration.h"
+#include <opencv2/opencv.hpp>
+#include <vector>
+
+/* Define custom error codes */
+enum ERROR_CODE {
+    MALLOC_ERR = 1,
+    INVALID_INPUT = 2,
+    INVALID_PARAM = 3,
+    CALIBRATION_ERR = 4,
+    CACHE_ERR = 5,
+    OPENCV_ERR = 6,
+};
+
+/* Part of the cache key, bump it when the layout or the meaning of the cached maps changes */
+#define GEOMETRY_MAP_VERSION 1
+/* Upper bound on the samples per output pixel and axis when the output is downscaled */
+#define GEOMETRY_MAX_SUPERSAMPLE 8
+/* Output tile processed by one task, small enough for its source region to stay in cache */
+#define GEOMETRY_TILE_WIDTH 256
+#define GEOMETRY_TILE_HEIGHT 32
+
+/* Everything the composed map depends on apart from the calibration, hashed into the cache key */
+typedef struct Geometry {
+    int32_t version;
+    int32_t input_width;
+    int32_t input_height;
+    int32_t undistort;
+    int32_t rotate;
+    int32_t crop_x;
+    int32_t crop_y;
+    int32_t crop_width;
+    int32_t crop_height;
+    int32_t output_width;
+    int32_t output_height;
+    int32_t supersample;
+} Geometry;
+
+/* Composed backward maps for one geometry: supersample^2 pairs of fixed-point maps (CV_16SC2 source
+   coordinates and CV_16UC1 interpolation table index), one pair per sample offset inside an output pixel */
+typedef struct GeometryMaps {
+    Geometry geometry;
+    CacheFile cache;
+    std::vector<cv::Mat> map1;
+    std::vector<cv::Mat> map2;
+} GeometryMaps;
+
+/* Distorted source position of an undistorted pixel position, the model of cv::initUndistortRectifyMap
+   with the camera matrix kept as the new camera matrix */
+static inline void distort_point(const CameraCalibration *calibration, double u, double v, float *src_x, float *src_y)
+{
+    const double *K = calibration->K;
+    const double *D = calibration->D;
+    double y = (v - K[5]) / K[4];
+    double x = (u - K[2] - K[1] * y) / K[0];
+    double r2 = x * x + y * y;
+    double radial = 1.0 + ((D[4] * r2 + D[1]) * r2 + D[0]) * r2;
+    double xd = x * radial + 2.0 * D[2] * x * y + D[3] * (r2 + 2.0 * x * x);
+    double yd = y * radial + D[2] * (r2 + 2.0 * y * y) + 2.0 * D[3] * x * y;
+    *src_x = (float)(K[0] * xd + K[1] * yd + K[2]);
+    *src_y = (float)(K[4] * yd + K[5]);
+}
+
+/*
+ * Backward map of one sample offset: output pixel -> resize -> crop -> 180 degree rotation -> undistortion
+ * -> input pixel. Coordinates are pixel centres, so the resize matches cv::resize and the rotation is an
+ * exact flip of the frame.
+ */
+static void build_map(const Geometry *geometry, const CameraCalibration *calibration, int sample_x, int sample_y,
+                      cv::Mat &map_x, cv::Mat &map_y)
+{
+    int n = geometry->supersample;
+    double scale_x = (double)geometry->crop_width / geometry->output_width;
+    double scale_y = (double)geometry->crop_height / geometry->output_height;
+    double offset_x = (sample_x + 0.5) / n;
+    double offset_y = (sample_y + 0.5) / n;
+
+    for (int v = 0; v < geometry->output_height; ++v)
+    {
+        float *row_x = map_x.ptr<float>(v);
+        float *row_y = map_y.ptr<float>(v);
+        double y = (v + offset_y) * scale_y - 0.5 + geometry->crop_y;
+        if (geometry->rotate)
+            y = geometry->input_height - 1 - y;
+        for (int u = 0; u < geometry->output_width; ++u)
+        {
+            double x = (u + offset_x) * scale_x - 0.5 + geometry->crop_x;
+            if (geometry->rotate)
+                x = geometry->input_width - 1 - x;
+            if (geometry->undistort)
+                distort_point(calibration, x, y, &row_x[u], &row_y[u]);
+            else
+            {
+                row_x[u] = (float)x;
+                row_y[u] = (float)y;
+            }
+        }
+    }
+}
+
+/* Map the composed maps of a geometry from the cache, building and caching them on a miss */
+static void load_geometry_maps(GeometryMaps *maps, const Geometry *geometry, const CameraCalibration *calibration,
+                               const char *cache_dir)
+{
+    uint64_t key = cache_hash(geometry, sizeof(*geometry), 0);
+    if (geometry->undistort)
+        key = cache_hash(calibration, sizeof(*calibration), key);
+
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/geometry_%dx%d_%dx%d_%016llx.map", cache_dir, geometry->input_width,
+             geometry->input_height, geometry->output_width, geometry->output_height, (unsigned long long)key);
+
+    int width = geometry->output_width;
+    int height = geometry->output_height;
+    int num_samples = geometry->supersample * geometry->supersample;
+    size_t map1_size = (size_t)width * height * 2 * sizeof(int16_t);
+    size_t map2_size = (size_t)width * height * sizeof(uint16_t);
+    int status = cache_open(&maps->cache, path, key, (map1_size + map2_size) * num_samples);
+    if (status < 0)
+        signal_error_and_exit(CACHE_ERR);
+
+    maps->geometry = *geometry;
+    maps->map1.clear();
+    maps->map2.clear();
+    unsigned char *data = (unsigned char *)maps->cache.data;
+    for (int s = 0; s < num_samples; ++s)
+    {
+        unsigned char *sample_data = data + (map1_size + map2_size) * s;
+        maps->map1.push_back(cv::Mat(height, width, CV_16SC2, sample_data));
+        maps->map2.push_back(cv::Mat(height, width, CV_16UC1, sample_data + map1_size));
+    }
+
+    if (status == 0)
+    {
+        try
+        {
+            cv::Mat map_x(height, width, CV_32FC1);
+            cv::Mat map_y(height, width, CV_32FC1);
+            for (int s = 0; s < num_samples; ++s)
+            {
+                build_map(geometry, calibration, s % geometry->supersample, s / geometry->supersample, map_x, map_y);
+                cv::convertMaps(map_x, map_y, maps->map1[s], maps->map2[s], CV_16SC2);
+            }
+        }
+        catch (const cv::Exception &)
+        {
+            signal_error_and_exit(OPENCV_ERR);
+        }
+        if (cache_commit(&maps->cache) != 0)
+            signal_error_and_exit(CACHE_ERR);
+    }
+}
+
+/* One remap pass over the output, in tiles spread over the OpenCV worker threads. With several samples per
+   pixel the samples of a tile are averaged in a float accumulator before the single conversion to output. */
+static void apply_geometry(const cv::Mat &input_image, cv::Mat &output_image, const GeometryMaps *maps)
+{
+    int width = output_image.cols;
+    int height = output_image.rows;
+    int tiles_x = (width + GEOMETRY_TILE_WIDTH - 1) / GEOMETRY_TILE_WIDTH;
+    int tiles_y = (height + GEOMETRY_TILE_HEIGHT - 1) / GEOMETRY_TILE_HEIGHT;
+    int num_samples = (int)maps->map1.size();
+
+    cv::parallel_for_(cv::Range(0, tiles_x * tiles_y), [&](const cv::Range &range) {
+        cv::Mat sample, sum;
+        for (int t = range.start; t < range.end; ++t)
+        {
+            int x = (t % tiles_x) * GEOMETRY_TILE_WIDTH;
+            int y = (t / tiles_x) * GEOMETRY_TILE_HEIGHT;
+            cv::Rect tile(x, y, std::min(GEOMETRY_TILE_WIDTH, width - x), std::min(GEOMETRY_TILE_HEIGHT, height - y));
+            cv::Mat output_tile = output_image(tile);
+
+            if (num_samples == 1)
+            {
+                cv::remap(input_image, output_tile, maps->map1[0](tile), maps->map2[0](tile), cv::INTER_LINEAR,
+                          cv::BORDER_CONSTANT);
+                continue;
+            }
+
+            sum.create(tile.size(), CV_MAKETYPE(CV_32F, input_image.channels()));
+            sum.setTo(cv::Scalar::all(0));
+            for (int s = 0; s < num_samples; ++s)
+            {
+                cv::remap(input_image, sample, maps->map1[s](tile), maps->map2[s](tile), cv::INTER_LINEAR,
+                          cv::BORDER_CONSTANT);
+                cv::accumulate(sample, sum);
+            }
+            sum.convertTo(output_tile, output_image.type(), 1.0 / num_samples);
+        }
+    });
+}
+
+/* START MODULE IMPLEMENTATION */
+void module()
+{
+    /* Get number of images in input batch */
+    int num_images = get_input_num_images();
+
+    int undistort = get_param_bool("undistort");
+    int rotate = get_param_bool("rotate_180");
+    int crop_x = get_param_int("crop_x");
+    int crop_y = get_param_int("crop_y");
+    int crop_width = get_param_int("crop_width");
+    int crop_height = get_param_int("crop_height");
+    int target_size = get_param_int("target_size");
+    int threads = get_param_int("geometry_threads");
+    const char *cache_dir = get_param_string("remap_cache");
+    if (crop_x < 0 || crop_y < 0 || crop_width < 0 || crop_height < 0 || target_size < 0 || threads < 0)
+        signal_error_and_exit(INVALID_PARAM);
+
+    CameraCalibration calibration;
+    memset(&calibration, 0, sizeof(calibration));
+    if (undistort
+        && calibration_load_camera(&calibration, get_param_string("calibration"), get_param_string("camera_matrix"),
+                                   get_param_string("distortion_coeffs")) != 0)
+        signal_error_and_exit(CALIBRATION_ERR);
+    if (threads > 0)
+        cv::setNumThreads(threads);
+
+    GeometryMaps maps;
+    memset(&maps.geometry, 0, sizeof(maps.geometry));
+
+    for (int i = 0; i < num_images; ++i)
+    {
+        Metadata *input_meta = get_metadata(i);
+        int height = input_meta->height;
+        int width = input_meta->width;
+        int channels = input_meta->channels;
+        int bits_pixel = input_meta->bits_pixel;
+        int bytes_per_sample = bits_pixel > 8 ? 2 : 1;
+
+        if (width <= 0 || height <= 0 || channels < 1 || channels > 4 || bits_pixel < 1 || bits_pixel > 16)
+            signal_error_and_exit(INVALID_INPUT);
+        /* A frame already rotated by demosaic (demosaic_rotate) would be turned back upright */
+        if (rotate && has_custom_metadata(input_meta, "orientation"))
+            signal_error_and_exit(INVALID_PARAM);
+
+        const unsigned char *input_image_data;
+        size_t size = get_image_view(i, &input_image_data);
+        if (size != (size_t)width * height * channels * bytes_per_sample)
+            signal_error_and_exit(INVALID_INPUT);
+
+        /* Crop of 0 x 0 keeps the rest of the frame, in the orientation after the rotation */
+        Geometry geometry;
+        memset(&geometry, 0, sizeof(geometry));
+        geometry.version = GEOMETRY_MAP_VERSION;
+        geometry.input_width = width;
+        geometry.input_height = height;
+        geometry.undistort = undistort;
+        geometry.rotate = rotate;
+        geometry.crop_x = crop_x;
+        geometry.crop_y = crop_y;
+        geometry.crop_width = crop_width > 0 ? crop_width : width - crop_x;
+        geometry.crop_height = crop_height > 0 ? crop_height : height - crop_y;
+        if (geometry.crop_width <= 0 || geometry.crop_height <= 0 || crop_x + geometry.crop_width > width
+            || crop_y + geometry.crop_height > height)
+            signal_error_and_exit(INVALID_PARAM);
+
+        /* Fit within target_size while preserving aspect ratio, as the resize module does */
+        double scale = 1.0;
+        if (target_size > 0)
+            scale = std::min((double)target_size / geometry.crop_width, (double)target_size / geometry.crop_height);
+        geometry.output_width = (int)(geometry.crop_width * scale);
+        geometry.output_height = (int)(geometry.crop_height * scale);
+        if (geometry.output_width <= 0 || geometry.output_height <= 0)
+            signal_error_and_exit(INVALID_PARAM);
+        /* A downscale averages a grid of samples per output pixel, so a thumbnail does not alias */
+        geometry.supersample = scale < 1.0 ? std::min((int)std::ceil(1.0 / scale), GEOMETRY_MAX_SUPERSAMPLE) : 1;
+
+        /* The maps are reused for every frame with the same geometry */
+        if (memcmp(&geometry, &maps.geometry, sizeof(geometry)) != 0)
+        {
+            if (maps.geometry.version != 0)
+                cache_close(&maps.cache);
+            load_geometry_maps(&maps, &geometry, &calibration, cache_dir);
+        }
+
+        int output_width = geometry.output_width;
+        int output_height = geometry.output_height;
+        size_t output_size = (size_t)output_width * output_height * channels * bytes_per_sample;
+
+        /* Create image metadata before appending */
+        Metadata new_meta = METADATA__INIT;
+        new_meta.size = output_size;
+        new_meta.width = output_width;
+        new_meta.height = output_height;
+        new_meta.channels = channels;
+        new_meta.timestamp = input_meta->timestamp;
+        new_meta.bits_pixel = bits_pixel;
+        new_meta.camera = input_meta->camera;
+        new_meta.obid = input_meta->obid;
+        if (undistort)
+            add_custom_metadata_bool(&new_meta, "distortion_corrected", 1);
+        if (rotate)
+            add_custom_metadata_string(&new_meta, "orientation", "flipped_vertical");
+        if (target_size > 0)
+            add_custom_metadata_int(&new_meta, "resized", target_size);
+        copy_custom_metadata(&new_meta, input_meta, NULL);
+
+        /* The remap writes straight into the result batch */
+        unsigned char *output_image_data = reserve_result_image(output_size, &new_meta);
+        if (output_image_data == NULL)
+            signal_error_and_exit(MALLOC_ERR);
+
+        int type = CV_MAKETYPE(bytes_per_sample == 2 ? CV_16U : CV_8U, channels);
+        try
+        {
+            cv::Mat input_image(height, width, type, (void *)input_image_data);
+            cv::Mat output_image(output_height, output_width, type, output_image_data);
+            apply_geometry(input_image, output_image, &maps);
+        }
+        catch (const cv::Exception &)
+        {
+            signal_error_and_exit(OPENCV_ERR);
+        }
+    }
+
+    if (maps.geometry.version != 0)
+        cache_close(&maps.cache);
+}
+/* END MODULE IMPLEMENTATION */
+
+/* Main function of module (NO NEED TO MODIFY) */
+extern "C" ImageBatch run(ImageBatch *input_batch, ModuleParameterList *module_parameter_list, int *ipc_error_pipe)
+{
+    ImageBatch result_batch;
+    result = &result_batch;
+    input = input_batch;
+    config = module_parameter_list;
+    error_pipe = ipc_error_pipe;
+    initialize();
+
+    module();
+
+    finalize();
+
+    return result_batch;
+}
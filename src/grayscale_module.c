@@ -0,0 +1,261 @@
+#include "module.h"
+#include "util.h"
+#include <time.h>
+
+#ifdef __ARM_NEON
+#include <arm_neon.h>
+#endif
+
+/* Define custom error codes in the range of 1-99*/
+enum ERROR_CODE {
+    MALLOC_ERR = 1,
+    INVALID_INPUT = 2,
+};
+
+/* BT.601 luma weights (0.299 R + 0.587 G + 0.114 B) in fixed point, each set sums to exactly 1.0 */
+#define LUMA_SHIFT_8 8
+#define LUMA_R_8 77
+#define LUMA_G_8 150
+#define LUMA_B_8 29
+#define LUMA_SHIFT_16 15
+#define LUMA_R_16 9798
+#define LUMA_G_16 19235
+#define LUMA_B_16 3735
+
+/* Weights in memory order of the first three channels */
+typedef struct LumaWeights {
+    uint16_t w8[3];
+    uint16_t w16[3];
+} LumaWeights;
+
+static void get_luma_weights(Metadata *meta, LumaWeights *weights)
+{
+    int bgr = has_custom_metadata(meta, "channel_order")
+        && strcmp(get_custom_metadata_string(meta, "channel_order"), "bgr") == 0;
+
+    weights->w8[0] = bgr ? LUMA_B_8 : LUMA_R_8;
+    weights->w8[1] = LUMA_G_8;
+    weights->w8[2] = bgr ? LUMA_R_8 : LUMA_B_8;
+    weights->w16[0] = bgr ? LUMA_B_16 : LUMA_R_16;
+    weights->w16[1] = LUMA_G_16;
+    weights->w16[2] = bgr ? LUMA_R_16 : LUMA_B_16;
+}
+
+/* 8-bit pixels with 3 or 4 interleaved channels to luma, the fourth channel is ignored */
+static void luma_u8(const uint8_t *src, uint8_t *dst, size_t num_pixels, int channels, const uint16_t w[3])
+{
+    size_t i = 0;
+#ifdef __ARM_NEON
+    /* 16 pixels per iteration: de-interleaving loads, widening multiply-accumulate, rounding narrow */
+    uint8x8_t w0 = vdup_n_u8(w[0]), w1 = vdup_n_u8(w[1]), w2 = vdup_n_u8(w[2]);
+    for (; i + 16 <= num_pixels; i += 16)
+    {
+        uint8x16_t c0, c1, c2;
+        if (channels == 4)
+        {
+            uint8x16x4_t p = vld4q_u8(src + i * 4);
+            c0 = p.val[0], c1 = p.val[1], c2 = p.val[2];
+        }
+        else
+        {
+            uint8x16x3_t p = vld3q_u8(src + i * 3);
+            c0 = p.val[0], c1 = p.val[1], c2 = p.val[2];
+        }
+        uint16x8_t lo = vmull_u8(vget_low_u8(c0), w0);
+        uint16x8_t hi = vmull_u8(vget_high_u8(c0), w0);
+        lo = vmlal_u8(lo, vget_low_u8(c1), w1);
+        hi = vmlal_u8(hi, vget_high_u8(c1), w1);
+        lo = vmlal_u8(lo, vget_low_u8(c2), w2);
+        hi = vmlal_u8(hi, vget_high_u8(c2), w2);
+        vst1q_u8(dst + i, vcombine_u8(vrshrn_n_u16(lo, LUMA_SHIFT_8), vrshrn_n_u16(hi, LUMA_SHIFT_8)));
+    }
+#endif
+    for (; i < num_pixels; ++i)
+    {
+        const uint8_t *p = src + i * channels;
+        dst[i] = (uint8_t)((w[0] * p[0] + w[1] * p[1] + w[2] * p[2] + (1 << (LUMA_SHIFT_8 - 1))) >> LUMA_SHIFT_8);
+    }
+}
+
+/* 16-bit container version, the same for any bit depth up to 16 */
+static void luma_u16(const uint16_t *src, uint16_t *dst, size_t num_pixels, int channels, const uint16_t w[3])
+{
+    size_t i = 0;
+#ifdef __ARM_NEON
+    uint16x4_t w0 = vdup_n_u16(w[0]), w1 = vdup_n_u16(w[1]), w2 = vdup_n_u16(w[2]);
+    for (; i + 8 <= num_pixels; i += 8)
+    {
+        uint16x8_t c0, c1, c2;
+        if (channels == 4)
+        {
+            uint16x8x4_t p = vld4q_u16(src + i * 4);
+            c0 = p.val[0], c1 = p.val[1], c2 = p.val[2];
+        }
+        else
+        {
+            uint16x8x3_t p = vld3q_u16(src + i * 3);
+            c0 = p.val[0], c1 = p.val[1], c2 = p.val[2];
+        }
+        uint32x4_t lo = vmull_u16(vget_low_u16(c0), w0);
+        uint32x4_t hi = vmull_u16(vget_high_u16(c0), w0);
+        lo = vmlal_u16(lo, vget_low_u16(c1), w1);
+        hi = vmlal_u16(hi, vget_high_u16(c1), w1);
+        lo = vmlal_u16(lo, vget_low_u16(c2), w2);
+        hi = vmlal_u16(hi, vget_high_u16(c2), w2);
+        vst1q_u16(dst + i, vcombine_u16(vrshrn_n_u32(lo, LUMA_SHIFT_16), vrshrn_n_u32(hi, LUMA_SHIFT_16)));
+    }
+#endif
+    for (; i < num_pixels; ++i)
+    {
+        const uint16_t *p = src + i * channels;
+        uint32_t sum = (uint32_t)w[0] * p[0] + (uint32_t)w[1] * p[1] + (uint32_t)w[2] * p[2];
+        dst[i] = (uint16_t)((sum + (1u << (LUMA_SHIFT_16 - 1))) >> LUMA_SHIFT_16);
+    }
+}
+
+/* START MODULE IMPLEMENTATION */
+void module()
+{
+    /* Get number of images in input batch */
+    int num_images = get_input_num_images();
+
+    /* The channel order no longer applies to the gray result */
+    static const char *const skip_keys[] = {"channel_order", NULL};
+
+    for (int i = 0; i < num_images; ++i)
+    {
+        Metadata *input_meta = get_metadata(i);
+        int width = input_meta->width;
+        int height = input_meta->height;
+        int channels = input_meta->channels;
+        int bits_pixel = input_meta->bits_pixel;
+        int bytes_per_sample = bits_pixel > 8 ? 2 : 1;
+
+        if (width <= 0 || height <= 0 || bits_pixel < 1 || bits_pixel > 16
+            || (channels != 1 && channels != 3 && channels != 4))
+            signal_error_and_exit(INVALID_INPUT);
+
+        const unsigned char *input_image_data;
+        size_t input_image_size = get_image_view(i, &input_image_data);
+        size_t num_pixels = (size_t)width * height;
+        if (input_image_size != num_pixels * channels * bytes_per_sample)
+            signal_error_and_exit(INVALID_INPUT);
+
+        size_t output_image_size = num_pixels * bytes_per_sample;
+
+        Metadata new_meta = METADATA__INIT;
+        new_meta.size = output_image_size;
+        new_meta.width = width;
+        new_meta.height = height;
+        new_meta.channels = 1;
+        new_meta.timestamp = input_meta->timestamp;
+        new_meta.bits_pixel = bits_pixel;
+        new_meta.camera = input_meta->camera;
+        new_meta.obid = input_meta->obid;
+        copy_custom_metadata(&new_meta, input_meta, skip_keys);
+
+        /* Gray images are passed on as they are */
+        if (channels == 1)
+        {
+            append_result_image((unsigned char *)input_image_data, output_image_size, &new_meta);
+            continue;
+        }
+
+        /* Luma is written straight into the result batch, there is no temporary output image */
+        unsigned char *output_image_data = reserve_result_image(output_image_size, &new_meta);
+        if (output_image_data == NULL)
+            signal_error_and_exit(MALLOC_ERR);
+
+        LumaWeights weights;
+        get_luma_weights(input_meta, &weights);
+        if (bytes_per_sample == 2)
+            luma_u16((const uint16_t *)input_image_data, (uint16_t *)output_image_data, num_pixels, channels, weights.w16);
+        else
+            luma_u8(input_image_data, output_image_data, num_pixels, channels, weights.w8);
+    }
+}
+/* END MODULE IMPLEMENTATION */
+
+/* Main function of module (NO NEED TO MODIFY) */
+ImageBatch run(ImageBatch *input_batch, ModuleParameterList *module_parameter_list, int *ipc_error_pipe)
+{
+    ImageBatch result_batch;
+    result = &result_batch;
+    input = input_batch;
+    config = module_parameter_list;
+    error_pipe = ipc_error_pipe;
+    initialize();
+
+    module();
+
+    finalize();
+
+    return result_batch;
+}
+
+#ifdef TESTING_MODULE_STANDALONE
+
+static double elapsed_ms(const struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1e3 + (now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+/* Host-side check of the kernels against the floating point formula, and their throughput */
+int main(void)
+{
+    const size_t num_pixels = 2464 * 2056;
+    const uint16_t w8[3] = {LUMA_R_8, LUMA_G_8, LUMA_B_8};
+    const uint16_t w16[3] = {LUMA_R_16, LUMA_G_16, LUMA_B_16};
+    int failures = 0;
+
+    for (int channels = 3; channels <= 4; ++channels)
+    {
+        uint8_t *src8 = malloc(num_pixels * channels);
+        uint16_t *src16 = malloc(num_pixels * channels * 2);
+        uint8_t *dst8 = malloc(num_pixels);
+        uint16_t *dst16 = malloc(num_pixels * 2);
+        for (size_t k = 0; k < num_pixels * channels; ++k)
+        {
+            src8[k] = rand();
+            src16[k] = rand();
+        }
+        /* Extremes must not overflow */
+        memset(src8, 0xFF, 64 * channels);
+        memset(src16, 0xFF, 64 * channels * 2);
+
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        luma_u8(src8, dst8, num_pixels, channels, w8);
+        double ms8 = elapsed_ms(&start);
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        luma_u16(src16, dst16, num_pixels, channels, w16);
+        double ms16 = elapsed_ms(&start);
+
+        int max_error8 = 0, max_error16 = 0;
+        for (size_t k = 0; k < num_pixels; ++k)
+        {
+            const uint8_t *p8 = src8 + k * channels;
+            const uint16_t *p16 = src16 + k * channels;
+            int ref8 = (int)(0.299 * p8[0] + 0.587 * p8[1] + 0.114 * p8[2] + 0.5);
+            int ref16 = (int)(0.299 * p16[0] + 0.587 * p16[1] + 0.114 * p16[2] + 0.5);
+            if (abs(dst8[k] - ref8) > max_error8)
+                max_error8 = abs(dst8[k] - ref8);
+            if (abs(dst16[k] - ref16) > max_error16)
+                max_error16 = abs(dst16[k] - ref16);
+        }
+        failures += max_error8 > 1 || max_error16 > 2 || dst8[0] != 255 || dst16[0] != 65535;
+
+        printf("%d channels: 8-bit %.0f MB/s (max error %d), 16-bit %.0f MB/s (max error %d)\n", channels,
+               num_pixels * channels / ms8 / 1e3, max_error8, num_pixels * channels * 2 / ms16 / 1e3, max_error16);
+
+        free(src8);
+        free(src16);
+        free(dst8);
+        free(dst16);
+    }
+    return failures != 0;
+}
+
+#endif
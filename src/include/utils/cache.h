@@ -0,0 +1,58 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Memory-mapped cache file holding one block of precomputed data, identified by a 64-bit key */
+typedef struct CacheFile {
+    int fd;
+    unsigned char *map;
+    size_t map_size;
+    void *data;  /* Start of the cached data, size bytes */
+    size_t size;
+    int writable;
+    char path[4096];
+    char tmp_path[4096];
+} CacheFile;
+
+/**
+ * 64-bit FNV-1a hash, for building cache keys from everything the cached data depends on.
+ *
+ * @param data Data to hash
+ * @param size Size of the data
+ * @param seed Previous hash to chain several fields, or 0 to start
+ */
+uint64_t cache_hash(const void *data, size_t size, uint64_t seed);
+
+/**
+ * Open a cache file. If path holds data with the same key and size, it is mapped read-only and
+ * 1 is returned. Otherwise a temporary file is created next to it and mapped writable, 0 is
+ * returned, and the caller fills cache->data and publishes it with cache_commit.
+ *
+ * @return 1 on a hit, 0 on a miss, -1 on error
+ */
+int cache_open(CacheFile *cache, const char *path, uint64_t key, size_t size);
+
+/**
+ * Publish the data written after a miss: it is synced and the temporary file is renamed over the
+ * cache file, so a crash never leaves a partly written cache behind. The data stays mapped.
+ *
+ * @return 0 on success, -1 on error
+ */
+int cache_commit(CacheFile *cache);
+
+/**
+ * Unmap and close a cache file. An uncommitted temporary file is removed.
+ */
+void cache_close(CacheFile *cache);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,121 @@
+#ifndef CALIBRATION_H
+#define CALIBRATION_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef enum CalibrationType {
+    CALIBRATION_F64 = 1,
+    CALIBRATION_F32 = 2,
+    CALIBRATION_U16 = 3,
+} CalibrationType;
+
+/* Directory entry of a named array in a calibration file, 64 bytes */
+typedef struct CalibrationArray {
+    char name[40];
+    uint32_t type;    /* CalibrationType */
+    uint32_t rows;
+    uint32_t cols;
+    uint32_t reserved;
+    uint64_t offset;  /* From the start of the file, 64-byte aligned */
+} CalibrationArray;
+
+/* Calibration file mapped read-only, the arrays are used in place */
+typedef struct CalibrationFile {
+    int fd;
+    unsigned char *map;
+    size_t map_size;
+    uint32_t count;
+    const CalibrationArray *arrays;
+} CalibrationFile;
+
+/* Camera matrix K (3x3, row-major) and distortion coefficients D (k1, k2, p1, p2, k3) */
+typedef struct CameraCalibration {
+    double K[9];
+    double D[5];
+} CameraCalibration;
+
+/* Text file with the values of one array (separated by spaces, commas or new lines), imported into the
+   calibration file when the calibration file is missing or older than the text file */
+typedef struct CalibrationSource {
+    const char *name;
+    const char *path;  /* NULL or empty to only use the calibration file */
+    uint32_t type;
+    uint32_t rows;
+    uint32_t cols;
+} CalibrationSource;
+
+/**
+ * Map a calibration file and verify its checksum.
+ *
+ * @return 0 on success, -1 if the file does not exist, -2 if it is invalid (bad magic, version, size or checksum)
+ */
+int calibration_open(CalibrationFile *file, const char *path);
+
+/**
+ * Map a calibration file, first importing the given text files into it if it is missing or older than one
+ * of them. Arrays of the file that are not in sources are kept, so several modules can share one file.
+ * Text is only parsed on the first run after a calibration change.
+ *
+ * @return 0 on success, -1 if the file is missing and cannot be imported, -2 if a file is invalid
+ */
+int calibration_load(CalibrationFile *file, const char *path, const CalibrationSource *sources, uint32_t count);
+
+/**
+ * Write a calibration file. It is written next to the old one and renamed over it, so a crash leaves
+ * either the old or the new file.
+ *
+ * @param arrays Name, type and size of each array, the offsets are set by the function
+ * @param data Data of each array
+ * @return 0 on success, -1 on failure
+ */
+int calibration_save(const char *path, const CalibrationArray *arrays, const void *const *data, uint32_t count);
+
+/**
+ * Find an array by name.
+ *
+ * @return Directory entry of the array, NULL if it is not in the file
+ */
+const CalibrationArray *calibration_find(const CalibrationFile *file, const char *name);
+
+/**
+ * Find an array by name and check its type and size.
+ *
+ * @return Pointer to the data of the array inside the mapping, NULL if it is not in the file or differs
+ */
+const void *calibration_get(const CalibrationFile *file, const char *name, uint32_t type, uint32_t rows, uint32_t cols);
+
+/**
+ * Pointer to the data of an array inside the mapping, valid until calibration_close.
+ */
+const void *calibration_data(const CalibrationFile *file, const CalibrationArray *array);
+
+/**
+ * Size of one element of a CalibrationType, 0 for an unknown type.
+ */
+size_t calibration_type_size(uint32_t type);
+
+/**
+ * Unmap and close a calibration file.
+ */
+void calibration_close(CalibrationFile *file);
+
+/**
+ * Copy the "camera_matrix" (3x3) and "distortion_coeffs" (1x5) arrays of a calibration file, importing
+ * the text files first if they are given and changed. The file is closed again before returning.
+ *
+ * @param matrix_path, coeffs_path Text files of K and D, NULL or empty to only use the calibration file
+ * @return 0 on success, -1 if the calibration file cannot be loaded, -2 if K or D is missing or has the wrong size
+ */
+int calibration_load_camera(CameraCalibration *camera, const char *path, const char *matrix_path,
+                            const char *coeffs_path);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,80 @@
+#ifndef DEFECT_MAP_H
+#define DEFECT_MAP_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+typedef enum DefectKind {
+    DEFECT_HOT = 1,    /* Reads brighter than its neighbours */
+    DEFECT_DEAD = 2,   /* Reads darker than its neighbours */
+    DEFECT_STUCK = 3,  /* Reads the same value whatever the scene */
+} DefectKind;
+
+typedef struct DefectEntry {
+    uint32_t position;  /* y * width + x */
+    uint16_t hits;      /* Confidence, raised each time the pixel is detected again and lowered when it is not */
+    uint8_t kind;       /* DefectKind */
+    uint8_t reserved;
+} DefectEntry;
+
+/* Sparse list of defective pixels, sorted by position */
+typedef struct DefectMap {
+    uint32_t width;
+    uint32_t height;
+    uint32_t generation;  /* Incremented every time the map is saved */
+    uint32_t count;
+    uint32_t capacity;
+    DefectEntry *entries;
+} DefectMap;
+
+/**
+ * Initialize an empty defect map for frames of the given size.
+ */
+void defect_map_init(DefectMap *map, uint32_t width, uint32_t height);
+
+/**
+ * Free the entries of a defect map.
+ */
+void defect_map_free(DefectMap *map);
+
+/**
+ * Load a defect map file written by defect_map_save.
+ *
+ * @return 0 on success, -1 if the file does not exist, -2 if it is invalid (bad magic, version or checksum)
+ */
+int defect_map_load(const char *path, DefectMap *map);
+
+/**
+ * Save a defect map and increment its generation. The file is written next to the old one and
+ * renamed over it, so a crash leaves either the old or the new map.
+ *
+ * @return 0 on success, -1 on failure
+ */
+int defect_map_save(const char *path, DefectMap *map);
+
+/**
+ * Find a position in the map.
+ *
+ * @return Index of the entry, -1 if the position is not in the map
+ */
+int defect_map_find(const DefectMap *map, uint32_t position);
+
+/**
+ * Merge one round of detection into the map. Detected positions already in the map gain a hit (up to
+ * max_hits) and take the detected kind, new positions enter with one hit, and map entries that were not
+ * detected lose a hit and are removed at zero, so defects that heal drop out of the map.
+ *
+ * @param detected Detected defects, sorted by position, their hits are ignored
+ * @param num_detected Number of detected defects
+ * @param max_hits Upper bound of the hits of an entry
+ */
+void defect_map_update(DefectMap *map, const DefectEntry *detected, uint32_t num_detected, uint16_t max_hits);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
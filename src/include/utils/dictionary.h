@@ -0,0 +1,23 @@
+#ifndef DICTIONARY_H
+#define DICTIONARY_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+
+/**
+ * Read a compression dictionary file trained offline (e.g. with `zstd --train`) into memory.
+ * An empty or NULL path means no dictionary: *dict is set to NULL and *dict_size to 0.
+ *
+ * @param dict Set to the dictionary, to be released with free
+ * @return 0 on success, -1 if the file is missing, empty or cannot be read, -2 on allocation failure
+ */
+int dictionary_load(const char *path, unsigned char **dict, size_t *dict_size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,75 @@
+#ifndef FLAT_FIELD_H
+#define FLAT_FIELD_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include "calibration.h"
+
+/* Gains are unsigned Q4.12 fixed point: 4096 is a gain of 1.0, the largest gain is just under 16 */
+#define FLAT_FIELD_SHIFT 12
+#define FLAT_FIELD_ONE (1 << FLAT_FIELD_SHIFT)
+
+/*
+ * Gain map for frames of one geometry. The map has the layout of the frame at a lower (or the same)
+ * resolution: channels are interleaved, and for CFA frames (step 2) it is itself a 2x2 mosaic, so every
+ * colour is interpolated from gains of the same colour. It is upsampled bilinearly, nodes at the frame
+ * corners, one row at a time while the frame is corrected.
+ */
+typedef struct FlatField {
+    int width;
+    int height;
+    int channels;
+    int step;              /* 2 for CFA frames, 1 otherwise */
+    int grid_width;        /* Gain nodes per row and colour */
+    int grid_height;       /* Gain nodes per column and colour */
+    const uint16_t *gains; /* grid_height * step rows of grid_width * step * channels gains */
+    uint16_t *rows;        /* Gain rows upsampled to the frame width, NULL if the map is full width */
+    int32_t *row_index;    /* Node row of each plane row */
+    uint16_t *row_weight;  /* Weight of the next node row, Q8 */
+} FlatField;
+
+/**
+ * Map the "flat_field" gain map (16-bit Q4.12) of a calibration file. If text_path is set, the text file
+ * (text_rows x text_cols gains) is imported into the calibration file first when it changed.
+ *
+ * @param rows, cols Size of the gain map
+ * @return Gains inside the mapping, NULL if the calibration file or the gain map is missing or invalid
+ */
+const uint16_t *flat_field_load(CalibrationFile *file, const char *path, const char *text_path, uint32_t text_rows,
+                                uint32_t text_cols, uint32_t *rows, uint32_t *cols);
+
+/**
+ * Prepare a gain map for frames of the given geometry. The gains are used in place and must stay valid
+ * until flat_field_free, e.g. a pointer into a calibration file.
+ *
+ * @param gains Gain map, rows x cols Q4.12 gains
+ * @param step 2 for raw CFA frames, 1 otherwise
+ * @return 0 on success, -1 if the map does not fit the frame layout, -2 on allocation failure
+ */
+int flat_field_init(FlatField *flat, const uint16_t *gains, uint32_t rows, uint32_t cols, int width, int height,
+                    int channels, int step);
+
+/**
+ * Apply the gains to one frame row: out = in * gain, rounded and saturated to max_value. src and dst
+ * may be the same row, so the correction can run on the rows of a frame while another stage reads them.
+ *
+ * @param y Row of the frame
+ * @param src Row of width * channels samples, 8-bit if bits_pixel <= 8 and 16-bit otherwise
+ * @param line Scratch buffer of width * channels gains
+ */
+void flat_field_apply_row(const FlatField *flat, int y, const void *src, void *dst, int bits_pixel,
+                          uint16_t *line);
+
+/**
+ * Free the buffers of a gain map (not the gains).
+ */
+void flat_field_free(FlatField *flat);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,67 @@
+#ifndef PHASH_H
+#define PHASH_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+typedef enum PerceptualHashType {
+    HASH_DHASH,
+    HASH_PHASH,
+} PerceptualHashType;
+
+/**
+ * Compute a 64-bit perceptual hash of an image from a tiny downsampled luminance version of it.
+ * Works on raw CFA frames as well as on demosaiced images: all channels, and every CFA colour,
+ * are averaged into the luminance.
+ *
+ * @param data Image data, 8-bit samples or 16-bit samples for bits_pixel > 8
+ * @param width Width of the image
+ * @param height Height of the image
+ * @param channels Number of interleaved channels
+ * @param bits_pixel Bits per sample
+ * @param type HASH_DHASH (gradient signs of a 9x8 grid) or HASH_PHASH (signs of the 8x8 low DCT
+ *             coefficients of a 32x32 grid against their median, more robust to noise and exposure)
+ *
+ * @return 64-bit hash, similar images have hashes with a small Hamming distance
+ */
+uint64_t compute_perceptual_hash(const unsigned char *data, int width, int height, int channels, int bits_pixel,
+                                 PerceptualHashType type);
+
+/**
+ * Hamming distance between two hashes.
+ */
+static inline int hash_distance(uint64_t a, uint64_t b)
+{
+    return __builtin_popcountll(a ^ b);
+}
+
+/**
+ * Hamming distances from one hash to a list of hashes, using the NEON byte popcount when available.
+ *
+ * @param hash Hash to compare
+ * @param hashes Hashes to compare against
+ * @param count Number of hashes
+ * @param distances Output, count distances (0 .. 64)
+ */
+void hash_distances(uint64_t hash, const uint64_t *hashes, int count, uint8_t *distances);
+
+/**
+ * Find the closest hash in a list.
+ *
+ * @param hash Hash to compare
+ * @param hashes Hashes to compare against
+ * @param count Number of hashes
+ * @param distance Output, distance to the closest hash (65 if count is 0)
+ *
+ * @return Index of the closest hash (the first one on ties), -1 if count is 0
+ */
+int nearest_hash(uint64_t hash, const uint64_t *hashes, int count, int *distance);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
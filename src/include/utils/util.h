@@ -81,6 +81,16 @@ int get_input_num_images();
  */
 size_t get_image_data(int index, unsigned char **out);
 
+/**
+ * Retrieves a read-only view of the data of an image at the specified index, without copying it.
+ * The view points into the input batch and must not be modified or freed.
+ *
+ * @param index Index of image
+ * @param out Pointer set to the start of the image data
+ * @return Size of image data
+ */
+size_t get_image_view(int index, const unsigned char **out);
+
 /**
  * Retrieves the metadata of an image at the specified index, allocating memory and returning the size of the metadata.
  *
@@ -130,6 +140,25 @@ void add_custom_metadata_float(Metadata *data, char *key, float val);
  */
 void add_custom_metadata_string(Metadata *data, char *key, char *val);
 
+/**
+ * Check whether a custom metadata value exists
+ *
+ * @param data Metadata to check
+ * @param key The name associated with the custom value
+ * @return 1 if the key is present, 0 otherwise
+ */
+int has_custom_metadata(Metadata *data, char *key);
+
+/**
+ * Copy the custom key-value pairs of one metadata to another.
+ * Keys that are already present in the destination are not overwritten.
+ *
+ * @param data Metadata that is to be added to
+ * @param src Metadata to copy the custom values from
+ * @param skip_keys NULL terminated list of keys that are not copied, or NULL to copy all
+ */
+void copy_custom_metadata(Metadata *data, Metadata *src, const char *const *skip_keys);
+
 /**
  * Get custom metadata value of type bool
  *
@@ -171,6 +200,17 @@ char *get_custom_metadata_string(Metadata *data, char *key);
  */
 void append_result_image(unsigned char *data, uint32_t data_size, Metadata *new_meta);
 
+/**
+ * Append an image to the resulting batch without its data, which the module then writes in place.
+ * The returned pointer is only valid until the next image is appended or reserved.
+ *
+ * @param data_size Size of the image data
+ * @param new_meta Pointer to the metadata
+ *
+ * @return Pointer to the image data inside the result batch
+ */
+unsigned char *reserve_result_image(uint32_t data_size, Metadata *new_meta);
+
 /**
  * Initialize module globals
 */
@@ -0,0 +1,155 @@
+#include "module.h"
+#include "util.h"
+#include <turbojpeg.h>
+#include <time.h>
+
+/* Define custom error codes */
+enum ERROR_CODE {
+    MALLOC_ERR = 1,
+    TJ_INIT = 2,
+    TJ_OPTIONS = 3,
+    TJ_COMPRESS = 4,
+    INVALID_INPUT = 5,
+    INVALID_PARAM = 6,
+};
+
+static double elapsed_ms(const struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1e3 + (now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+static int parse_subsampling(const char *name)
+{
+    if (strcmp(name, "444") == 0)
+        return TJSAMP_444;
+    if (strcmp(name, "422") == 0)
+        return TJSAMP_422;
+    if (strcmp(name, "420") == 0)
+        return TJSAMP_420;
+    if (strcmp(name, "440") == 0)
+        return TJSAMP_440;
+    if (strcmp(name, "411") == 0)
+        return TJSAMP_411;
+    signal_error_and_exit(INVALID_PARAM);
+    return -1;
+}
+
+/* TurboJPEG reads the samples in the order they are stored, so BGR input needs no conversion */
+static int pixel_format(Metadata *meta)
+{
+    int bgr = has_custom_metadata(meta, "channel_order")
+        && strcmp(get_custom_metadata_string(meta, "channel_order"), "bgr") == 0;
+
+    switch (meta->channels)
+    {
+    case 1:
+        return TJPF_GRAY;
+    case 3:
+        return bgr ? TJPF_BGR : TJPF_RGB;
+    case 4:
+        return bgr ? TJPF_BGRX : TJPF_RGBX;
+    default:
+        signal_error_and_exit(INVALID_INPUT);
+        return -1;
+    }
+}
+
+/* START MODULE IMPLEMENTATION */
+void module()
+{
+    /* Get number of images in input batch */
+    int num_images = get_input_num_images();
+
+    int quality = get_param_int("jpeg_quality");
+    int subsampling = parse_subsampling(get_param_string("subsampling"));
+    if (quality < 1 || quality > 100)
+        signal_error_and_exit(INVALID_PARAM);
+
+    tjhandle handle = tj3Init(TJINIT_COMPRESS);
+    if (handle == NULL)
+        signal_error_and_exit(TJ_INIT);
+
+    /* The output buffer is sized for the worst case and reused for every image of the batch */
+    if (tj3Set(handle, TJPARAM_QUALITY, quality) < 0 || tj3Set(handle, TJPARAM_NOREALLOC, 1) < 0)
+        signal_error_and_exit(TJ_OPTIONS);
+
+    unsigned char *output_buffer = NULL;
+    size_t output_capacity = 0;
+
+    for (int i = 0; i < num_images; ++i)
+    {
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        Metadata *input_meta = get_metadata(i);
+        if (input_meta->width <= 0 || input_meta->height <= 0 || input_meta->bits_pixel != 8)
+            signal_error_and_exit(INVALID_INPUT);
+        int format = pixel_format(input_meta);
+
+        const unsigned char *input_image_data;
+        size_t size = get_image_view(i, &input_image_data);
+        if (size != (size_t)input_meta->width * input_meta->height * input_meta->channels)
+            signal_error_and_exit(INVALID_INPUT);
+
+        int image_subsampling = format == TJPF_GRAY ? TJSAMP_GRAY : subsampling;
+        if (tj3Set(handle, TJPARAM_SUBSAMP, image_subsampling) < 0)
+            signal_error_and_exit(TJ_OPTIONS);
+
+        size_t needed = tj3JPEGBufSize(input_meta->width, input_meta->height, image_subsampling);
+        if (needed == 0)
+            signal_error_and_exit(INVALID_INPUT);
+        if (needed > output_capacity)
+        {
+            tj3Free(output_buffer);
+            output_buffer = (unsigned char *)tj3Alloc(needed);
+            if (output_buffer == NULL)
+                signal_error_and_exit(MALLOC_ERR);
+            output_capacity = needed;
+        }
+
+        size_t enc_size = output_capacity;
+        if (tj3Compress8(handle, input_image_data, input_meta->width, 0, input_meta->height, format,
+                         &output_buffer, &enc_size) < 0)
+            signal_error_and_exit(TJ_COMPRESS);
+
+        /* Create image metadata before appending */
+        Metadata new_meta = METADATA__INIT;
+        new_meta.size = enc_size;
+        new_meta.width = input_meta->width;
+        new_meta.height = input_meta->height;
+        new_meta.channels = input_meta->channels;
+        new_meta.timestamp = input_meta->timestamp;
+        new_meta.bits_pixel = input_meta->bits_pixel;
+        new_meta.camera = input_meta->camera;
+        new_meta.obid = input_meta->obid;
+        add_custom_metadata_string(&new_meta, "enc", "jpeg");
+        add_custom_metadata_float(&new_meta, "encode_ms", elapsed_ms(&start));
+
+        /* Append the image to the result batch */
+        append_result_image(output_buffer, enc_size, &new_meta);
+    }
+
+    /* Remember to free any allocated memory */
+    tj3Free(output_buffer);
+    tj3Destroy(handle);
+}
+/* END MODULE IMPLEMENTATION */
+
+/* Main function of module (NO NEED TO MODIFY) */
+ImageBatch run(ImageBatch *input_batch, ModuleParameterList *module_parameter_list, int *ipc_error_pipe)
+{
+    ImageBatch result_batch;
+    result = &result_batch;
+    input = input_batch;
+    config = module_parameter_list;
+    error_pipe = ipc_error_pipe;
+    initialize();
+
+    module();
+
+    finalize();
+
+    return result_batch;
+}
@@ -1,6 +1,8 @@
 #include "module.h"
 #include "util.h"
 #include <jxl/encode.h>
+#include <time.h>
+#include <math.h>
 
 /* Define custom error codes */
 enum ERROR_CODE {
@@ -12,101 +14,1476 @@ enum ERROR_CODE {
     JXL_ENC_SET_INFO = 6,
     JXL_ENC_ADD_IMAGE = 7,
     JXL_ENC_PROCESS = 8,
+    INVALID_INPUT = 9,
+    INVALID_PARAM = 10,
 };
 
-/* START MODULE IMPLEMENTATION */
-void module()
+/* Sample layout of an input image, derived from its metadata */
+typedef struct SampleLayout {
+    JxlPixelFormat format;
+    JxlBitDepth bit_depth;
+    uint32_t bits_per_sample;
+    uint32_t exponent_bits_per_sample;
+    size_t bytes_per_sample;
+    int bgr;
+} SampleLayout;
+
+/* Pick the JXL pixel format matching the samples described by the metadata */
+static void get_sample_layout(Metadata *meta, SampleLayout *layout)
 {
-    /* Get number of images in input batch */
-    int num_images = get_input_num_images();
+    int is_float = has_custom_metadata(meta, "sample_format")
+        && strcmp(get_custom_metadata_string(meta, "sample_format"), "float") == 0;
 
-    int effort = get_param_int("effort");
-    int resampling = get_param_int("resampling");
-    float distance = get_param_float("distance");
-    int lossless = distance == 0; 
+    layout->format.num_channels = meta->channels;
+    layout->format.endianness = JXL_NATIVE_ENDIAN;
+    layout->format.align = 0;
 
-    /* Example code for iterating a pixel value at a time */
-    for (int i = 0; i < num_images; ++i)
+    if (is_float && meta->bits_pixel == 16)
     {
-        Metadata *input_meta = get_metadata(i);
-        int size = input_meta->size;
-        int height = input_meta->height;
-        int width = input_meta->width;
-        int channels = input_meta->channels;
-        int timestamp = input_meta->timestamp;
-        int bits_pixel = input_meta->bits_pixel;
-        char *camera = input_meta->camera;
-        int obid = input_meta->obid;
+        layout->format.data_type = JXL_TYPE_FLOAT16;
+        layout->bytes_per_sample = 2;
+        layout->bits_per_sample = 16;
+        layout->exponent_bits_per_sample = 5;
+        layout->bit_depth.type = JXL_BIT_DEPTH_FROM_PIXEL_FORMAT;
+    }
+    else if (!is_float && meta->bits_pixel > 0 && meta->bits_pixel <= 16)
+    {
+        layout->format.data_type = meta->bits_pixel <= 8 ? JXL_TYPE_UINT8 : JXL_TYPE_UINT16;
+        layout->bytes_per_sample = meta->bits_pixel <= 8 ? 1 : 2;
+        layout->bits_per_sample = meta->bits_pixel;
+        layout->exponent_bits_per_sample = 0;
+        /* Samples are stored at their native depth (e.g. 12-bit in a 16-bit container),
+           so let the codestream bit depth define their range instead of rescaling them */
+        layout->bit_depth.type = JXL_BIT_DEPTH_FROM_CODESTREAM;
+    }
+    else
+    {
+        signal_error_and_exit(INVALID_INPUT);
+    }
 
-        unsigned char *input_image_data;
-        get_image_data(i, &input_image_data);
+    layout->bit_depth.bits_per_sample = layout->bits_per_sample;
+    layout->bit_depth.exponent_bits_per_sample = layout->exponent_bits_per_sample;
+    layout->bgr = meta->channels >= 3 && has_custom_metadata(meta, "channel_order")
+        && strcmp(get_custom_metadata_string(meta, "channel_order"), "bgr") == 0;
+}
 
-        JxlEncoder* encoder = JxlEncoderCreate(NULL); //initialize encoder
+/* Swap the first and third channel of every pixel in place (BGR <-> RGB) */
+static void swap_red_blue(unsigned char *data, size_t num_pixels, int channels, size_t bytes_per_sample)
+{
+    size_t pixel_stride = channels * bytes_per_sample;
+    size_t blue_offset = 2 * bytes_per_sample;
 
-        if (encoder == NULL)
-            signal_error_and_exit(JXL_ENC_ENCODER_CREATE);
+    if (bytes_per_sample == 1)
+    {
+        for (size_t p = 0; p < num_pixels; ++p, data += pixel_stride)
+        {
+            unsigned char tmp = data[0];
+            data[0] = data[blue_offset];
+            data[blue_offset] = tmp;
+        }
+        return;
+    }
 
-        JxlEncoderFrameSettings* settings = JxlEncoderFrameSettingsCreate(encoder, NULL); //creates settings object for configuring how frames are compressed
-        
-        if (JxlEncoderFrameSettingsSetOption(settings, JXL_ENC_FRAME_SETTING_EFFORT, effort)) //sets compression effort - from configuration
-            signal_error_and_exit(JXL_ENC_SET_OPTIONS);
+    for (size_t p = 0; p < num_pixels; ++p, data += pixel_stride)
+    {
+        uint16_t tmp;
+        memcpy(&tmp, data, sizeof(uint16_t));
+        memcpy(data, data + blue_offset, sizeof(uint16_t));
+        memcpy(data + blue_offset, &tmp, sizeof(uint16_t));
+    }
+}
 
-        if (JxlEncoderFrameSettingsSetOption(settings, JXL_ENC_FRAME_SETTING_RESAMPLING, resampling))// sets sampling strategy - from configuration
-            signal_error_and_exit(JXL_ENC_SET_OPTIONS);
+/* Drain the encoder output into a buffer, growing it until the codestream fits */
+static size_t process_output(JxlEncoder *encoder, uint8_t **output_buffer, size_t initial_size)
+{
+    size_t output_buffer_size = initial_size > 64 ? initial_size : 64;
+    *output_buffer = (uint8_t *)malloc(output_buffer_size);
+    if (*output_buffer == NULL)
+        signal_error_and_exit(MALLOC_ERR);
 
-        if (lossless && JxlEncoderSetFrameLossless(settings, JXL_TRUE)) //sets lossless
-            signal_error_and_exit(JXL_ENC_SET_LOSSLESS);
-
-        if (!lossless && JxlEncoderSetFrameDistance(settings, distance)) //sets lossy based on distance - from configuration
-            signal_error_and_exit(JXL_ENC_SET_DISTANCE);
-        
-        JxlBasicInfo basic_info; //image metadata
-        JxlEncoderInitBasicInfo(&basic_info);
-        if (lossless) basic_info.uses_original_profile = JXL_TRUE;
-        basic_info.xsize = width;
-        basic_info.ysize = height;
-        basic_info.num_color_channels = channels > 3 ? 3 : channels;
-        basic_info.num_extra_channels = channels - basic_info.num_color_channels;
-        basic_info.bits_per_sample = bits_pixel;
-        basic_info.alpha_bits = basic_info.num_extra_channels > 0 ? bits_pixel : 0;
-
-        JxlPixelFormat format = {channels, JXL_TYPE_UINT8, JXL_NATIVE_ENDIAN, 0}; 
-
-        if (JxlEncoderSetBasicInfo(encoder, &basic_info))
-            signal_error_and_exit(JXL_ENC_SET_INFO);
-        
-        if (JxlEncoderAddImageFrame(settings, &format, input_image_data, size)) //feeds raw pixel data to encoder for compression
-            signal_error_and_exit(JXL_ENC_ADD_IMAGE);
+    uint8_t *out_buf_next = *output_buffer;
+    size_t out_buf_remain = output_buffer_size;
+    JxlEncoderStatus status;
+    while ((status = JxlEncoderProcessOutput(encoder, &out_buf_next, &out_buf_remain)) == JXL_ENC_NEED_MORE_OUTPUT)
+    {
+        size_t offset = out_buf_next - *output_buffer;
+        output_buffer_size *= 2;
+        uint8_t *tmp = (uint8_t *)realloc(*output_buffer, output_buffer_size);
+        if (tmp == NULL)
+            signal_error_and_exit(MALLOC_ERR);
+        *output_buffer = tmp;
+        out_buf_next = *output_buffer + offset;
+        out_buf_remain = output_buffer_size - offset;
+    }
+
+    if (status != JXL_ENC_SUCCESS)
+        signal_error_and_exit(JXL_ENC_PROCESS);
+
+    return out_buf_next - *output_buffer; //calculate compressed size
+}
+
+/* Encoder settings shared by every frame, read from the module configuration */
+typedef struct EncodeParams {
+    int effort;
+    int resampling;
+    float distance;
+    int lossless;
+    int target_bytes;
+    int trial_effort;
+    int max_trials;
+    int progressive;
+    int chunked;
+} EncodeParams;
+
+/* Chunked frame input, reading tiles straight from the input batch view */
+typedef struct ChunkedSource {
+    const unsigned char *data;
+    size_t row_size;
+    size_t pixel_size;
+    size_t bytes_per_sample;
+    int channels;
+    int bgr;
+    JxlPixelFormat format;
+} ChunkedSource;
+
+/* Codestream written by the encoder through an output processor */
+typedef struct OutputSink {
+    uint8_t *data;
+    size_t capacity;
+    size_t position; /* where the next write goes, the encoder may seek back */
+    size_t end;      /* size of the codestream written so far */
+} OutputSink;
+
+/* Byte-budget rate control state, carried from one image to the next */
+typedef struct RateControl {
+    float distance;      /* distance chosen for the previous image */
+    double slope;        /* -d log(size) / d log(distance) */
+    double effort_ratio; /* final effort size / trial effort size */
+} RateControl;
+
+/* Outcome of the distance search for one image */
+typedef struct RateSearch {
+    float distance;          /* smallest distance fitting the scaled budget, 0 if none */
+    size_t distance_size;    /* trial size at that distance */
+    uint8_t *fallback;       /* largest trial within the real budget, NULL if none */
+    size_t fallback_size;
+    float fallback_distance;
+    int trials;
+} RateSearch;
+
+/* Bit position in a codestream being parsed for its layer offsets */
+typedef struct BitReader {
+    const uint8_t *data;
+    size_t size;
+    size_t bit;
+    int error; /* set when a field runs past the end or is not handled */
+} BitReader;
 
-        JxlEncoderCloseInput(encoder); //signalizes this is the end of the input
+/* Image header fields needed to lay out the frames */
+typedef struct ImageHeader {
+    uint32_t width;
+    uint32_t height;
+    int xyb_encoded;
+    uint32_t num_extra_channels;
+    int have_animation;
+    int have_timecodes;
+} ImageHeader;
+
+/* Section boundaries of one frame, relative to the end of its table of contents */
+typedef struct FrameLayout {
+    int is_last;
+    int single_section;  /* the whole frame is coded in one section */
+    uint32_t num_passes;
+    uint64_t lf_end;     /* end of the LF groups */
+    uint64_t pass_end[11];
+    uint64_t total;
+} FrameLayout;
+
+#define MIN_DISTANCE 0.05f
+#define MAX_DISTANCE 25.0f
+#define RC_TOLERANCE 0.9        /* trials within 90% of the budget are accepted */
+#define RC_TOLERANCE_MID 0.95   /* aim for the middle of the accepted range */
+
+#define MAX_LAYERS 16
+
+static double elapsed_ms(const struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1e3 + (now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+/* Check that the size of an input image matches its layout */
+static void check_image_size(Metadata *meta, const SampleLayout *layout, size_t size)
+{
+    if (size != (size_t)meta->width * meta->height * meta->channels * layout->bytes_per_sample)
+        signal_error_and_exit(INVALID_INPUT);
+}
+
+/* Load an input image, check it against its layout and convert it to RGB order */
+static size_t load_image(int index, const SampleLayout *layout, unsigned char **data)
+{
+    Metadata *meta = get_metadata(index);
+    size_t size = get_image_data(index, data);
+    size_t num_pixels = (size_t)meta->width * meta->height;
+    check_image_size(meta, layout, size);
 
-        size_t output_buffer_size = size;
-        size_t out_buf_remain = output_buffer_size;
-        uint8_t* output_buffer = (uint8_t *)malloc(output_buffer_size); 
-        uint8_t* out_buf_next = output_buffer;
-        if (JxlEncoderProcessOutput(encoder, &out_buf_next, &out_buf_remain))
+    /* The input buffer is a private copy, so the channel order can be fixed up in place */
+    if (layout->bgr)
+        swap_red_blue(*data, num_pixels, meta->channels, layout->bytes_per_sample);
+
+    return size;
+}
+
+/* Create frame settings configured from the module parameters */
+static JxlEncoderFrameSettings *create_frame_settings(JxlEncoder *encoder, const EncodeParams *params, const SampleLayout *layout)
+{
+    JxlEncoderFrameSettings* settings = JxlEncoderFrameSettingsCreate(encoder, NULL); //creates settings object for configuring how frames are compressed
+
+    if (JxlEncoderFrameSettingsSetOption(settings, JXL_ENC_FRAME_SETTING_EFFORT, params->effort)) //sets compression effort - from configuration
+        signal_error_and_exit(JXL_ENC_SET_OPTIONS);
+
+    if (JxlEncoderFrameSettingsSetOption(settings, JXL_ENC_FRAME_SETTING_RESAMPLING, params->resampling))// sets sampling strategy - from configuration
+        signal_error_and_exit(JXL_ENC_SET_OPTIONS);
+
+    if (params->lossless && JxlEncoderSetFrameLossless(settings, JXL_TRUE)) //sets lossless
+        signal_error_and_exit(JXL_ENC_SET_LOSSLESS);
+
+    if (!params->lossless && JxlEncoderSetFrameDistance(settings, params->distance)) //sets lossy based on distance - from configuration
+        signal_error_and_exit(JXL_ENC_SET_DISTANCE);
+
+    if (JxlEncoderSetFrameBitDepth(settings, &layout->bit_depth)) //interpret samples at their native depth
+        signal_error_and_exit(JXL_ENC_SET_INFO);
+
+    /* Order the codestream DC first, then the AC passes, so any prefix decodes to a coarser image */
+    if (params->progressive
+        && (JxlEncoderFrameSettingsSetOption(settings, JXL_ENC_FRAME_SETTING_PROGRESSIVE_DC, 1)
+            || JxlEncoderFrameSettingsSetOption(settings, JXL_ENC_FRAME_SETTING_PROGRESSIVE_AC, 1)
+            || JxlEncoderFrameSettingsSetOption(settings, JXL_ENC_FRAME_SETTING_RESPONSIVE, 1)))
+        signal_error_and_exit(JXL_ENC_SET_OPTIONS);
+
+    return settings;
+}
+
+/* Describe the image stored in the codestream */
+static void set_basic_info(JxlEncoder *encoder, Metadata *meta, const SampleLayout *layout, const EncodeParams *params, int animated)
+{
+    JxlBasicInfo basic_info; //image metadata
+    JxlEncoderInitBasicInfo(&basic_info);
+    if (params->lossless) basic_info.uses_original_profile = JXL_TRUE;
+    basic_info.xsize = meta->width;
+    basic_info.ysize = meta->height;
+    basic_info.num_color_channels = meta->channels > 3 ? 3 : meta->channels;
+    basic_info.num_extra_channels = meta->channels - basic_info.num_color_channels;
+    basic_info.bits_per_sample = layout->bits_per_sample;
+    basic_info.exponent_bits_per_sample = layout->exponent_bits_per_sample;
+    basic_info.alpha_bits = basic_info.num_extra_channels > 0 ? layout->bits_per_sample : 0;
+    basic_info.alpha_exponent_bits = basic_info.num_extra_channels > 0 ? layout->exponent_bits_per_sample : 0;
+
+    /* Frames of a batch are stored as animation frames, so every frame stays a
+       separately decodable image instead of being blended into one */
+    if (animated)
+    {
+        basic_info.have_animation = JXL_TRUE;
+        basic_info.animation.tps_numerator = 1;
+        basic_info.animation.tps_denominator = 1;
+        basic_info.animation.num_loops = 0;
+    }
+
+    if (JxlEncoderSetBasicInfo(encoder, &basic_info))
+        signal_error_and_exit(JXL_ENC_SET_INFO);
+}
+
+/* Copy the fields of an input image's metadata into the result metadata */
+static void copy_metadata(Metadata *new_meta, Metadata *input_meta, size_t enc_size)
+{
+    new_meta->size = enc_size;
+    new_meta->width = input_meta->width;
+    new_meta->height = input_meta->height;
+    new_meta->channels = input_meta->channels;
+    new_meta->timestamp = input_meta->timestamp;
+    new_meta->bits_pixel = input_meta->bits_pixel;
+    new_meta->camera = input_meta->camera;
+    new_meta->obid = input_meta->obid;
+}
+
+/* Pack the original metadata of an input image, so it can be stored in a box */
+static size_t pack_input_metadata(Metadata *input_meta, uint8_t **buf)
+{
+    Metadata meta = METADATA__INIT;
+    copy_metadata(&meta, input_meta, input_meta->size);
+    copy_custom_metadata(&meta, input_meta, NULL);
+
+    size_t meta_size = metadata__get_packed_size(&meta);
+    *buf = (uint8_t *)malloc(meta_size);
+    if (*buf == NULL)
+        signal_error_and_exit(MALLOC_ERR);
+    metadata__pack(&meta, *buf);
+
+    for (size_t k = 0; k < meta.n_items; ++k)
+    {
+        free(meta.items[k]->key);
+        if (meta.items[k]->value_case == METADATA_ITEM__VALUE_STRING_VALUE)
+            free(meta.items[k]->string_value);
+        free(meta.items[k]);
+    }
+    free(meta.items);
+
+    return meta_size;
+}
+
+/* Check whether two input images can be stored as frames of the same codestream. The group
+   shares the sample layout of its first frame, so the sample format and channel order must match. */
+static int same_frame_group(Metadata *a, Metadata *b)
+{
+    if (a->obid != b->obid || a->width != b->width || a->height != b->height
+        || a->channels != b->channels || a->bits_pixel != b->bits_pixel)
+        return 0;
+
+    SampleLayout layout_a, layout_b;
+    get_sample_layout(a, &layout_a);
+    get_sample_layout(b, &layout_b);
+    return layout_a.format.data_type == layout_b.format.data_type && layout_a.bgr == layout_b.bgr;
+}
+
+static void chunked_pixel_format(void *opaque, JxlPixelFormat *pixel_format)
+{
+    *pixel_format = ((ChunkedSource *)opaque)->format;
+}
+
+/* Hand the encoder a tile of the frame. Tiles are returned in place when the channel order
+   already is RGB; BGR tiles are converted into a tile sized buffer, released right after use */
+static const void *chunked_color_data_at(void *opaque, size_t xpos, size_t ypos, size_t xsize, size_t ysize, size_t *row_offset)
+{
+    ChunkedSource *source = (ChunkedSource *)opaque;
+    const unsigned char *tile = source->data + ypos * source->row_size + xpos * source->pixel_size;
+
+    if (!source->bgr)
+    {
+        *row_offset = source->row_size;
+        return tile;
+    }
+
+    size_t tile_row_size = xsize * source->pixel_size;
+    unsigned char *buffer = (unsigned char *)malloc(tile_row_size * ysize);
+    if (buffer == NULL)
+        signal_error_and_exit(MALLOC_ERR);
+
+    for (size_t y = 0; y < ysize; ++y)
+    {
+        memcpy(buffer + y * tile_row_size, tile + y * source->row_size, tile_row_size);
+        swap_red_blue(buffer + y * tile_row_size, xsize, source->channels, source->bytes_per_sample);
+    }
+
+    *row_offset = tile_row_size;
+    return buffer;
+}
+
+static void chunked_extra_pixel_format(void *opaque, size_t ec_index, JxlPixelFormat *pixel_format)
+{
+    *pixel_format = ((ChunkedSource *)opaque)->format;
+}
+
+/* Extra channels are interleaved with the colour channels, so they are never requested separately */
+static const void *chunked_extra_data_at(void *opaque, size_t ec_index, size_t xpos, size_t ypos, size_t xsize, size_t ysize, size_t *row_offset)
+{
+    return NULL;
+}
+
+static void chunked_release_buffer(void *opaque, const void *buf)
+{
+    if (((ChunkedSource *)opaque)->bgr)
+        free((void *)buf);
+}
+
+/* Describe a frame of the input batch view to the chunked frame callbacks */
+static void init_chunked_source(ChunkedSource *source, const SampleLayout *layout, Metadata *meta, const unsigned char *data)
+{
+    source->data = data;
+    source->channels = meta->channels;
+    source->bytes_per_sample = layout->bytes_per_sample;
+    source->pixel_size = meta->channels * layout->bytes_per_sample;
+    source->row_size = meta->width * source->pixel_size;
+    source->bgr = layout->bgr;
+    source->format = layout->format;
+}
+
+/* Feed a frame to the encoder tile by tile. The tiles are only read while the encoder flushes
+   its input, so the source must outlive the encoder, not just this call. */
+static void add_chunked_frame(JxlEncoderFrameSettings *settings, ChunkedSource *source)
+{
+    JxlChunkedFrameInputSource chunked_input;
+    chunked_input.opaque = source;
+    chunked_input.get_color_channels_pixel_format = chunked_pixel_format;
+    chunked_input.get_color_channel_data_at = chunked_color_data_at;
+    chunked_input.get_extra_channel_pixel_format = chunked_extra_pixel_format;
+    chunked_input.get_extra_channel_data_at = chunked_extra_data_at;
+    chunked_input.release_buffer = chunked_release_buffer;
+
+    /* Stream input and output for every frame larger than one group */
+    if (JxlEncoderFrameSettingsSetOption(settings, JXL_ENC_FRAME_SETTING_BUFFERING, 2))
+        signal_error_and_exit(JXL_ENC_SET_OPTIONS);
+
+    if (JxlEncoderAddChunkedFrame(settings, JXL_TRUE, chunked_input))
+        signal_error_and_exit(JXL_ENC_ADD_IMAGE);
+}
+
+static void *sink_get_buffer(void *opaque, size_t *size)
+{
+    OutputSink *sink = (OutputSink *)opaque;
+    size_t wanted = *size > 0 ? *size : 1;
+    if (sink->capacity - sink->position < wanted)
+    {
+        size_t capacity = sink->capacity;
+        while (capacity - sink->position < wanted)
+            capacity *= 2;
+        uint8_t *tmp = (uint8_t *)realloc(sink->data, capacity);
+        if (tmp == NULL)
+            signal_error_and_exit(MALLOC_ERR);
+        sink->data = tmp;
+        sink->capacity = capacity;
+    }
+    *size = sink->capacity - sink->position;
+    return sink->data + sink->position;
+}
+
+static void sink_release_buffer(void *opaque, size_t written_bytes)
+{
+    OutputSink *sink = (OutputSink *)opaque;
+    sink->position += written_bytes;
+    if (sink->position > sink->end)
+        sink->end = sink->position;
+}
+
+/* The encoder seeks back to patch the table of contents once the groups are written */
+static void sink_seek(void *opaque, uint64_t position)
+{
+    ((OutputSink *)opaque)->position = position;
+}
+
+/* Everything is kept in memory, so there is nothing to hand off at a finalized position */
+static void sink_set_finalized_position(void *opaque, uint64_t finalized_position)
+{
+}
+
+/* Stream the codestream into a growing buffer. Without an output processor libjxl cannot stream,
+   and copies a chunked frame into a full frame buffer of its own. */
+static void set_output_sink(JxlEncoder *encoder, OutputSink *sink, size_t initial_size)
+{
+    sink->capacity = initial_size > 64 ? initial_size : 64;
+    sink->position = 0;
+    sink->end = 0;
+    sink->data = (uint8_t *)malloc(sink->capacity);
+    if (sink->data == NULL)
+        signal_error_and_exit(MALLOC_ERR);
+
+    JxlEncoderOutputProcessor processor;
+    processor.opaque = sink;
+    processor.get_buffer = sink_get_buffer;
+    processor.release_buffer = sink_release_buffer;
+    processor.seek = sink_seek;
+    processor.set_finalized_position = sink_set_finalized_position;
+    if (JxlEncoderSetOutputProcessor(encoder, processor))
+        signal_error_and_exit(JXL_ENC_SET_OPTIONS);
+}
+
+/* Encode one image buffer as a standalone JXL codestream.
+   In chunked mode the buffer is the input batch view, still in its original channel order. */
+static size_t encode_buffer(Metadata *meta, const SampleLayout *layout, const EncodeParams *params,
+                            const unsigned char *data, size_t size, uint8_t **output_buffer)
+{
+    JxlEncoder* encoder = JxlEncoderCreate(NULL); //initialize encoder
+
+    if (encoder == NULL)
+        signal_error_and_exit(JXL_ENC_ENCODER_CREATE);
+
+    set_basic_info(encoder, meta, layout, params, 0);
+    JxlEncoderFrameSettings* settings = create_frame_settings(encoder, params, layout);
+
+    /* Both are used by the encoder callbacks until it is destroyed */
+    ChunkedSource source;
+    OutputSink sink;
+    if (params->chunked)
+    {
+        /* The output is usually much smaller than the frame, start small when streaming */
+        set_output_sink(encoder, &sink, size / 8);
+        init_chunked_source(&source, layout, meta, data);
+        add_chunked_frame(settings, &source);
+    }
+    else if (JxlEncoderAddImageFrame(settings, &layout->format, data, size)) //feeds raw pixel data to encoder for compression
+        signal_error_and_exit(JXL_ENC_ADD_IMAGE);
+
+    JxlEncoderCloseInput(encoder); //signalizes this is the end of the input
+
+    size_t enc_size;
+    if (params->chunked)
+    {
+        if (JxlEncoderFlushInput(encoder) != JXL_ENC_SUCCESS)
             signal_error_and_exit(JXL_ENC_PROCESS);
+        *output_buffer = sink.data;
+        enc_size = sink.end;
+    }
+    else
+    {
+        enc_size = process_output(encoder, output_buffer, size);
+    }
+    JxlEncoderDestroy(encoder);
+    return enc_size;
+}
 
-        int enc_size = output_buffer_size - out_buf_remain; //calculate compressed size
+/* Read n bits (n <= 64), least significant first as in every JPEG XL header */
+static uint64_t read_bits(BitReader *br, int n)
+{
+    uint64_t value = 0;
+    for (int k = 0; k < n; ++k, ++br->bit)
+    {
+        if (br->bit >= 8 * br->size)
+        {
+            br->error = 1;
+            return 0;
+        }
+        value |= (uint64_t)((br->data[br->bit >> 3] >> (br->bit & 7)) & 1) << k;
+    }
+    return value;
+}
 
-        /* Create image metadata before appending */
-        Metadata new_meta = METADATA__INIT;
-        new_meta.size = enc_size;
-        new_meta.width = width;
-        new_meta.height = height;
-        new_meta.channels = channels;
-        new_meta.timestamp = timestamp;
-        new_meta.bits_pixel = bits_pixel;
-        new_meta.camera = camera;
-        add_custom_metadata_string(&new_meta, "enc", "jxl");
+static void skip_bits(BitReader *br, uint64_t n)
+{
+    if (n > 8 * br->size - br->bit)
+    {
+        br->error = 1;
+        br->bit = 8 * br->size;
+    }
+    else
+    {
+        br->bit += n;
+    }
+}
 
-        /* Append the image to the result batch */
-        append_result_image(output_buffer, enc_size, &new_meta);
+/* U32 field: a 2-bit selector picks one of four offset + extra-bits distributions */
+static uint32_t read_u32(BitReader *br, uint32_t o0, int b0, uint32_t o1, int b1, uint32_t o2, int b2, uint32_t o3, int b3)
+{
+    const uint32_t offset[4] = {o0, o1, o2, o3};
+    const int bits[4] = {b0, b1, b2, b3};
+    int selector = (int)read_bits(br, 2);
+    return offset[selector] + (uint32_t)read_bits(br, bits[selector]);
+}
+
+static uint64_t read_u64(BitReader *br)
+{
+    switch (read_bits(br, 2))
+    {
+    case 0:
+        return 0;
+    case 1:
+        return 1 + read_bits(br, 4);
+    case 2:
+        return 17 + read_bits(br, 8);
+    default:
+    {
+        uint64_t value = read_bits(br, 12);
+        int shift = 12;
+        while (shift < 64 && read_bits(br, 1) && !br->error)
+        {
+            int n = shift == 60 ? 4 : 8;
+            value |= read_bits(br, n) << shift;
+            shift += n;
+        }
+        return value;
+    }
+    }
+}
+
+static uint32_t read_enum(BitReader *br)
+{
+    return read_u32(br, 0, 0, 1, 0, 2, 4, 18, 6);
+}
+
+static void skip_name(BitReader *br)
+{
+    skip_bits(br, 8 * (uint64_t)read_u32(br, 0, 0, 0, 4, 16, 5, 48, 10));
+}
+
+/* Extensions: a bit mask, then the size in bits of each present extension */
+static void skip_extensions(BitReader *br)
+{
+    uint64_t mask = read_u64(br);
+    for (int k = 0; k < 64 && !br->error; ++k)
+        if (mask & ((uint64_t)1 << k))
+            skip_bits(br, read_u64(br));
+}
+
+static void skip_bit_depth(BitReader *br)
+{
+    if (read_bits(br, 1))
+    {
+        read_u32(br, 32, 0, 16, 0, 24, 0, 1, 6);
+        read_bits(br, 4);
+    }
+    else
+    {
+        read_u32(br, 8, 0, 10, 0, 12, 0, 1, 6);
+    }
+}
+
+static void read_size(BitReader *br, uint32_t *width, uint32_t *height)
+{
+    static const uint32_t ratio_num[7] = {1, 12, 4, 3, 16, 5, 2};
+    static const uint32_t ratio_den[7] = {1, 10, 3, 2, 9, 4, 1};
+
+    int small = (int)read_bits(br, 1);
+    *height = small ? ((uint32_t)read_bits(br, 5) + 1) * 8 : read_u32(br, 1, 9, 1, 13, 1, 18, 1, 30);
+    uint32_t ratio = (uint32_t)read_bits(br, 3);
+    if (ratio == 0)
+        *width = small ? ((uint32_t)read_bits(br, 5) + 1) * 8 : read_u32(br, 1, 9, 1, 13, 1, 18, 1, 30);
+    else
+        *width = (uint32_t)((uint64_t)*height * ratio_num[ratio - 1] / ratio_den[ratio - 1]);
+}
+
+static void skip_custom_xy(BitReader *br)
+{
+    read_u32(br, 0, 19, 0x80000, 19, 0x100000, 20, 0x200000, 21);
+    read_u32(br, 0, 19, 0x80000, 19, 0x100000, 20, 0x200000, 21);
+}
+
+static void skip_colour_encoding(BitReader *br)
+{
+    if (read_bits(br, 1)) //all_default
+        return;
+    int want_icc = (int)read_bits(br, 1);
+    uint32_t colour_space = read_enum(br);
+    if (want_icc) //the ICC profile is entropy coded ahead of the frames, not handled here
+    {
+        br->error = 1;
+        return;
+    }
+    if (colour_space != 2 && read_enum(br) == 2) //custom white point, XYB has none
+        skip_custom_xy(br);
+    if (colour_space != 1 && colour_space != 2 && read_enum(br) == 2) //custom primaries
+        for (int k = 0; k < 3; ++k)
+            skip_custom_xy(br);
+    if (colour_space != 2)
+    {
+        if (read_bits(br, 1)) //have_gamma
+            read_bits(br, 24);
+        else
+            read_enum(br);
+    }
+    read_enum(br); //rendering intent
+}
+
+/* Parse the signature, size, image metadata and colour transform of a bare codestream,
+   leaving the reader at the first frame header */
+static int read_image_header(BitReader *br, ImageHeader *image)
+{
+    if (read_bits(br, 16) != 0x0aff)
+        return -1;
+    read_size(br, &image->width, &image->height);
+
+    image->xyb_encoded = 1;
+    image->num_extra_channels = 0;
+    image->have_animation = 0;
+    image->have_timecodes = 0;
+    if (!read_bits(br, 1)) //metadata all_default
+    {
+        int extra_fields = (int)read_bits(br, 1);
+        if (extra_fields)
+        {
+            read_bits(br, 3); //orientation
+            if (read_bits(br, 1)) //have_intrinsic_size
+            {
+                uint32_t w, h;
+                read_size(br, &w, &h);
+            }
+            if (read_bits(br, 1)) //have_preview
+                return -1;
+            if ((image->have_animation = (int)read_bits(br, 1)))
+            {
+                read_u32(br, 100, 0, 1000, 0, 1, 10, 1, 30);
+                read_u32(br, 1, 0, 1001, 0, 1, 8, 1, 10);
+                read_u32(br, 0, 0, 0, 3, 0, 16, 0, 32);
+                image->have_timecodes = (int)read_bits(br, 1);
+            }
+        }
+        skip_bit_depth(br);
+        read_bits(br, 1); //modular_16_bit_buffer_sufficient
+        image->num_extra_channels = read_u32(br, 0, 0, 1, 0, 2, 4, 1, 12);
+        for (uint32_t k = 0; k < image->num_extra_channels && !br->error; ++k)
+        {
+            if (read_bits(br, 1)) //all_default alpha channel
+                continue;
+            uint32_t type = read_enum(br);
+            skip_bit_depth(br);
+            read_u32(br, 0, 0, 3, 0, 4, 0, 1, 3); //dim_shift
+            skip_name(br);
+            if (type == 0) //alpha
+                read_bits(br, 1);
+            else if (type == 2) //spot colour
+                read_bits(br, 64);
+            else if (type == 5) //colour filter array
+                read_u32(br, 1, 0, 0, 2, 3, 4, 19, 8);
+        }
+        image->xyb_encoded = (int)read_bits(br, 1);
+        skip_colour_encoding(br);
+        if (extra_fields)
+        {
+            if (!read_bits(br, 1)) //tone mapping all_default
+                read_bits(br, 16 + 16 + 1 + 16);
+        }
+        skip_extensions(br);
+    }
+    if (!read_bits(br, 1)) //transform data all_default
+    {
+        if (image->xyb_encoded && !read_bits(br, 1)) //custom opsin inverse matrix
+            skip_bits(br, 16 * 16);
+        uint32_t custom_weights_mask = (uint32_t)read_bits(br, 3);
+        if (custom_weights_mask & 1)
+            skip_bits(br, 15 * 16);
+        if (custom_weights_mask & 2)
+            skip_bits(br, 55 * 16);
+        if (custom_weights_mask & 4)
+            skip_bits(br, 210 * 16);
+    }
+    br->bit = (br->bit + 7) & ~(size_t)7;
+    return br->error ? -1 : 0;
+}
+
+static uint32_t div_ceil(uint64_t a, uint64_t b)
+{
+    return (uint32_t)((a + b - 1) / b);
+}
+
+/* Parse a frame header and its table of contents, leaving the reader at the first section */
+static int read_frame_layout(BitReader *br, const ImageHeader *image, FrameLayout *frame)
+{
+    enum { REGULAR_FRAME = 0, LF_FRAME = 1, REFERENCE_ONLY = 2, SKIP_PROGRESSIVE = 3 };
+
+    uint32_t type = REGULAR_FRAME, modular = 0, upsampling = 1, group_size_shift = 1, lf_level = 0;
+    uint32_t width = image->width, height = image->height;
+    frame->num_passes = 1;
+    frame->is_last = 1;
+
+    if (!read_bits(br, 1)) //frame header all_default
+    {
+        type = (uint32_t)read_bits(br, 2);
+        modular = (uint32_t)read_bits(br, 1);
+        uint64_t flags = read_u64(br);
+        int do_ycbcr = image->xyb_encoded ? 0 : (int)read_bits(br, 1);
+        if (!(flags & 0x20)) //not kUseLfFrame
+        {
+            if (do_ycbcr)
+                read_bits(br, 6);
+            upsampling = 1u << read_bits(br, 2);
+            skip_bits(br, 2 * (uint64_t)image->num_extra_channels);
+        }
+        if (modular)
+            group_size_shift = (uint32_t)read_bits(br, 2);
+        else if (image->xyb_encoded)
+            read_bits(br, 6); //x_qm_scale, b_qm_scale
+        if (type != REFERENCE_ONLY)
+        {
+            frame->num_passes = read_u32(br, 1, 0, 2, 0, 3, 0, 4, 3);
+            if (frame->num_passes != 1)
+            {
+                uint32_t num_downsample = read_u32(br, 0, 0, 1, 0, 2, 0, 3, 1);
+                skip_bits(br, 2 * (uint64_t)(frame->num_passes - 1)); //shift
+                skip_bits(br, 2 * (uint64_t)num_downsample);          //downsample
+                for (uint32_t k = 0; k < num_downsample; ++k)
+                    read_u32(br, 0, 0, 1, 0, 2, 0, 0, 3); //last_pass
+            }
+        }
+
+        int full_frame = 1;
+        if (type == LF_FRAME)
+        {
+            lf_level = (uint32_t)read_bits(br, 2) + 1;
+        }
+        else if (read_bits(br, 1)) //have_crop
+        {
+            int32_t x0 = 0, y0 = 0;
+            if (type != REFERENCE_ONLY)
+            {
+                uint32_t ux0 = read_u32(br, 0, 8, 256, 11, 2304, 14, 18688, 30);
+                uint32_t uy0 = read_u32(br, 0, 8, 256, 11, 2304, 14, 18688, 30);
+                x0 = (ux0 & 1) ? -(int32_t)(ux0 >> 1) - 1 : (int32_t)(ux0 >> 1);
+                y0 = (uy0 & 1) ? -(int32_t)(uy0 >> 1) - 1 : (int32_t)(uy0 >> 1);
+            }
+            width = read_u32(br, 0, 8, 256, 11, 2304, 14, 18688, 30);
+            height = read_u32(br, 0, 8, 256, 11, 2304, 14, 18688, 30);
+            full_frame = x0 <= 0 && y0 <= 0 && (int64_t)x0 + width >= image->width && (int64_t)y0 + height >= image->height;
+        }
+
+        uint32_t blend_mode = 0, duration = 0, save_as_reference = 0;
+        frame->is_last = 0;
+        if (type == REGULAR_FRAME || type == SKIP_PROGRESSIVE)
+        {
+            for (uint32_t k = 0; k <= image->num_extra_channels && !br->error; ++k)
+            {
+                uint32_t mode = read_u32(br, 0, 0, 1, 0, 2, 0, 3, 2);
+                int blend_alpha = image->num_extra_channels > 0 && (mode == 2 || mode == 3);
+                if (blend_alpha)
+                    read_u32(br, 0, 0, 1, 0, 2, 0, 3, 3); //alpha_channel
+                if (blend_alpha || mode == 4)
+                    read_bits(br, 1); //clamp
+                if (mode != 0 || !full_frame)
+                    read_bits(br, 2); //source
+                if (k == 0)
+                    blend_mode = mode;
+            }
+            if (image->have_animation)
+            {
+                duration = read_u32(br, 0, 0, 1, 0, 0, 8, 0, 32);
+                if (image->have_timecodes)
+                    read_bits(br, 32);
+            }
+            frame->is_last = (int)read_bits(br, 1);
+        }
+        if (type != LF_FRAME && !frame->is_last)
+            save_as_reference = (uint32_t)read_bits(br, 2);
+        if (type == REFERENCE_ONLY
+            || (full_frame && (type == REGULAR_FRAME || type == SKIP_PROGRESSIVE) && blend_mode == 0
+                && (duration == 0 || save_as_reference != 0) && !frame->is_last))
+            read_bits(br, 1); //save_before_colour_transform
+        skip_name(br);
+
+        if (!read_bits(br, 1)) //restoration filter all_default
+        {
+            if (read_bits(br, 1) && read_bits(br, 1)) //gabor-like filter with custom weights
+                skip_bits(br, 6 * 16);
+            if (read_bits(br, 2)) //edge-preserving filter iterations
+            {
+                if (!modular && read_bits(br, 1))
+                    skip_bits(br, 8 * 16);
+                if (read_bits(br, 1))
+                    skip_bits(br, 5 * 16);
+                if (read_bits(br, 1))
+                    skip_bits(br, modular ? 3 * 16 : 4 * 16);
+                if (modular)
+                    skip_bits(br, 16);
+            }
+            skip_extensions(br);
+        }
+        skip_extensions(br);
+    }
+    if (br->error || frame->num_passes > 11)
+        return -1;
+
+    if (type == LF_FRAME)
+    {
+        width = div_ceil(image->width, (uint64_t)1 << (3 * lf_level));
+        height = div_ceil(image->height, (uint64_t)1 << (3 * lf_level));
+    }
+    width = div_ceil(width, upsampling);
+    height = div_ceil(height, upsampling);
+    uint32_t group_dim = 128u << group_size_shift;
+    uint64_t num_groups = (uint64_t)div_ceil(width, group_dim) * div_ceil(height, group_dim);
+    uint64_t num_lf_groups = (uint64_t)div_ceil(width, 8 * group_dim) * div_ceil(height, 8 * group_dim);
+    if (num_groups == 0)
+        return -1;
+
+    //Table of contents: LfGlobal, the LF groups, HfGlobal, then the groups of every pass
+    frame->single_section = num_groups == 1 && frame->num_passes == 1;
+    uint64_t num_sections = frame->single_section ? 1 : 2 + num_lf_groups + frame->num_passes * num_groups;
+    if (read_bits(br, 1)) //permuted
+        return -1;
+    br->bit = (br->bit + 7) & ~(size_t)7;
+
+    frame->total = 0;
+    frame->lf_end = 0;
+    for (uint64_t k = 0; k < num_sections && !br->error; ++k)
+    {
+        frame->total += read_u32(br, 0, 10, 1024, 14, 17408, 22, 4211712, 30);
+        if (k == num_lf_groups)
+            frame->lf_end = frame->total;
+        else if (k >= 2 + num_lf_groups && (k - 1 - num_lf_groups) % num_groups == 0)
+            frame->pass_end[(k - 2 - num_lf_groups) / num_groups] = frame->total;
+    }
+    br->bit = (br->bit + 7) & ~(size_t)7;
+    return br->error ? -1 : 0;
+}
+
+/* Find the byte offsets at which each quality layer of a progressive codestream is complete.
+   Only the headers and the frame tables of contents are parsed, no pixel data is decoded.
+   The first layer ends with the LF groups of the last frame (and so includes the LF frame
+   written for a progressive DC), each further layer ends with the groups of one more pass.
+   Returns the number of layers found, 0 if the codestream uses a feature not handled here. */
+static int find_layer_offsets(const uint8_t *data, size_t size, size_t *offsets)
+{
+    static const uint8_t container_signature[12] = {0, 0, 0, 0x0c, 'J', 'X', 'L', ' ', 0x0d, 0x0a, 0x87, 0x0a};
+    size_t base = 0;
+
+    if (size >= sizeof(container_signature) && memcmp(data, container_signature, sizeof(container_signature)) == 0)
+    {
+        //Look for a single jxlc box, a codestream split into jxlp boxes is not handled
+        size_t pos = 0;
+        for (;;)
+        {
+            if (pos + 8 > size)
+                return 0;
+            uint64_t box_size = ((uint64_t)data[pos] << 24) | (data[pos + 1] << 16) | (data[pos + 2] << 8) | data[pos + 3];
+            size_t header = 8;
+            if (box_size == 1)
+            {
+                if (pos + 16 > size)
+                    return 0;
+                box_size = 0;
+                for (int k = 0; k < 8; ++k)
+                    box_size = (box_size << 8) | data[pos + 8 + k];
+                header = 16;
+            }
+            else if (box_size == 0)
+            {
+                box_size = size - pos;
+            }
+            if (box_size < header || box_size > size - pos)
+                return 0;
+            if (memcmp(data + pos + 4, "jxlc", 4) == 0)
+            {
+                base = pos + header;
+                size = pos + box_size;
+                break;
+            }
+            pos += box_size;
+        }
+    }
+
+    BitReader br = {data + base, size - base, 0, 0};
+    ImageHeader image;
+    if (read_image_header(&br, &image))
+        return 0;
+
+    for (;;)
+    {
+        FrameLayout frame;
+        if (read_frame_layout(&br, &image, &frame))
+            return 0;
+
+        size_t start = base + br.bit / 8;
+        if (frame.total > size - start)
+            return 0;
+        if (frame.is_last)
+        {
+            if (frame.num_passes > MAX_LAYERS - 1)
+                return 0;
+            if (frame.single_section)
+            {
+                offsets[0] = start + frame.total;
+                return 1;
+            }
+            offsets[0] = start + frame.lf_end;
+            for (uint32_t p = 0; p < frame.num_passes; ++p)
+                offsets[p + 1] = start + frame.pass_end[p];
+            return (int)frame.num_passes + 1;
+        }
+        br.bit += 8 * frame.total;
+    }
+}
+
+/* Record the layer offsets of a progressive codestream in the result metadata */
+static void add_layer_metadata(Metadata *new_meta, const uint8_t *codestream, size_t size)
+{
+    size_t offsets[MAX_LAYERS];
+    int num_layers = find_layer_offsets(codestream, size, offsets);
+
+    char layer_offsets[MAX_LAYERS * 12 + 1] = "";
+    size_t len = 0;
+    for (int k = 0; k < num_layers; ++k)
+        len += snprintf(layer_offsets + len, sizeof(layer_offsets) - len, "%s%zu", k == 0 ? "" : ",", offsets[k]);
+
+    add_custom_metadata_int(new_meta, "layers", num_layers);
+    add_custom_metadata_string(new_meta, "layer_offsets", layer_offsets);
+}
+
+/* Find the distance meeting the byte budget with cheap trial encodes at low effort.
+   Sizes are modelled as log(size) = a - slope * log(distance), and each guess is kept
+   inside the bracket of distances already known to be too large or small enough.
+   The largest trial within the real budget is kept as a fallback in case the final encode
+   overshoots. */
+static void search_distance(Metadata *meta, const SampleLayout *layout, const EncodeParams *params, RateControl *rc,
+                            const unsigned char *data, size_t size, RateSearch *search)
+{
+    EncodeParams trial = *params;
+    trial.effort = params->trial_effort;
+    trial.lossless = 0;
+
+    /* Trial encodes are cheaper but larger (or smaller) than the final one, so scale the
+       budget by the ratio observed on the previous image */
+    double target = params->target_bytes / rc->effort_ratio;
+    float too_large = MIN_DISTANCE; /* largest distance known to exceed the budget */
+    float fits = 0;                 /* smallest distance known to fit the scaled budget */
+    float distance = rc->distance;
+    float last_distance = 0;
+    size_t last_size = 0;
+
+    memset(search, 0, sizeof(*search));
+    for (search->trials = 0; search->trials < params->max_trials; )
+    {
+        trial.distance = distance;
+        uint8_t *trial_buffer;
+        size_t trial_size = encode_buffer(meta, layout, &trial, data, size, &trial_buffer);
+        search->trials++;
+
+        if (last_size > 0 && trial_size != last_size && distance != last_distance)
+        {
+            double slope = -log((double)trial_size / last_size) / log(distance / last_distance);
+            if (slope > 0.1 && slope < 4.0)
+                rc->slope = slope;
+        }
+        last_distance = distance;
+        last_size = trial_size;
+
+        /* The scaled target can be up to twice the budget, so only a trial within the
+           budget itself is a valid fallback */
+        if (trial_size <= (size_t)params->target_bytes && trial_size > search->fallback_size)
+        {
+            free(search->fallback);
+            search->fallback = trial_buffer;
+            search->fallback_size = trial_size;
+            search->fallback_distance = distance;
+            trial_buffer = NULL;
+        }
+
+        if (trial_size <= target)
+        {
+            free(trial_buffer);
+            fits = distance;
+            search->distance_size = trial_size;
+            /* Close enough to the budget, no need for more trials */
+            if (trial_size >= RC_TOLERANCE * target)
+                break;
+        }
+        else
+        {
+            free(trial_buffer);
+            too_large = distance;
+            if (distance >= MAX_DISTANCE)
+                break;
+        }
+
+        /* Next guess from the size model, bisected if it leaves the bracket */
+        float next = distance * pow(trial_size / (RC_TOLERANCE_MID * target), 1.0 / rc->slope);
+        float upper = fits > 0 ? fits : MAX_DISTANCE;
+        if (next <= too_large || next >= upper)
+            next = fits > 0 ? sqrtf(too_large * upper) : fminf(2 * distance, MAX_DISTANCE);
+        if (next == distance)
+            break;
+        distance = next;
+    }
+
+    /* Without trials the previous distance is used as is */
+    search->distance = search->trials > 0 ? fits : rc->distance;
+}
+
+/* Encode a single input image as its own JXL codestream */
+static void encode_single(int index, const EncodeParams *params, RateControl *rc)
+{
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    Metadata *input_meta = get_metadata(index);
+
+    SampleLayout layout;
+    get_sample_layout(input_meta, &layout);
+
+    /* Chunked encoding reads the input batch in place, otherwise work on a private copy */
+    unsigned char *input_copy = NULL;
+    const unsigned char *input_image_data;
+    size_t size;
+    if (params->chunked)
+    {
+        size = get_image_view(index, &input_image_data);
+        check_image_size(input_meta, &layout, size);
+    }
+    else
+    {
+        size = load_image(index, &layout, &input_copy);
+        input_image_data = input_copy;
+    }
+
+    uint8_t *output_buffer;
+    size_t enc_size;
+    RateSearch search;
+    search.trials = 0;
+    int over_budget = 0;
+    EncodeParams final = *params;
+
+    if (params->target_bytes > 0)
+    {
+        search_distance(input_meta, &layout, params, rc, input_image_data, size, &search);
+        final.distance = search.distance > 0 ? search.distance : MAX_DISTANCE;
+        final.lossless = 0;
+
+        if (params->trial_effort >= params->effort && search.fallback != NULL)
+        {
+            /* The trial already ran at the requested effort */
+            output_buffer = search.fallback;
+            enc_size = search.fallback_size;
+            final.distance = search.fallback_distance;
+        }
+        else
+        {
+            enc_size = encode_buffer(input_meta, &layout, &final, input_image_data, size, &output_buffer);
+
+            /* Learn how the final effort compares to the trial effort for the next image */
+            if (search.distance_size > 0)
+                rc->effort_ratio = fmin(fmax((double)enc_size / search.distance_size, 0.5), 2.0);
+
+            /* Never exceed the budget: fall back to the trial encode that fits it */
+            if (enc_size > (size_t)params->target_bytes && search.fallback != NULL)
+            {
+                free(output_buffer);
+                output_buffer = search.fallback;
+                enc_size = search.fallback_size;
+                final.distance = search.fallback_distance;
+            }
+            else
+            {
+                free(search.fallback);
+            }
+        }
+
+        /* Report a missed budget instead of shipping it silently, and do not seed the next
+           search from a failed one */
+        over_budget = enc_size > (size_t)params->target_bytes;
+        if (search.distance > 0 && !over_budget)
+            rc->distance = final.distance; //seed the search for the next image
+    }
+    else
+    {
+        enc_size = encode_buffer(input_meta, &layout, params, input_image_data, size, &output_buffer);
+    }
+
+    /* Create image metadata before appending */
+    Metadata new_meta = METADATA__INIT;
+    copy_metadata(&new_meta, input_meta, enc_size);
+    add_custom_metadata_string(&new_meta, "enc", "jxl");
+    add_custom_metadata_float(&new_meta, "encode_ms", elapsed_ms(&start));
+    if (params->target_bytes > 0)
+    {
+        add_custom_metadata_float(&new_meta, "distance", final.distance);
+        add_custom_metadata_int(&new_meta, "rc_trials", search.trials);
+        if (over_budget)
+            add_custom_metadata_bool(&new_meta, "rc_over_budget", 1);
+    }
+    if (params->progressive)
+        add_layer_metadata(&new_meta, output_buffer, enc_size);
+
+    /* Append the image to the result batch */
+    append_result_image(output_buffer, enc_size, &new_meta);
+
+    /* Remember to free any allocated memory */
+    free(input_copy);
+    free(output_buffer);
+}
+
+/* Position (0-3, row-major in the 2x2 cell) of each CFA colour: R, G1, B, G2 */
+static void get_cfa_positions(Metadata *meta, int positions[4])
+{
+    const char *pattern = has_custom_metadata(meta, "cfa_pattern") ? get_custom_metadata_string(meta, "cfa_pattern") : "rggb";
+    int num_green = 0;
+    positions[0] = positions[1] = positions[2] = positions[3] = -1;
+
+    for (int k = 0; k < 4 && pattern[k] != '\0'; ++k)
+    {
+        switch (pattern[k])
+        {
+        case 'r': case 'R': positions[0] = k; break;
+        case 'b': case 'B': positions[2] = k; break;
+        case 'g': case 'G': positions[num_green++ == 0 ? 1 : 3] = k; break;
+        default: break;
+        }
+    }
+
+    if (positions[0] < 0 || positions[1] < 0 || positions[2] < 0 || positions[3] < 0)
+        signal_error_and_exit(INVALID_INPUT);
+}
+
+/* Split a raw CFA frame into quarter resolution planes in one pass: R, G1 and B are
+   interleaved into the colour buffer, G2 goes into a separate extra channel plane */
+#define SPLIT_CFA(type)                                                                     \
+    do {                                                                                    \
+        const type *src = (const type *)raw;                                                \
+        type *dst_color = (type *)color;                                                    \
+        type *dst_extra = (type *)extra;                                                    \
+        for (int y = 0; y < half_height; ++y)                                               \
+        {                                                                                   \
+            const type *cell[4] = {src + 2 * y * width, src + 2 * y * width + 1,            \
+                                   src + (2 * y + 1) * width, src + (2 * y + 1) * width + 1}; \
+            const type *r = cell[positions[0]], *g1 = cell[positions[1]];                   \
+            const type *b = cell[positions[2]], *g2 = cell[positions[3]];                   \
+            for (int x = 0; x < half_width; ++x)                                            \
+            {                                                                               \
+                dst_color[0] = r[2 * x];                                                    \
+                dst_color[1] = g1[2 * x];                                                   \
+                dst_color[2] = b[2 * x];                                                    \
+                dst_color += 3;                                                             \
+                *dst_extra++ = g2[2 * x];                                                   \
+            }                                                                               \
+        }                                                                                   \
+    } while (0)
+
+static void split_cfa_planes(const unsigned char *raw, int width, int height, size_t bytes_per_sample,
+                             const int positions[4], unsigned char *color, unsigned char *extra)
+{
+    int half_width = width / 2;
+    int half_height = height / 2;
+
+    if (bytes_per_sample == 1)
+        SPLIT_CFA(uint8_t);
+    else
+        SPLIT_CFA(uint16_t);
+}
+
+/* Losslessly encode a raw CFA frame as a 4-channel (3 colour + 1 extra) quarter resolution
+   JXL. Demosaicing is left to ground processing. */
+static void encode_raw_bayer(int index, const EncodeParams *params)
+{
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    Metadata *input_meta = get_metadata(index);
+    int width = input_meta->width;
+    int height = input_meta->height;
+
+    if (input_meta->channels != 1 || width % 2 != 0 || height % 2 != 0)
+        signal_error_and_exit(INVALID_INPUT);
+
+    SampleLayout layout;
+    get_sample_layout(input_meta, &layout);
+    if (layout.format.data_type == JXL_TYPE_FLOAT16)
+        signal_error_and_exit(INVALID_INPUT);
+
+    int positions[4];
+    get_cfa_positions(input_meta, positions);
+
+    unsigned char *input_image_data;
+    size_t size = load_image(index, &layout, &input_image_data);
+
+    size_t plane_size = (size_t)(width / 2) * (height / 2) * layout.bytes_per_sample;
+    unsigned char *color = (unsigned char *)malloc(3 * plane_size);
+    unsigned char *extra = (unsigned char *)malloc(plane_size);
+    if (color == NULL || extra == NULL)
+        signal_error_and_exit(MALLOC_ERR);
+
+    split_cfa_planes(input_image_data, width, height, layout.bytes_per_sample, positions, color, extra);
+    free(input_image_data);
+
+    JxlEncoder* encoder = JxlEncoderCreate(NULL); //initialize encoder
+
+    if (encoder == NULL)
+        signal_error_and_exit(JXL_ENC_ENCODER_CREATE);
+
+    JxlBasicInfo basic_info;
+    JxlEncoderInitBasicInfo(&basic_info);
+    basic_info.uses_original_profile = JXL_TRUE;
+    basic_info.xsize = width / 2;
+    basic_info.ysize = height / 2;
+    basic_info.num_color_channels = 3;
+    basic_info.num_extra_channels = 1;
+    basic_info.bits_per_sample = layout.bits_per_sample;
+    basic_info.alpha_bits = 0;
+
+    if (JxlEncoderSetBasicInfo(encoder, &basic_info))
+        signal_error_and_exit(JXL_ENC_SET_INFO);
+
+    JxlExtraChannelInfo extra_info;
+    JxlEncoderInitExtraChannelInfo(JXL_CHANNEL_OPTIONAL, &extra_info);
+    extra_info.bits_per_sample = layout.bits_per_sample;
+    if (JxlEncoderSetExtraChannelInfo(encoder, 0, &extra_info)
+        || JxlEncoderSetExtraChannelName(encoder, 0, "G2", 2))
+        signal_error_and_exit(JXL_ENC_SET_INFO);
+
+    EncodeParams raw_params = *params;
+    raw_params.lossless = 1;
+    JxlEncoderFrameSettings* settings = create_frame_settings(encoder, &raw_params, &layout);
+
+    JxlPixelFormat color_format = layout.format;
+    color_format.num_channels = 3;
+    JxlPixelFormat extra_format = layout.format;
+    extra_format.num_channels = 1;
+
+    if (JxlEncoderAddImageFrame(settings, &color_format, color, 3 * plane_size)
+        || JxlEncoderSetExtraChannelBuffer(settings, &extra_format, extra, plane_size, 0))
+        signal_error_and_exit(JXL_ENC_ADD_IMAGE);
+
+    JxlEncoderCloseInput(encoder); //signalizes this is the end of the input
+
+    uint8_t *output_buffer;
+    size_t enc_size = process_output(encoder, &output_buffer, size / 2);
+
+    /* Create image metadata before appending, the dimensions stay those of the raw frame */
+    Metadata new_meta = METADATA__INIT;
+    copy_metadata(&new_meta, input_meta, enc_size);
+    add_custom_metadata_string(&new_meta, "enc", "jxl");
+    add_custom_metadata_string(&new_meta, "cfa_planes", "R,G1,B+G2");
+    add_custom_metadata_float(&new_meta, "encode_ms", elapsed_ms(&start));
+    if (params->progressive)
+        add_layer_metadata(&new_meta, output_buffer, enc_size);
+
+    /* Append the image to the result batch */
+    append_result_image(output_buffer, enc_size, &new_meta);
+
+    /* Remember to free any allocated memory */
+    free(color);
+    free(extra);
+    free(output_buffer);
+    JxlEncoderDestroy(encoder);
+}
+
+/* Encode the input images [first, first + count) as frames of one multi-frame JXL.
+   The original metadata of every frame is stored, in frame order, in a "dmet" box */
+static void encode_group(int first, int count, const EncodeParams *params)
+{
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    Metadata *first_meta = get_metadata(first);
+
+    SampleLayout layout;
+    get_sample_layout(first_meta, &layout);
+
+    JxlEncoder* encoder = JxlEncoderCreate(NULL); //initialize encoder
+
+    if (encoder == NULL)
+        signal_error_and_exit(JXL_ENC_ENCODER_CREATE);
+
+    if (JxlEncoderUseContainer(encoder, JXL_TRUE) || JxlEncoderUseBoxes(encoder))
+        signal_error_and_exit(JXL_ENC_SET_OPTIONS);
+
+    set_basic_info(encoder, first_meta, &layout, params, 1);
+    JxlEncoderFrameSettings* settings = create_frame_settings(encoder, params, &layout);
+
+    /* Index mapping frame numbers back to the original images */
+    size_t index_size = 1;
+    char *frame_index = (char *)calloc(1, index_size);
+    if (frame_index == NULL)
+        signal_error_and_exit(MALLOC_ERR);
+
+    for (int f = 0; f < count; ++f)
+    {
+        Metadata *input_meta = get_metadata(first + f);
+
+        uint8_t *meta_buf;
+        size_t meta_size = pack_input_metadata(input_meta, &meta_buf);
+        if (JxlEncoderAddBox(encoder, "dmet", meta_buf, meta_size, JXL_FALSE))
+            signal_error_and_exit(JXL_ENC_ADD_IMAGE);
+        free(meta_buf);
+
+        char entry[16];
+        int entry_len = snprintf(entry, sizeof(entry), "%s%d", f == 0 ? "" : ",", input_meta->timestamp);
+        char *tmp = (char *)realloc(frame_index, index_size + entry_len);
+        if (tmp == NULL)
+            signal_error_and_exit(MALLOC_ERR);
+        frame_index = tmp;
+        memcpy(frame_index + index_size - 1, entry, entry_len + 1);
+        index_size += entry_len;
+    }
+    JxlEncoderCloseBoxes(encoder);
+
+    size_t raw_size = 0;
+    for (int f = 0; f < count; ++f)
+    {
+        unsigned char *input_image_data;
+        size_t size = load_image(first + f, &layout, &input_image_data);
+        raw_size += size;
+
+        JxlFrameHeader frame_header;
+        JxlEncoderInitFrameHeader(&frame_header);
+        frame_header.duration = 1;
+        if (JxlEncoderSetFrameHeader(settings, &frame_header))
+            signal_error_and_exit(JXL_ENC_SET_OPTIONS);
+
+        if (JxlEncoderAddImageFrame(settings, &layout.format, input_image_data, size)) //feeds raw pixel data to encoder for compression
+            signal_error_and_exit(JXL_ENC_ADD_IMAGE);
 
-        /* Remember to free any allocated memory */
         free(input_image_data);
-        free(output_buffer);
-        JxlEncoderDestroy(encoder);
+    }
+
+    JxlEncoderCloseInput(encoder); //signalizes this is the end of the input
+
+    uint8_t *output_buffer;
+    size_t enc_size = process_output(encoder, &output_buffer, raw_size / count);
+
+    /* Create image metadata before appending */
+    Metadata new_meta = METADATA__INIT;
+    copy_metadata(&new_meta, first_meta, enc_size);
+    add_custom_metadata_string(&new_meta, "enc", "jxl");
+    add_custom_metadata_int(&new_meta, "frames", count);
+    add_custom_metadata_string(&new_meta, "frame_index", frame_index);
+    add_custom_metadata_float(&new_meta, "encode_ms", elapsed_ms(&start));
+
+    /* Append the image to the result batch */
+    append_result_image(output_buffer, enc_size, &new_meta);
+
+    /* Remember to free any allocated memory */
+    free(frame_index);
+    free(output_buffer);
+    JxlEncoderDestroy(encoder);
+}
+
+/* START MODULE IMPLEMENTATION */
+void module()
+{
+    /* Get number of images in input batch */
+    int num_images = get_input_num_images();
+
+    EncodeParams params;
+    params.effort = get_param_int("effort");
+    params.resampling = get_param_int("resampling");
+    params.distance = get_param_float("distance");
+    params.lossless = params.distance == 0;
+    int batch_frames = get_param_bool("batch_frames");
+    params.target_bytes = get_param_int("target_bytes");
+    params.trial_effort = get_param_int("trial_effort");
+    params.max_trials = get_param_int("max_trials");
+    params.progressive = get_param_bool("progressive");
+    int raw_bayer = get_param_bool("raw_bayer");
+    params.chunked = get_param_bool("chunked");
+
+    //Layer offsets are only recorded for single-frame codestreams
+    if (params.progressive && batch_frames && !raw_bayer)
+        signal_error_and_exit(INVALID_PARAM);
+
+    RateControl rc;
+    rc.distance = params.distance > MIN_DISTANCE ? params.distance : 1.0f;
+    rc.slope = 1.0;
+    rc.effort_ratio = 1.0;
+
+    for (int i = 0; i < num_images; ++i)
+    {
+        Metadata *input_meta = get_metadata(i);
+        if (input_meta->height <= 0 || input_meta->width <= 0 || input_meta->channels <= 0)
+            signal_error_and_exit(INVALID_INPUT);
+    }
+
+    if (raw_bayer)
+    {
+        for (int i = 0; i < num_images; ++i)
+            encode_raw_bayer(i, &params);
+        return;
+    }
+
+    if (!batch_frames)
+    {
+        for (int i = 0; i < num_images; ++i)
+            encode_single(i, &params, &rc);
+        return;
+    }
+
+    /* Consecutive images of the same observation are encoded as one multi-frame image */
+    int first = 0;
+    while (first < num_images)
+    {
+        int count = 1;
+        while (first + count < num_images && same_frame_group(get_metadata(first), get_metadata(first + count)))
+            count++;
+
+        if (count == 1)
+            encode_single(first, &params, &rc);
+        else
+            encode_group(first, count, &params);
+
+        first += count;
     }
 }
 /* END MODULE IMPLEMENTATION */
@@ -0,0 +1,350 @@
+#include "module.h"
+#include "util.h"
+
+#ifdef __ARM_NEON
+#include <arm_neon.h>
+#endif
+
+/* Define custom error codes */
+enum ERROR_CODE {
+    MALLOC_ERR = 1,
+    INVALID_INPUT = 2,
+    INVALID_PARAM = 3,
+};
+
+/*
+ * Line buffer of the filter: the same-colour column triples of one row, sorted into their low, middle and
+ * high sample. Each line has pad samples on both sides, mirrored from the row, so the horizontal pass needs
+ * no border cases. Allocated once per frame geometry.
+ */
+typedef struct MedianLines {
+    size_t n;      /* Samples per row */
+    int pad;       /* Distance to the horizontal same-colour neighbours */
+    uint16_t *buffer;
+    uint16_t *lo;
+    uint16_t *mid;
+    uint16_t *hi;
+} MedianLines;
+
+static inline uint16_t min_u16(uint16_t a, uint16_t b)
+{
+    return a < b ? a : b;
+}
+
+static inline uint16_t max_u16(uint16_t a, uint16_t b)
+{
+    return a < b ? b : a;
+}
+
+/* Median of three as a sorting network of min and max */
+static inline uint16_t median3(uint16_t a, uint16_t b, uint16_t c)
+{
+    return max_u16(min_u16(a, b), min_u16(max_u16(a, b), c));
+}
+
+static inline uint16_t get_sample(const unsigned char *data, int wide, size_t index)
+{
+    return wide ? ((const uint16_t *)data)[index] : data[index];
+}
+
+static void init_lines(MedianLines *lines, size_t n, int pad)
+{
+    size_t length = n + 2 * (size_t)pad;
+    lines->n = n;
+    lines->pad = pad;
+    lines->buffer = (uint16_t *)malloc(sizeof(uint16_t) * 3 * length);
+    if (lines->buffer == NULL)
+        signal_error_and_exit(MALLOC_ERR);
+    lines->lo = lines->buffer + pad;
+    lines->mid = lines->lo + length;
+    lines->hi = lines->mid + length;
+}
+
+static void free_lines(MedianLines *lines)
+{
+    free(lines->buffer);
+    lines->buffer = NULL;
+}
+
+#ifdef __ARM_NEON
+static inline uint16x8_t load_u16x8(const unsigned char *data, int wide, size_t index)
+{
+    return wide ? vld1q_u16((const uint16_t *)data + index) : vmovl_u8(vld1_u8(data + index));
+}
+
+static inline uint16x8_t median3_u16x8(uint16x8_t a, uint16x8_t b, uint16x8_t c)
+{
+    return vmaxq_u16(vminq_u16(a, b), vminq_u16(vmaxq_u16(a, b), c));
+}
+#endif
+
+/* Vertical pass: sort the samples of the rows above, at and below each position into the line buffer */
+static void sort_columns(MedianLines *lines, const unsigned char *up, const unsigned char *row,
+                         const unsigned char *down, int wide)
+{
+    size_t n = lines->n;
+    size_t x = 0;
+#ifdef __ARM_NEON
+    for (; x + 8 <= n; x += 8)
+    {
+        uint16x8_t a = load_u16x8(up, wide, x);
+        uint16x8_t b = load_u16x8(row, wide, x);
+        uint16x8_t c = load_u16x8(down, wide, x);
+        uint16x8_t low = vminq_u16(a, b), high = vmaxq_u16(a, b);
+        vst1q_u16(lines->lo + x, vminq_u16(low, c));
+        vst1q_u16(lines->mid + x, vmaxq_u16(low, vminq_u16(high, c)));
+        vst1q_u16(lines->hi + x, vmaxq_u16(high, c));
+    }
+#endif
+    for (; x < n; ++x)
+    {
+        uint16_t a = get_sample(up, wide, x), b = get_sample(row, wide, x), c = get_sample(down, wide, x);
+        uint16_t low = min_u16(a, b), high = max_u16(a, b);
+        lines->lo[x] = min_u16(low, c);
+        lines->mid[x] = max_u16(low, min_u16(high, c));
+        lines->hi[x] = max_u16(high, c);
+    }
+
+    /* Mirror the borders around the first and last sample of each colour */
+    int pad = lines->pad;
+    uint16_t *line[3] = {lines->lo, lines->mid, lines->hi};
+    for (int k = 0; k < 3; ++k)
+        for (int j = 1; j <= pad; ++j)
+        {
+            line[k][-j] = line[k][2 * pad - j];
+            line[k][n - 1 + j] = line[k][n - 1 + j - 2 * pad];
+        }
+}
+
+/*
+ * Horizontal pass: the median of the nine samples is the median of the largest low, the middle mid and the
+ * smallest high of the three sorted columns. Samples further than limit from the median are replaced by it,
+ * the others are copied.
+ */
+static void filter_row(const MedianLines *lines, const unsigned char *row, unsigned char *out, int wide,
+                       uint16_t limit)
+{
+    size_t n = lines->n;
+    int pad = lines->pad;
+    const uint16_t *lo = lines->lo, *mid = lines->mid, *hi = lines->hi;
+    size_t x = 0;
+#ifdef __ARM_NEON
+    uint16x8_t limit_v = vdupq_n_u16(limit);
+    for (; x + 8 <= n; x += 8)
+    {
+        uint16x8_t low = vmaxq_u16(vmaxq_u16(vld1q_u16(lo + x - pad), vld1q_u16(lo + x)), vld1q_u16(lo + x + pad));
+        uint16x8_t high = vminq_u16(vminq_u16(vld1q_u16(hi + x - pad), vld1q_u16(hi + x)), vld1q_u16(hi + x + pad));
+        uint16x8_t middle = median3_u16x8(vld1q_u16(mid + x - pad), vld1q_u16(mid + x), vld1q_u16(mid + x + pad));
+        uint16x8_t median = median3_u16x8(low, middle, high);
+        uint16x8_t sample = load_u16x8(row, wide, x);
+        uint16x8_t value = vbslq_u16(vcgtq_u16(vabdq_u16(sample, median), limit_v), median, sample);
+        if (wide)
+            vst1q_u16((uint16_t *)out + x, value);
+        else
+            vst1_u8(out + x, vmovn_u16(value));
+    }
+#endif
+    for (; x < n; ++x)
+    {
+        uint16_t low = max_u16(max_u16(lo[x - pad], lo[x]), lo[x + pad]);
+        uint16_t high = min_u16(min_u16(hi[x - pad], hi[x]), hi[x + pad]);
+        uint16_t median = median3(low, median3(mid[x - pad], mid[x], mid[x + pad]), high);
+        uint16_t sample = get_sample(row, wide, x);
+        uint16_t distance = sample > median ? sample - median : median - sample;
+        uint16_t value = distance > limit ? median : sample;
+        if (wide)
+            ((uint16_t *)out)[x] = value;
+        else
+            out[x] = (unsigned char)value;
+    }
+}
+
+/* Filter a frame of height rows of lines->n samples, same-colour rows are row_step apart */
+static void median_filter(MedianLines *lines, const unsigned char *src, unsigned char *dst, int height,
+                          int row_step, int wide, uint16_t limit)
+{
+    size_t stride = lines->n * (wide ? 2 : 1);
+    for (int y = 0; y < height; ++y)
+    {
+        int up = y - row_step >= 0 ? y - row_step : y + row_step;
+        int down = y + row_step < height ? y + row_step : y - row_step;
+        sort_columns(lines, src + up * stride, src + y * stride, src + down * stride, wide);
+        filter_row(lines, src + y * stride, dst + y * stride, wide, limit);
+    }
+}
+
+/* START MODULE IMPLEMENTATION */
+void module()
+{
+    /* Get number of images in input batch */
+    int num_images = get_input_num_images();
+
+    int cfa = get_param_bool("cfa");
+    float threshold = get_param_float("median_threshold");
+    if (threshold < 0.0f || threshold > 1.0f)
+        signal_error_and_exit(INVALID_PARAM);
+
+    MedianLines lines;
+    memset(&lines, 0, sizeof(lines));
+
+    for (int i = 0; i < num_images; ++i)
+    {
+        Metadata *input_meta = get_metadata(i);
+        int width = input_meta->width;
+        int height = input_meta->height;
+        int channels = input_meta->channels;
+        int bits = input_meta->bits_pixel;
+        int wide = bits > 8;
+        /* Only single channel frames are CFA mosaics, other channels are interleaved */
+        int row_step = cfa && channels == 1 ? 2 : 1;
+        int pad = cfa && channels == 1 ? 2 : channels;
+
+        if (channels < 1 || bits < 1 || bits > 16 || width <= 2 * row_step || height <= 2 * row_step)
+            signal_error_and_exit(INVALID_INPUT);
+
+        const unsigned char *input_image_data;
+        size_t size = get_image_view(i, &input_image_data);
+        if (size != (size_t)width * height * channels * (wide ? 2 : 1))
+            signal_error_and_exit(INVALID_INPUT);
+
+        size_t n = (size_t)width * channels;
+        if (n != lines.n || pad != lines.pad)
+        {
+            free_lines(&lines);
+            init_lines(&lines, n, pad);
+        }
+
+        /* Create image metadata before appending */
+        Metadata new_meta = METADATA__INIT;
+        new_meta.size = size;
+        new_meta.width = width;
+        new_meta.height = height;
+        new_meta.channels = channels;
+        new_meta.timestamp = input_meta->timestamp;
+        new_meta.bits_pixel = bits;
+        new_meta.camera = input_meta->camera;
+        new_meta.obid = input_meta->obid;
+        add_custom_metadata_bool(&new_meta, "median_filtered", 1);
+        copy_custom_metadata(&new_meta, input_meta, NULL);
+
+        /* Rows are filtered from the input view straight into the result batch */
+        unsigned char *output_image_data = reserve_result_image(size, &new_meta);
+        if (output_image_data == NULL)
+            signal_error_and_exit(MALLOC_ERR);
+        uint16_t limit = (uint16_t)(threshold * ((1u << bits) - 1));
+        median_filter(&lines, input_image_data, output_image_data, height, row_step, wide, limit);
+    }
+
+    free_lines(&lines);
+}
+/* END MODULE IMPLEMENTATION */
+
+/* Main function of module (NO NEED TO MODIFY) */
+ImageBatch run(ImageBatch *input_batch, ModuleParameterList *module_parameter_list, int *ipc_error_pipe)
+{
+    ImageBatch result_batch;
+    result = &result_batch;
+    input = input_batch;
+    config = module_parameter_list;
+    error_pipe = ipc_error_pipe;
+    initialize();
+
+    module();
+
+    finalize();
+
+    return result_batch;
+}
+
+#ifdef TESTING_MODULE_STANDALONE
+
+#include <time.h>
+
+static int compare_u16(const void *a, const void *b)
+{
+    return *(const uint16_t *)a - *(const uint16_t *)b;
+}
+
+/* Reference: sort the nine mirrored same-colour neighbours of every sample */
+static void reference_median(const uint16_t *src, uint16_t *dst, int width, int height, int channels, int step,
+                             int row_step, uint16_t limit)
+{
+    int n = width * channels;
+    for (int y = 0; y < height; ++y)
+        for (int x = 0; x < n; ++x)
+        {
+            uint16_t values[9];
+            int k = 0;
+            for (int dy = -1; dy <= 1; ++dy)
+                for (int dx = -1; dx <= 1; ++dx)
+                {
+                    int sy = y + dy * row_step, sx = x + dx * step;
+                    sy = sy < 0 ? y + row_step : sy >= height ? y - row_step : sy;
+                    sx = sx < 0 ? x + step : sx >= n ? x - step : sx;
+                    values[k++] = src[sy * n + sx];
+                }
+            qsort(values, 9, sizeof(uint16_t), compare_u16);
+            uint16_t sample = src[y * n + x];
+            dst[y * n + x] = abs(sample - values[4]) > limit ? values[4] : sample;
+        }
+}
+
+static int check(int width, int height, int channels, int cfa, int bits, uint16_t limit, double *ms)
+{
+    int wide = bits > 8;
+    int row_step = cfa ? 2 : 1, pad = cfa ? 2 : channels;
+    size_t samples = (size_t)width * height * channels;
+    uint16_t *frame = malloc(sizeof(uint16_t) * samples);
+    uint16_t *expected = malloc(sizeof(uint16_t) * samples);
+    unsigned char *src = malloc(samples * 2), *dst = malloc(samples * 2);
+
+    /* A smooth scene with noise, hot pixels and saturated pixels */
+    uint16_t max_value = (uint16_t)((1u << bits) - 1);
+    for (size_t s = 0; s < samples; ++s)
+    {
+        uint32_t value = (s % 97) * max_value / 200 + rand() % (max_value / 16 + 1);
+        if (rand() % 500 == 0)
+            value = max_value;
+        frame[s] = (uint16_t)(value < max_value ? value : max_value);
+        if (wide)
+            ((uint16_t *)src)[s] = frame[s];
+        else
+            src[s] = (unsigned char)frame[s];
+    }
+    reference_median(frame, expected, width, height, channels, pad, row_step, limit);
+
+    MedianLines lines;
+    init_lines(&lines, (size_t)width * channels, pad);
+    clock_t start = clock();
+    median_filter(&lines, src, dst, height, row_step, wide, limit);
+    *ms = 1000.0 * (clock() - start) / CLOCKS_PER_SEC;
+    free_lines(&lines);
+
+    int errors = 0;
+    for (size_t s = 0; s < samples; ++s)
+        errors += get_sample(dst, wide, s) != expected[s];
+
+    free(frame);
+    free(expected);
+    free(src);
+    free(dst);
+    return errors;
+}
+
+/* Host-side check against sorting all nine samples: 12-bit CFA frames with and without a threshold,
+   an interleaved 8-bit RGB frame and a frame narrower than a vector */
+int main(void)
+{
+    double cfa_ms, threshold_ms, rgb_ms, narrow_ms;
+    int cfa_errors = check(2464, 2056, 1, 1, 12, 0, &cfa_ms);
+    int threshold_errors = check(2464, 2056, 1, 1, 12, 400, &threshold_ms);
+    int rgb_errors = check(1231, 1027, 3, 0, 8, 0, &rgb_ms);
+    int narrow_errors = check(5, 7, 1, 1, 16, 100, &narrow_ms);
+
+    printf("12-bit CFA: %d errors (%.1f ms), with threshold: %d errors (%.1f ms), 8-bit RGB: %d errors (%.1f ms), "
+           "narrow: %d errors\n",
+           cfa_errors, cfa_ms, threshold_errors, threshold_ms, rgb_errors, rgb_ms, narrow_errors);
+    return cfa_errors != 0 || threshold_errors != 0 || rgb_errors != 0 || narrow_errors != 0;
+}
+
+#endif
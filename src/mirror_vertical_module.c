@@ -0,0 +1,264 @@
+#include "module.h"
+#include "util.h"
+
+#ifdef __ARM_NEON
+#include <arm_neon.h>
+#endif
+
+/* Define custom error codes in the range of 1-99*/
+enum ERROR_CODE {
+    MALLOC_ERR = 1,
+    INVALID_INPUT = 2,
+    INVALID_PARAM = 3,
+};
+
+/* Largest pixel handled: 4 channels of 16-bit samples */
+#define MAX_PIXEL_BYTES 8
+
+#ifdef __ARM_NEON
+static inline uint8x16_t reverse_u8(uint8x16_t v)
+{
+    v = vrev64q_u8(v);
+    return vextq_u8(v, v, 8);
+}
+
+static inline uint16x8_t reverse_u16(uint16x8_t v)
+{
+    v = vrev64q_u16(v);
+    return vextq_u16(v, v, 4);
+}
+
+static inline uint32x4_t reverse_u32(uint32x4_t v)
+{
+    v = vrev64q_u32(v);
+    return vextq_u32(v, v, 2);
+}
+
+/* Pixels in one vector block for each pixel size, 0 if there is no vector path */
+static int block_pixels(int pixel_bytes)
+{
+    switch (pixel_bytes)
+    {
+    case 1: return 16;
+    case 2: return 8;
+    case 3: return 16;
+    case 4: return 4;
+    case 6: return 8;
+    case 8: return 2;
+    default: return 0;
+    }
+}
+
+/* Copy one block of pixels from src to dst in reverse pixel order. Three channel pixels are
+   split into planes by the de-interleaving load, each plane is reversed and interleaved again. */
+static inline void reverse_block(const uint8_t *src, uint8_t *dst, int pixel_bytes)
+{
+    switch (pixel_bytes)
+    {
+    case 1:
+        vst1q_u8(dst, reverse_u8(vld1q_u8(src)));
+        break;
+    case 2:
+        vst1q_u16((uint16_t *)dst, reverse_u16(vld1q_u16((const uint16_t *)src)));
+        break;
+    case 3:
+    {
+        uint8x16x3_t p = vld3q_u8(src);
+        p.val[0] = reverse_u8(p.val[0]);
+        p.val[1] = reverse_u8(p.val[1]);
+        p.val[2] = reverse_u8(p.val[2]);
+        vst3q_u8(dst, p);
+        break;
+    }
+    case 4:
+        vst1q_u32((uint32_t *)dst, reverse_u32(vld1q_u32((const uint32_t *)src)));
+        break;
+    case 6:
+    {
+        uint16x8x3_t p = vld3q_u16((const uint16_t *)src);
+        p.val[0] = reverse_u16(p.val[0]);
+        p.val[1] = reverse_u16(p.val[1]);
+        p.val[2] = reverse_u16(p.val[2]);
+        vst3q_u16((uint16_t *)dst, p);
+        break;
+    }
+    case 8:
+    {
+        uint64x2_t v = vld1q_u64((const uint64_t *)src);
+        vst1q_u64((uint64_t *)dst, vextq_u64(v, v, 1));
+        break;
+    }
+    }
+}
+#endif
+
+/* Mirror a row of width pixels from src into dst */
+static void mirror_row(const uint8_t *src, uint8_t *dst, int width, int pixel_bytes)
+{
+    int x = 0;
+#ifdef __ARM_NEON
+    int n = block_pixels(pixel_bytes);
+    if (n > 0)
+        for (; x + n <= width; x += n)
+            reverse_block(src + (size_t)(width - x - n) * pixel_bytes, dst + (size_t)x * pixel_bytes, pixel_bytes);
+#endif
+    for (; x < width; ++x)
+        memcpy(dst + (size_t)x * pixel_bytes, src + (size_t)(width - 1 - x) * pixel_bytes, pixel_bytes);
+}
+
+/* START MODULE IMPLEMENTATION */
+void module()
+{
+    /* Get number of images in input batch */
+    int num_images = get_input_num_images();
+
+    float flip_percent = get_param_float("flip_percent");
+    if (flip_percent < 0.0f || flip_percent > 1.0f)
+        signal_error_and_exit(INVALID_PARAM);
+
+    for (int i = 0; i < num_images; ++i)
+    {
+        Metadata *input_meta = get_metadata(i);
+        int height = input_meta->height;
+        int width = input_meta->width;
+        int channels = input_meta->channels;
+        int bits_pixel = input_meta->bits_pixel;
+        int pixel_bytes = channels * (bits_pixel > 8 ? 2 : 1);
+
+        if (width <= 0 || height <= 0 || channels <= 0 || bits_pixel < 1 || bits_pixel > 16
+            || pixel_bytes > MAX_PIXEL_BYTES)
+            signal_error_and_exit(INVALID_INPUT);
+
+        /* Rows 0 .. flip_height are mirrored, the rows below are copied unchanged */
+        int flip_height = height * flip_percent;
+        int flip_rows = flip_height + 1 < height ? flip_height + 1 : height;
+        size_t row_bytes = (size_t)width * pixel_bytes;
+
+        Metadata new_meta = METADATA__INIT;
+        new_meta.size = row_bytes * height;
+        new_meta.width = width;
+        new_meta.height = height;
+        new_meta.channels = channels;
+        new_meta.timestamp = input_meta->timestamp;
+        new_meta.bits_pixel = bits_pixel;
+        new_meta.camera = input_meta->camera;
+        new_meta.obid = input_meta->obid;
+        copy_custom_metadata(&new_meta, input_meta, NULL);
+
+        const unsigned char *input_image_data;
+        size_t size = get_image_view(i, &input_image_data);
+        if (size != row_bytes * height)
+            signal_error_and_exit(INVALID_INPUT);
+
+        unsigned char *output_image_data = reserve_result_image(size, &new_meta);
+        if (output_image_data == NULL)
+            signal_error_and_exit(MALLOC_ERR);
+
+        for (int y = 0; y < flip_rows; ++y)
+            mirror_row(input_image_data + y * row_bytes, output_image_data + y * row_bytes, width, pixel_bytes);
+        memcpy(output_image_data + flip_rows * row_bytes, input_image_data + flip_rows * row_bytes,
+               (height - flip_rows) * row_bytes);
+    }
+}
+/* END MODULE IMPLEMENTATION */
+
+/* Main function of module (NO NEED TO MODIFY) */
+ImageBatch run(ImageBatch *input_batch, ModuleParameterList *module_parameter_list, int *ipc_error_pipe)
+{
+    ImageBatch result_batch;
+    result = &result_batch;
+    input = input_batch;
+    config = module_parameter_list;
+    error_pipe = ipc_error_pipe;
+    initialize();
+
+    module();
+
+    finalize();
+
+    return result_batch;
+}
+
+#ifdef TESTING_MODULE_STANDALONE
+
+/* The previous implementation, kept as the reference. It works on bytes, so a pixel has channels bytes. */
+static void mirror_reference(const unsigned char *input_image_data, unsigned char *output_image_data,
+                             int width, int height, int channels, int flip_height)
+{
+    for (int y = 0; y < height; ++y)
+    {
+        for (int x = 0; x < width / 2; ++x)
+        {
+            for (int c = 0; c < channels; ++c)
+            {
+                if (y > flip_height)
+                {
+                    output_image_data[((y * width + x) * channels + c)] =
+                        input_image_data[(y * width + x) * channels + c];
+                    output_image_data[((y * width + (width - 1 - x)) * channels + c)] =
+                        input_image_data[(y * width + (width - 1 - x)) * channels + c];
+                }
+                else
+                {
+                    unsigned char temp = input_image_data[(y * width + x) * channels + c];
+                    output_image_data[((y * width + x) * channels + c)] =
+                        input_image_data[(y * width + (width - 1 - x)) * channels + c];
+                    output_image_data[((y * width + (width - 1 - x)) * channels + c)] = temp;
+                }
+            }
+        }
+        /* The reference never writes the middle column of odd widths, which stays in place */
+        if (width % 2)
+            memcpy(output_image_data + ((size_t)y * width + width / 2) * channels,
+                   input_image_data + ((size_t)y * width + width / 2) * channels, channels);
+    }
+}
+
+/* Host-side check: the row mirror against the previous implementation, for every pixel size */
+int main(void)
+{
+    const int widths[] = {1, 2, 7, 16, 33, 640, 2463};
+    const int pixel_sizes[] = {1, 2, 3, 4, 6, 8};
+    const float percents[] = {0.0f, 0.37f, 1.0f};
+    const int height = 9;
+    int failures = 0;
+
+    for (size_t w = 0; w < sizeof(widths) / sizeof(widths[0]); ++w)
+        for (size_t p = 0; p < sizeof(pixel_sizes) / sizeof(pixel_sizes[0]); ++p)
+            for (size_t f = 0; f < sizeof(percents) / sizeof(percents[0]); ++f)
+            {
+                int width = widths[w];
+                int pixel_bytes = pixel_sizes[p];
+                int flip_height = height * percents[f];
+                int flip_rows = flip_height + 1 < height ? flip_height + 1 : height;
+                size_t row_bytes = (size_t)width * pixel_bytes;
+                size_t size = row_bytes * height;
+
+                unsigned char *src = malloc(size);
+                unsigned char *expected = malloc(size);
+                unsigned char *out = malloc(size);
+                for (size_t k = 0; k < size; ++k)
+                    src[k] = rand();
+
+                mirror_reference(src, expected, width, height, pixel_bytes, flip_height);
+                for (int y = 0; y < height; ++y)
+                    if (y < flip_rows)
+                        mirror_row(src + y * row_bytes, out + y * row_bytes, width, pixel_bytes);
+                    else
+                        memcpy(out + y * row_bytes, src + y * row_bytes, row_bytes);
+
+                if (memcmp(out, expected, size) != 0)
+                {
+                    printf("MISMATCH: width %d, pixel bytes %d, flip height %d\n", width, pixel_bytes, flip_height);
+                    failures++;
+                }
+                free(src);
+                free(expected);
+                free(out);
+            }
+
+    printf("%s\n", failures == 0 ? "All cases match the previous implementation" : "FAILED");
+    return failures != 0;
+}
+
+#endif
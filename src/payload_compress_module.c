@@ -0,0 +1,237 @@
+#include "module.h"
+#include "util.h"
+#include "dictionary.h"
+#include <time.h>
+#include <zstd.h>
+#include <lz4.h>
+#include <lz4hc.h>
+
+/* Define custom error codes */
+enum ERROR_CODE {
+    MALLOC_ERR = 1,
+    INVALID_PARAM = 2,
+    DICT_ERR = 3,
+    ZSTD_ERR = 4,
+    LZ4_ERR = 5,
+};
+
+typedef enum Codec {
+    CODEC_LZ4,
+    CODEC_ZSTD,
+} Codec;
+
+/* Compression state shared by all images of the batch, so the dictionary is only loaded once */
+typedef struct Compressor {
+    Codec codec;
+    int level;
+    unsigned char *dict;
+    size_t dict_size;
+    ZSTD_CCtx *cctx;
+    ZSTD_CDict *cdict;
+    LZ4_stream_t *lz4_stream;
+    LZ4_stream_t *lz4_dict;
+    LZ4_streamHC_t *lz4_hc;
+    LZ4_streamHC_t *lz4_hc_dict;
+} Compressor;
+
+static double elapsed_ms(const struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1e3 + (now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+static void init_compressor(Compressor *c, const char *codec, int level, int threads, const char *dictionary)
+{
+    memset(c, 0, sizeof(*c));
+    if (strcmp(codec, "zstd") == 0)
+        c->codec = CODEC_ZSTD;
+    else if (strcmp(codec, "lz4") == 0)
+        c->codec = CODEC_LZ4;
+    else
+        signal_error_and_exit(INVALID_PARAM);
+    c->level = level;
+
+    int status = dictionary_load(dictionary, &c->dict, &c->dict_size);
+    if (status != 0)
+        signal_error_and_exit(status == -2 ? MALLOC_ERR : DICT_ERR);
+
+    if (c->codec == CODEC_ZSTD)
+    {
+        c->cctx = ZSTD_createCCtx();
+        if (c->cctx == NULL)
+            signal_error_and_exit(MALLOC_ERR);
+        if (ZSTD_isError(ZSTD_CCtx_setParameter(c->cctx, ZSTD_c_compressionLevel, level))
+            || ZSTD_isError(ZSTD_CCtx_setParameter(c->cctx, ZSTD_c_checksumFlag, 1)))
+            signal_error_and_exit(ZSTD_ERR);
+        /* Worker threads need a multithreaded libzstd, a single threaded build keeps compressing inline */
+        if (threads > 1)
+            ZSTD_CCtx_setParameter(c->cctx, ZSTD_c_nbWorkers, threads);
+
+        if (c->dict != NULL)
+        {
+            c->cdict = ZSTD_createCDict(c->dict, c->dict_size, level);
+            if (c->cdict == NULL || ZSTD_isError(ZSTD_CCtx_refCDict(c->cctx, c->cdict)))
+                signal_error_and_exit(DICT_ERR);
+        }
+    }
+    else if (level >= LZ4HC_CLEVEL_MIN)
+    {
+        c->lz4_hc = LZ4_createStreamHC();
+        if (c->lz4_hc == NULL)
+            signal_error_and_exit(MALLOC_ERR);
+        /* The dictionary is hashed into its own stream once, every image starts from a copy of it */
+        if (c->dict != NULL)
+        {
+            c->lz4_hc_dict = LZ4_createStreamHC();
+            if (c->lz4_hc_dict == NULL)
+                signal_error_and_exit(MALLOC_ERR);
+            LZ4_resetStreamHC_fast(c->lz4_hc_dict, level);
+            LZ4_loadDictHC(c->lz4_hc_dict, (const char *)c->dict, c->dict_size);
+        }
+    }
+    else
+    {
+        c->lz4_stream = LZ4_createStream();
+        if (c->lz4_stream == NULL)
+            signal_error_and_exit(MALLOC_ERR);
+        if (c->dict != NULL)
+        {
+            c->lz4_dict = LZ4_createStream();
+            if (c->lz4_dict == NULL)
+                signal_error_and_exit(MALLOC_ERR);
+            LZ4_loadDict(c->lz4_dict, (const char *)c->dict, c->dict_size);
+        }
+    }
+}
+
+static void free_compressor(Compressor *c)
+{
+    ZSTD_freeCCtx(c->cctx);
+    ZSTD_freeCDict(c->cdict);
+    if (c->lz4_stream != NULL)
+        LZ4_freeStream(c->lz4_stream);
+    if (c->lz4_dict != NULL)
+        LZ4_freeStream(c->lz4_dict);
+    if (c->lz4_hc != NULL)
+        LZ4_freeStreamHC(c->lz4_hc);
+    if (c->lz4_hc_dict != NULL)
+        LZ4_freeStreamHC(c->lz4_hc_dict);
+    free(c->dict);
+}
+
+/* Compress one payload, returns the compressed size */
+static size_t compress_payload(Compressor *c, const unsigned char *data, size_t size, unsigned char **out)
+{
+    if (c->codec == CODEC_ZSTD)
+    {
+        size_t capacity = ZSTD_compressBound(size);
+        *out = (unsigned char *)malloc(capacity);
+        if (*out == NULL)
+            signal_error_and_exit(MALLOC_ERR);
+        size_t enc_size = ZSTD_compress2(c->cctx, *out, capacity, data, size);
+        if (ZSTD_isError(enc_size))
+            signal_error_and_exit(ZSTD_ERR);
+        return enc_size;
+    }
+
+    if (size > LZ4_MAX_INPUT_SIZE)
+        signal_error_and_exit(LZ4_ERR);
+    int capacity = LZ4_compressBound(size);
+    *out = (unsigned char *)malloc(capacity);
+    if (*out == NULL)
+        signal_error_and_exit(MALLOC_ERR);
+
+    int enc_size;
+    if (c->lz4_hc != NULL)
+    {
+        /* LZ4_attach_HC_dictionary is not exported by shared liblz4 builds, so the primed stream is copied */
+        if (c->lz4_hc_dict != NULL)
+            memcpy(c->lz4_hc, c->lz4_hc_dict, sizeof(LZ4_streamHC_t));
+        else
+            LZ4_resetStreamHC_fast(c->lz4_hc, c->level);
+        enc_size = LZ4_compress_HC_continue(c->lz4_hc, (const char *)data, (char *)*out, size, capacity);
+    }
+    else
+    {
+        /* Levels below 1 select faster, larger LZ4 acceleration */
+        int acceleration = c->level < 1 ? 1 - c->level : 1;
+        /* Start from a copy of the stream with the dictionary loaded, instead of hashing the dictionary again */
+        if (c->lz4_dict != NULL)
+            memcpy(c->lz4_stream, c->lz4_dict, sizeof(LZ4_stream_t));
+        else
+            LZ4_resetStream_fast(c->lz4_stream);
+        enc_size = LZ4_compress_fast_continue(c->lz4_stream, (const char *)data, (char *)*out, size, capacity, acceleration);
+    }
+    if (enc_size <= 0)
+        signal_error_and_exit(LZ4_ERR);
+    return enc_size;
+}
+
+/* START MODULE IMPLEMENTATION */
+void module()
+{
+    /* Get number of images in input batch */
+    int num_images = get_input_num_images();
+
+    Compressor compressor;
+    init_compressor(&compressor, get_param_string("codec"), get_param_int("level"), get_param_int("threads"),
+                    get_param_string("dictionary"));
+
+    for (int i = 0; i < num_images; ++i)
+    {
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        Metadata *input_meta = get_metadata(i);
+        const unsigned char *input_image_data;
+        size_t size = get_image_view(i, &input_image_data);
+
+        unsigned char *output_buffer;
+        size_t enc_size = compress_payload(&compressor, input_image_data, size, &output_buffer);
+
+        /* Create image metadata before appending */
+        Metadata new_meta = METADATA__INIT;
+        new_meta.size = enc_size;
+        new_meta.width = input_meta->width;
+        new_meta.height = input_meta->height;
+        new_meta.channels = input_meta->channels;
+        new_meta.timestamp = input_meta->timestamp;
+        new_meta.bits_pixel = input_meta->bits_pixel;
+        new_meta.camera = input_meta->camera;
+        new_meta.obid = input_meta->obid;
+        add_custom_metadata_string(&new_meta, "enc", compressor.codec == CODEC_ZSTD ? "zstd" : "lz4");
+        add_custom_metadata_int(&new_meta, "raw_size", size);
+        add_custom_metadata_float(&new_meta, "compress_ms", elapsed_ms(&start));
+        /* An already encoded payload keeps its encoding, the decompress module restores it */
+        if (has_custom_metadata(input_meta, "enc"))
+            add_custom_metadata_string(&new_meta, "inner_enc", get_custom_metadata_string(input_meta, "enc"));
+        copy_custom_metadata(&new_meta, input_meta, NULL);
+
+        /* Append the image to the result batch */
+        append_result_image(output_buffer, enc_size, &new_meta);
+
+        /* Remember to free any allocated memory */
+        free(output_buffer);
+    }
+
+    free_compressor(&compressor);
+}
+/* END MODULE IMPLEMENTATION */
+
+/* Main function of module (NO NEED TO MODIFY) */
+ImageBatch run(ImageBatch *input_batch, ModuleParameterList *module_parameter_list, int *ipc_error_pipe)
+{
+    ImageBatch result_batch;
+    result = &result_batch;
+    input = input_batch;
+    config = module_parameter_list;
+    error_pipe = ipc_error_pipe;
+    initialize();
+
+    module();
+
+    finalize();
+
+    return result_batch;
+}
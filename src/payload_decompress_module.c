@@ -0,0 +1,127 @@
+#include "module.h"
+#include "util.h"
+#include "dictionary.h"
+#include <zstd.h>
+#include <lz4.h>
+
+/* Define custom error codes */
+enum ERROR_CODE {
+    MALLOC_ERR = 1,
+    DICT_ERR = 2,
+    ZSTD_ERR = 3,
+    LZ4_ERR = 4,
+    INVALID_INPUT = 5,
+};
+
+/* Items added by the compress module, dropped again when the payload is restored */
+static const char *const compress_keys[] = {"enc", "raw_size", "compress_ms", "inner_enc", NULL};
+
+/* START MODULE IMPLEMENTATION */
+void module()
+{
+    /* Get number of images in input batch */
+    int num_images = get_input_num_images();
+
+    /* The dictionary is loaded once per run and shared by all images */
+    unsigned char *dict;
+    size_t dict_size;
+    int status = dictionary_load(get_param_string("dictionary"), &dict, &dict_size);
+    if (status != 0)
+        signal_error_and_exit(status == -2 ? MALLOC_ERR : DICT_ERR);
+
+    ZSTD_DCtx *dctx = ZSTD_createDCtx();
+    ZSTD_DDict *ddict = dict != NULL ? ZSTD_createDDict(dict, dict_size) : NULL;
+    if (dctx == NULL || (dict != NULL && ddict == NULL))
+        signal_error_and_exit(MALLOC_ERR);
+
+    for (int i = 0; i < num_images; ++i)
+    {
+        Metadata *input_meta = get_metadata(i);
+        const unsigned char *input_image_data;
+        size_t size = get_image_view(i, &input_image_data);
+
+        const char *enc = has_custom_metadata(input_meta, "enc") ? get_custom_metadata_string(input_meta, "enc") : "";
+        int is_zstd = strcmp(enc, "zstd") == 0;
+        int is_lz4 = strcmp(enc, "lz4") == 0;
+
+        /* Create image metadata before appending */
+        Metadata new_meta = METADATA__INIT;
+        new_meta.width = input_meta->width;
+        new_meta.height = input_meta->height;
+        new_meta.channels = input_meta->channels;
+        new_meta.timestamp = input_meta->timestamp;
+        new_meta.bits_pixel = input_meta->bits_pixel;
+        new_meta.camera = input_meta->camera;
+        new_meta.obid = input_meta->obid;
+
+        /* Payloads that were not compressed by the compress module pass through unchanged */
+        if (!is_zstd && !is_lz4)
+        {
+            new_meta.size = size;
+            copy_custom_metadata(&new_meta, input_meta, NULL);
+            append_result_image((unsigned char *)input_image_data, size, &new_meta);
+            continue;
+        }
+
+        if (!has_custom_metadata(input_meta, "raw_size") || get_custom_metadata_int(input_meta, "raw_size") < 0)
+            signal_error_and_exit(INVALID_INPUT);
+        size_t raw_size = get_custom_metadata_int(input_meta, "raw_size");
+
+        unsigned char *output_buffer = (unsigned char *)malloc(raw_size > 0 ? raw_size : 1);
+        if (output_buffer == NULL)
+            signal_error_and_exit(MALLOC_ERR);
+
+        if (is_zstd)
+        {
+            size_t dec_size = ddict != NULL
+                ? ZSTD_decompress_usingDDict(dctx, output_buffer, raw_size, input_image_data, size, ddict)
+                : ZSTD_decompressDCtx(dctx, output_buffer, raw_size, input_image_data, size);
+            if (ZSTD_isError(dec_size))
+                signal_error_and_exit(ZSTD_ERR);
+            if (dec_size != raw_size)
+                signal_error_and_exit(INVALID_INPUT);
+        }
+        else
+        {
+            int dec_size = LZ4_decompress_safe_usingDict((const char *)input_image_data, (char *)output_buffer, size,
+                                                         raw_size, (const char *)dict, dict_size);
+            if (dec_size < 0)
+                signal_error_and_exit(LZ4_ERR);
+            if ((size_t)dec_size != raw_size)
+                signal_error_and_exit(INVALID_INPUT);
+        }
+
+        new_meta.size = raw_size;
+        if (has_custom_metadata(input_meta, "inner_enc"))
+            add_custom_metadata_string(&new_meta, "enc", get_custom_metadata_string(input_meta, "inner_enc"));
+        copy_custom_metadata(&new_meta, input_meta, compress_keys);
+
+        /* Append the image to the result batch */
+        append_result_image(output_buffer, raw_size, &new_meta);
+
+        /* Remember to free any allocated memory */
+        free(output_buffer);
+    }
+
+    ZSTD_freeDDict(ddict);
+    ZSTD_freeDCtx(dctx);
+    free(dict);
+}
+/* END MODULE IMPLEMENTATION */
+
+/* Main function of module (NO NEED TO MODIFY) */
+ImageBatch run(ImageBatch *input_batch, ModuleParameterList *module_parameter_list, int *ipc_error_pipe)
+{
+    ImageBatch result_batch;
+    result = &result_batch;
+    input = input_batch;
+    config = module_parameter_list;
+    error_pipe = ipc_error_pipe;
+    initialize();
+
+    module();
+
+    finalize();
+
+    return result_batch;
+}
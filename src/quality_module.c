@@ -0,0 +1,312 @@
+#include "module.h"
+#include "util.h"
+#include <math.h>
+#include <time.h>
+
+/* Define custom error codes */
+enum ERROR_CODE {
+    MALLOC_ERR = 1,
+    INVALID_INPUT = 2,
+    INVALID_PARAM = 3,
+};
+
+/* A bright sample counts as cloud when its gray-world balanced R, G and B differ by less than this fraction */
+#define CLOUD_MAX_SPREAD 0.25f
+
+typedef struct QualityStats {
+    float mean;       /* Mean brightness, fraction of full scale */
+    float clipped;    /* Fraction of sampled cells with a saturated sample */
+    float sharpness;  /* Variance of the Laplacian, in (fraction of full scale)^2 */
+    float cloud;      /* Fraction of sampled cells that are bright and white */
+} QualityStats;
+
+static double elapsed_ms(const struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1e3 + (now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+/* Position (0-3, row-major in the 2x2 cell) of each CFA colour: R, G1, B, G2 */
+static void get_cfa_positions(Metadata *meta, int positions[4])
+{
+    const char *pattern = has_custom_metadata(meta, "cfa_pattern") ? get_custom_metadata_string(meta, "cfa_pattern") : "rggb";
+    int num_green = 0;
+    positions[0] = positions[1] = positions[2] = positions[3] = -1;
+
+    for (int k = 0; k < 4 && pattern[k] != '\0'; ++k)
+    {
+        switch (pattern[k])
+        {
+        case 'r': case 'R': positions[0] = k; break;
+        case 'b': case 'B': positions[2] = k; break;
+        case 'g': case 'G': positions[num_green++ == 0 ? 1 : 3] = k; break;
+        default: break;
+        }
+    }
+
+    if (positions[0] < 0 || positions[1] < 0 || positions[2] < 0 || positions[3] < 0)
+        signal_error_and_exit(INVALID_INPUT);
+}
+
+static inline uint32_t sample_at(const unsigned char *data, int wide, size_t index)
+{
+    return wide ? ((const uint16_t *)data)[index] : data[index];
+}
+
+/* Sum of the four samples of the 2x2 cell whose top-left sample is at index */
+static inline uint32_t cell_sum(const unsigned char *data, int wide, size_t index, int width)
+{
+    return sample_at(data, wide, index) + sample_at(data, wide, index + 1)
+         + sample_at(data, wide, index + width) + sample_at(data, wide, index + width + 1);
+}
+
+/*
+ * Statistics on a sparse grid of 2x2 cells, every grid_step cells in both directions.
+ * Each 2x2 cell is one CFA period, so its sum is a luminance that does not depend on
+ * the colour of the sample it starts on. The Laplacian is taken between neighbouring
+ * cells (not neighbouring grid points), which keeps it sensitive to fine detail and
+ * motion blur while only about 20 samples are read per grid point.
+ */
+static void compute_quality_stats(const unsigned char *data, int width, int height, int bits, int cfa,
+                                  const int positions[4], int grid_step, float cloud_level, QualityStats *stats)
+{
+    int wide = bits > 8;
+    uint32_t max_value = (1u << bits) - 1;
+    float scale = 1.0f / (4.0f * max_value);
+    int cells_x = width / 2;
+    int cells_y = height / 2;
+    int points_x = (cells_x - 3) / grid_step + 1;
+    int points_y = (cells_y - 3) / grid_step + 1;
+
+    /* Colour of the bright cells, kept for the cloud test once the gray-world balance is known */
+    float *bright = (float *)malloc(sizeof(float) * 3 * points_x * points_y);
+    if (bright == NULL)
+        signal_error_and_exit(MALLOC_ERR);
+
+    double sum_luma = 0.0, sum_lap = 0.0, sum_lap2 = 0.0;
+    double sum_color[3] = {0.0, 0.0, 0.0};
+    int num_points = 0, num_clipped = 0, num_bright = 0;
+
+    for (int cy = 1; cy < cells_y - 1; cy += grid_step)
+    {
+        for (int cx = 1; cx < cells_x - 1; cx += grid_step)
+        {
+            size_t index = (size_t)2 * cy * width + 2 * cx;
+            uint32_t s[4] = {
+                sample_at(data, wide, index), sample_at(data, wide, index + 1),
+                sample_at(data, wide, index + width), sample_at(data, wide, index + width + 1),
+            };
+            uint32_t luma = s[0] + s[1] + s[2] + s[3];
+
+            int32_t lap = 4 * (int32_t)luma
+                - (int32_t)cell_sum(data, wide, index - 2, width) - (int32_t)cell_sum(data, wide, index + 2, width)
+                - (int32_t)cell_sum(data, wide, index - 2 * (size_t)width, width)
+                - (int32_t)cell_sum(data, wide, index + 2 * (size_t)width, width);
+            float lap_norm = lap * scale;
+            float luma_norm = luma * scale;
+
+            sum_luma += luma_norm;
+            sum_lap += lap_norm;
+            sum_lap2 += (double)lap_norm * lap_norm;
+            num_clipped += s[0] >= max_value || s[1] >= max_value || s[2] >= max_value || s[3] >= max_value;
+
+            if (cfa)
+            {
+                float r = s[positions[0]];
+                float g = 0.5f * (s[positions[1]] + s[positions[3]]);
+                float b = s[positions[2]];
+                sum_color[0] += r;
+                sum_color[1] += g;
+                sum_color[2] += b;
+                if (luma_norm >= cloud_level)
+                {
+                    bright[3 * num_bright] = r;
+                    bright[3 * num_bright + 1] = g;
+                    bright[3 * num_bright + 2] = b;
+                }
+            }
+            num_bright += luma_norm >= cloud_level;
+            num_points++;
+        }
+    }
+
+    /* Raw colours are not white balanced, so whiteness is judged against the frame's own gray-world balance */
+    int num_cloud = num_bright;
+    if (cfa && num_bright > 0)
+    {
+        float gain[3];
+        for (int c = 0; c < 3; ++c)
+            gain[c] = sum_color[c] > 0.0 ? (float)(num_points / sum_color[c]) : 0.0f;
+
+        num_cloud = 0;
+        for (int k = 0; k < num_bright; ++k)
+        {
+            float r = bright[3 * k] * gain[0];
+            float g = bright[3 * k + 1] * gain[1];
+            float b = bright[3 * k + 2] * gain[2];
+            float hi = fmaxf(r, fmaxf(g, b));
+            float lo = fminf(r, fminf(g, b));
+            num_cloud += hi > 0.0f && hi - lo <= CLOUD_MAX_SPREAD * hi;
+        }
+    }
+
+    double mean_lap = sum_lap / num_points;
+    stats->mean = (float)(sum_luma / num_points);
+    stats->clipped = (float)num_clipped / num_points;
+    stats->sharpness = (float)(sum_lap2 / num_points - mean_lap * mean_lap);
+    stats->cloud = (float)num_cloud / num_points;
+
+    free(bright);
+}
+
+/* START MODULE IMPLEMENTATION */
+void module()
+{
+    /* Get number of images in input batch */
+    int num_images = get_input_num_images();
+
+    int cfa = get_param_bool("cfa");
+    int grid_step = get_param_int("grid_step");
+    float min_mean = get_param_float("min_mean");
+    float max_clipped = get_param_float("max_clipped");
+    float min_sharpness = get_param_float("min_sharpness");
+    float cloud_level = get_param_float("cloud_level");
+    float max_cloud = get_param_float("max_cloud");
+    int drop_rejected = get_param_bool("drop_rejected");
+
+    if (grid_step < 1)
+        signal_error_and_exit(INVALID_PARAM);
+
+    for (int i = 0; i < num_images; ++i)
+    {
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        Metadata *input_meta = get_metadata(i);
+        int width = input_meta->width;
+        int height = input_meta->height;
+        int bits = input_meta->bits_pixel;
+
+        if (width < 6 || height < 6 || input_meta->channels != 1 || bits < 1 || bits > 16)
+            signal_error_and_exit(INVALID_INPUT);
+
+        const unsigned char *input_image_data;
+        size_t size = get_image_view(i, &input_image_data);
+        if (size != (size_t)width * height * (bits > 8 ? 2 : 1))
+            signal_error_and_exit(INVALID_INPUT);
+
+        int positions[4] = {0, 1, 2, 3};
+        if (cfa)
+            get_cfa_positions(input_meta, positions);
+
+        QualityStats stats;
+        compute_quality_stats(input_image_data, width, height, bits, cfa, positions, grid_step, cloud_level, &stats);
+
+        /* Comma-separated list of the failed checks, empty if the frame passes */
+        char reject[64] = "";
+        if (stats.mean < min_mean)
+            strcat(reject, ",dark");
+        if (stats.clipped > max_clipped)
+            strcat(reject, ",saturated");
+        if (stats.sharpness < min_sharpness)
+            strcat(reject, ",blurred");
+        if (stats.cloud > max_cloud)
+            strcat(reject, ",cloudy");
+        int pass = reject[0] == '\0';
+
+        /* Rejected frames never reach the expensive modules further down the pipeline */
+        if (!pass && drop_rejected)
+            continue;
+
+        /* Create image metadata before appending */
+        Metadata new_meta = METADATA__INIT;
+        new_meta.size = size;
+        new_meta.width = width;
+        new_meta.height = height;
+        new_meta.channels = input_meta->channels;
+        new_meta.timestamp = input_meta->timestamp;
+        new_meta.bits_pixel = bits;
+        new_meta.camera = input_meta->camera;
+        new_meta.obid = input_meta->obid;
+        add_custom_metadata_float(&new_meta, "quality_mean", stats.mean);
+        add_custom_metadata_float(&new_meta, "quality_clipped", stats.clipped);
+        add_custom_metadata_float(&new_meta, "quality_sharpness", stats.sharpness);
+        add_custom_metadata_float(&new_meta, "quality_cloud", stats.cloud);
+        add_custom_metadata_bool(&new_meta, "quality_pass", pass);
+        if (!pass)
+            add_custom_metadata_string(&new_meta, "quality_reject", reject + 1);
+        add_custom_metadata_float(&new_meta, "quality_ms", elapsed_ms(&start));
+        copy_custom_metadata(&new_meta, input_meta, NULL);
+
+        /* Append the image to the result batch */
+        append_result_image((unsigned char *)input_image_data, size, &new_meta);
+    }
+}
+/* END MODULE IMPLEMENTATION */
+
+/* Main function of module (NO NEED TO MODIFY) */
+ImageBatch run(ImageBatch *input_batch, ModuleParameterList *module_parameter_list, int *ipc_error_pipe)
+{
+    ImageBatch result_batch;
+    result = &result_batch;
+    input = input_batch;
+    config = module_parameter_list;
+    error_pipe = ipc_error_pipe;
+    initialize();
+
+    module();
+
+    finalize();
+
+    return result_batch;
+}
+
+#ifdef TESTING_MODULE_STANDALONE
+
+/* Host-side check: print the statistics of a raw frame and the time they take */
+int main(int argc, char **argv)
+{
+    if (argc != 6)
+    {
+        printf("Usage: %s <raw_image_file> <width> <height> <bits> <grid_step>\n", argv[0]);
+        return 1;
+    }
+
+    int width = atoi(argv[2]);
+    int height = atoi(argv[3]);
+    int bits = atoi(argv[4]);
+    int grid_step = atoi(argv[5]);
+    size_t image_size = (size_t)width * height * (bits > 8 ? 2 : 1);
+
+    FILE *f = fopen(argv[1], "rb");
+    if (!f)
+    {
+        perror("Error opening input file");
+        return 1;
+    }
+
+    unsigned char *image_data = malloc(image_size);
+    if (!image_data || fread(image_data, 1, image_size, f) != image_size)
+    {
+        printf("Error: could not read %zu bytes\n", image_size);
+        fclose(f);
+        return 1;
+    }
+    fclose(f);
+
+    int positions[4] = {0, 1, 3, 2};
+    QualityStats stats;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    compute_quality_stats(image_data, width, height, bits, 1, positions, grid_step, 0.6f, &stats);
+    double ms = elapsed_ms(&start);
+
+    printf("mean %.4f, clipped %.4f, sharpness %.3g, cloud %.4f in %.3f ms\n",
+           stats.mean, stats.clipped, stats.sharpness, stats.cloud, ms);
+
+    free(image_data);
+    return 0;
+}
+
+#endif
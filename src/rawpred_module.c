@@ -0,0 +1,494 @@
+#include "module.h"
+#include "util.h"
+#include <time.h>
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+/* Define custom error codes */
+enum ERROR_CODE {
+    MALLOC_ERR = 1,
+    INVALID_INPUT = 2,
+};
+
+/*
+ * Fast predictive lossless codec for raw frames.
+ *
+ * Every sample is predicted with the MED (LOCO-I) predictor from its west, north and
+ * north-west neighbours. In CFA mode the neighbours are taken two samples away, so each
+ * of the four Bayer planes is predicted from samples of its own colour. The mapped
+ * residuals are coded with adaptive Golomb-Rice codes, with one context per CFA colour.
+ *
+ * Stream layout (little endian):
+ *   "DRPC" | version (u8) | bits (u8) | cfa (u8) | reserved (u8) | width (u32) | height (u32) | bitstream
+ */
+
+#define RAWPRED_MAGIC "DRPC"
+#define RAWPRED_VERSION 1
+#define RAWPRED_HEADER_SIZE 16
+#define RICE_LIMIT 24      /* unary prefixes this long escape to a raw value */
+#define RICE_MAX_K 16
+#define ESCAPE_BITS 17     /* mapped residuals of 16-bit samples fit in 17 bits */
+#define CONTEXT_RESET 64   /* halve the context statistics after this many samples */
+
+typedef struct RiceContext {
+    uint32_t sum;   /* sum of mapped residuals */
+    uint32_t count;
+} RiceContext;
+
+typedef struct BitWriter {
+    uint8_t *buf;
+    size_t size;
+    size_t capacity;
+    uint64_t acc;
+    int nbits;
+} BitWriter;
+
+static void put_bits(BitWriter *bw, uint32_t value, int n)
+{
+    bw->acc = (bw->acc << n) | value;
+    bw->nbits += n;
+    while (bw->nbits >= 8)
+    {
+        bw->nbits -= 8;
+        bw->buf[bw->size++] = (uint8_t)(bw->acc >> bw->nbits);
+    }
+}
+
+static void flush_bits(BitWriter *bw)
+{
+    if (bw->nbits > 0)
+        put_bits(bw, 0, 8 - bw->nbits);
+}
+
+/* Make room for the worst case encoding of the next n samples */
+static void reserve_bits(BitWriter *bw, size_t n)
+{
+    size_t needed = bw->size + n * ((RICE_LIMIT + ESCAPE_BITS + 7) / 8) + 8;
+    if (needed <= bw->capacity)
+        return;
+
+    size_t capacity = bw->capacity * 2 > needed ? bw->capacity * 2 : needed;
+    uint8_t *tmp = (uint8_t *)realloc(bw->buf, capacity);
+    if (tmp == NULL)
+        signal_error_and_exit(MALLOC_ERR);
+    bw->buf = tmp;
+    bw->capacity = capacity;
+}
+
+/* Smallest k with count << k >= sum, from the leading bit positions plus one correction step */
+static inline int get_rice_k(const RiceContext *ctx)
+{
+    if (ctx->sum <= ctx->count)
+        return 0;
+    int k = __builtin_clz(ctx->count) - __builtin_clz(ctx->sum);
+    if ((ctx->count << k) < ctx->sum)
+        k++;
+    return k < RICE_MAX_K ? k : RICE_MAX_K;
+}
+
+static void update_context(RiceContext *ctx, uint32_t mapped)
+{
+    ctx->sum += mapped;
+    if (++ctx->count == CONTEXT_RESET)
+    {
+        ctx->sum >>= 1;
+        ctx->count >>= 1;
+    }
+}
+
+static void init_contexts(RiceContext contexts[2][2])
+{
+    for (int c = 0; c < 4; ++c)
+    {
+        contexts[c / 2][c % 2].sum = 4;
+        contexts[c / 2][c % 2].count = 1;
+    }
+}
+
+static inline int med_predict(int w, int n, int nw)
+{
+    int mn = w < n ? w : n;
+    int mx = w < n ? n : w;
+    int p = w + n - nw;
+    return p < mn ? mn : (p > mx ? mx : p);
+}
+
+/* Edge samples have no full neighbourhood and fall back to simpler predictors */
+static inline int edge_predict(const uint16_t *cur, const uint16_t *prev, int x, int step, int mid)
+{
+    if (prev == NULL)
+        return x < step ? mid : cur[x - step];
+    if (x < step)
+        return prev[x];
+    return med_predict(cur[x - step], prev[x], prev[x - step]);
+}
+
+/* Map residuals of a whole row to unsigned values. All neighbours are original samples,
+   so the row can be predicted independently of the entropy coder (and vectorized). */
+static void map_row(const uint16_t *cur, const uint16_t *prev, int width, int step, int bits, uint32_t *mapped)
+{
+    int mid = 1 << (bits - 1);
+    int x = 0;
+
+    if (prev == NULL)
+    {
+        for (; x < width; ++x)
+        {
+            int e = cur[x] - edge_predict(cur, prev, x, step, mid);
+            mapped[x] = e >= 0 ? 2 * e : -2 * e - 1;
+        }
+        return;
+    }
+
+    for (; x < step && x < width; ++x)
+    {
+        int e = cur[x] - prev[x];
+        mapped[x] = e >= 0 ? 2 * e : -2 * e - 1;
+    }
+
+#if defined(__ARM_NEON)
+    /* MED on 4 samples per half vector, widened to 32-bit lanes so any 16-bit input is exact */
+    for (; x + 8 <= width; x += 8)
+    {
+        uint16x8_t w16 = vld1q_u16(cur + x - step);
+        uint16x8_t n16 = vld1q_u16(prev + x);
+        uint16x8_t nw16 = vld1q_u16(prev + x - step);
+        uint16x8_t c16 = vld1q_u16(cur + x);
+
+        for (int half = 0; half < 2; ++half)
+        {
+            int32x4_t w = vreinterpretq_s32_u32(vmovl_u16(half ? vget_high_u16(w16) : vget_low_u16(w16)));
+            int32x4_t n = vreinterpretq_s32_u32(vmovl_u16(half ? vget_high_u16(n16) : vget_low_u16(n16)));
+            int32x4_t nw = vreinterpretq_s32_u32(vmovl_u16(half ? vget_high_u16(nw16) : vget_low_u16(nw16)));
+            int32x4_t c = vreinterpretq_s32_u32(vmovl_u16(half ? vget_high_u16(c16) : vget_low_u16(c16)));
+
+            int32x4_t p = vsubq_s32(vaddq_s32(w, n), nw);
+            p = vminq_s32(vmaxq_s32(p, vminq_s32(w, n)), vmaxq_s32(w, n));
+            int32x4_t e = vsubq_s32(c, p);
+            int32x4_t m = veorq_s32(vshlq_n_s32(e, 1), vshrq_n_s32(e, 31));
+
+            vst1q_u32(mapped + x + 4 * half, vreinterpretq_u32_s32(m));
+        }
+    }
+#endif
+
+    for (; x < width; ++x)
+    {
+        int e = cur[x] - med_predict(cur[x - step], prev[x], prev[x - step]);
+        mapped[x] = e >= 0 ? 2 * e : -2 * e - 1;
+    }
+}
+
+static void encode_row(BitWriter *bw, const uint32_t *mapped, int width, RiceContext *row_contexts, int step)
+{
+    for (int x = 0; x < width; ++x)
+    {
+        RiceContext *ctx = &row_contexts[step == 2 ? (x & 1) : 0];
+        uint32_t m = mapped[x];
+        int k = get_rice_k(ctx);
+        uint32_t q = m >> k;
+
+        if (q < RICE_LIMIT && q + 1 + k <= 32)
+        {
+            /* Unary prefix, stop bit and remainder in a single write */
+            put_bits(bw, ((((1u << q) - 1) << 1) << k) | (m & ((1u << k) - 1)), q + 1 + k);
+        }
+        else if (q < RICE_LIMIT)
+        {
+            put_bits(bw, ((1u << q) - 1) << 1, q + 1);
+            put_bits(bw, m & ((1u << k) - 1), k);
+        }
+        else
+        {
+            put_bits(bw, (1u << RICE_LIMIT) - 1, RICE_LIMIT);
+            put_bits(bw, m, ESCAPE_BITS);
+        }
+
+        update_context(ctx, m);
+    }
+}
+
+/* Load a row of 8 or 16-bit samples into a 16-bit line buffer */
+static void load_row(const unsigned char *data, int y, int width, int bytes_per_sample, uint16_t *row)
+{
+    if (bytes_per_sample == 2)
+    {
+        memcpy(row, data + (size_t)y * width * 2, (size_t)width * 2);
+        return;
+    }
+    const unsigned char *src = data + (size_t)y * width;
+    for (int x = 0; x < width; ++x)
+        row[x] = src[x];
+}
+
+/* Encode a raw frame, returns the size of the stream */
+static size_t rawpred_encode(const unsigned char *data, int width, int height, int bits, int cfa, uint8_t **out)
+{
+    int bytes_per_sample = bits > 8 ? 2 : 1;
+    int step = cfa ? 2 : 1;
+
+    BitWriter bw = {0};
+    bw.capacity = (size_t)width * height * bytes_per_sample / 2 + RAWPRED_HEADER_SIZE;
+    bw.buf = (uint8_t *)malloc(bw.capacity);
+
+    /* Ring of the last step + 1 rows, plus the mapped residuals of the current row */
+    uint16_t *rows = (uint16_t *)malloc(sizeof(uint16_t) * width * (step + 1));
+    uint32_t *mapped = (uint32_t *)malloc(sizeof(uint32_t) * width);
+    if (bw.buf == NULL || rows == NULL || mapped == NULL)
+        signal_error_and_exit(MALLOC_ERR);
+
+    memcpy(bw.buf, RAWPRED_MAGIC, 4);
+    bw.buf[4] = RAWPRED_VERSION;
+    bw.buf[5] = bits;
+    bw.buf[6] = cfa;
+    bw.buf[7] = 0;
+    uint32_t dims[2] = {width, height};
+    memcpy(bw.buf + 8, dims, sizeof(dims));
+    bw.size = RAWPRED_HEADER_SIZE;
+
+    RiceContext contexts[2][2];
+    init_contexts(contexts);
+
+    for (int y = 0; y < height; ++y)
+    {
+        uint16_t *cur = rows + (size_t)(y % (step + 1)) * width;
+        uint16_t *prev = y >= step ? rows + (size_t)((y - step) % (step + 1)) * width : NULL;
+        load_row(data, y, width, bytes_per_sample, cur);
+
+        map_row(cur, prev, width, step, bits, mapped);
+        reserve_bits(&bw, width);
+        encode_row(&bw, mapped, width, contexts[step == 2 ? (y & 1) : 0], step);
+    }
+    flush_bits(&bw);
+
+    free(rows);
+    free(mapped);
+    *out = bw.buf;
+    return bw.size;
+}
+
+static double elapsed_ms(const struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1e3 + (now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+/* START MODULE IMPLEMENTATION */
+void module()
+{
+    /* Get number of images in input batch */
+    int num_images = get_input_num_images();
+
+    int cfa = get_param_bool("cfa");
+
+    for (int i = 0; i < num_images; ++i)
+    {
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        Metadata *input_meta = get_metadata(i);
+        int width = input_meta->width;
+        int height = input_meta->height;
+        int bits = input_meta->bits_pixel;
+
+        if (width <= 0 || height <= 0 || input_meta->channels != 1 || bits < 1 || bits > 16)
+            signal_error_and_exit(INVALID_INPUT);
+
+        const unsigned char *input_image_data;
+        size_t size = get_image_view(i, &input_image_data);
+        if (size != (size_t)width * height * (bits > 8 ? 2 : 1))
+            signal_error_and_exit(INVALID_INPUT);
+
+        uint8_t *output_buffer;
+        size_t enc_size = rawpred_encode(input_image_data, width, height, bits, cfa, &output_buffer);
+
+        /* Create image metadata before appending */
+        Metadata new_meta = METADATA__INIT;
+        new_meta.size = enc_size;
+        new_meta.width = width;
+        new_meta.height = height;
+        new_meta.channels = input_meta->channels;
+        new_meta.timestamp = input_meta->timestamp;
+        new_meta.bits_pixel = bits;
+        new_meta.camera = input_meta->camera;
+        new_meta.obid = input_meta->obid;
+        add_custom_metadata_string(&new_meta, "enc", "rawpred");
+        add_custom_metadata_float(&new_meta, "encode_ms", elapsed_ms(&start));
+
+        /* Append the image to the result batch */
+        append_result_image(output_buffer, enc_size, &new_meta);
+
+        /* Remember to free any allocated memory */
+        free(output_buffer);
+    }
+}
+/* END MODULE IMPLEMENTATION */
+
+/* Main function of module (NO NEED TO MODIFY) */
+ImageBatch run(ImageBatch *input_batch, ModuleParameterList *module_parameter_list, int *ipc_error_pipe)
+{
+    ImageBatch result_batch;
+    result = &result_batch;
+    input = input_batch;
+    config = module_parameter_list;
+    error_pipe = ipc_error_pipe;
+    initialize();
+
+    module();
+
+    finalize();
+
+    return result_batch;
+}
+
+#ifdef TESTING_MODULE_STANDALONE
+
+typedef struct BitReader {
+    const uint8_t *buf;
+    size_t size;
+    size_t pos;
+    uint64_t acc;
+    int nbits;
+} BitReader;
+
+static uint32_t get_bits(BitReader *br, int n)
+{
+    while (br->nbits < n)
+    {
+        uint8_t byte = br->pos < br->size ? br->buf[br->pos] : 0;
+        br->pos++;
+        br->acc = (br->acc << 8) | byte;
+        br->nbits += 8;
+    }
+    br->nbits -= n;
+    return (uint32_t)(br->acc >> br->nbits) & (uint32_t)((1ull << n) - 1);
+}
+
+/* Decode a stream produced by rawpred_encode into 8 or 16-bit samples.
+   Returns the number of bytes written to out, or 0 if the stream is invalid. */
+static size_t rawpred_decode(const uint8_t *stream, size_t size, unsigned char **out, int *width_out, int *height_out, int *bits_out)
+{
+    if (size < RAWPRED_HEADER_SIZE || memcmp(stream, RAWPRED_MAGIC, 4) != 0 || stream[4] != RAWPRED_VERSION)
+        return 0;
+
+    int bits = stream[5];
+    int step = stream[6] ? 2 : 1;
+    uint32_t dims[2];
+    memcpy(dims, stream + 8, sizeof(dims));
+    int width = dims[0];
+    int height = dims[1];
+    if (bits < 1 || bits > 16 || width <= 0 || height <= 0)
+        return 0;
+
+    int bytes_per_sample = bits > 8 ? 2 : 1;
+    int mid = 1 << (bits - 1);
+    size_t out_size = (size_t)width * height * bytes_per_sample;
+    *out = (unsigned char *)malloc(out_size);
+    uint16_t *rows = (uint16_t *)malloc(sizeof(uint16_t) * width * (step + 1));
+    if (*out == NULL || rows == NULL)
+        signal_error_and_exit(MALLOC_ERR);
+
+    BitReader br = {stream + RAWPRED_HEADER_SIZE, size - RAWPRED_HEADER_SIZE, 0, 0, 0};
+    RiceContext contexts[2][2];
+    init_contexts(contexts);
+
+    for (int y = 0; y < height; ++y)
+    {
+        uint16_t *cur = rows + (size_t)(y % (step + 1)) * width;
+        uint16_t *prev = y >= step ? rows + (size_t)((y - step) % (step + 1)) * width : NULL;
+        RiceContext *row_contexts = contexts[step == 2 ? (y & 1) : 0];
+
+        for (int x = 0; x < width; ++x)
+        {
+            RiceContext *ctx = &row_contexts[step == 2 ? (x & 1) : 0];
+            int k = get_rice_k(ctx);
+
+            uint32_t q = 0;
+            while (q < RICE_LIMIT && get_bits(&br, 1))
+                q++;
+            uint32_t m = q < RICE_LIMIT ? (q << k) | (k > 0 ? get_bits(&br, k) : 0) : get_bits(&br, ESCAPE_BITS);
+            update_context(ctx, m);
+
+            int e = (m & 1) ? -(int)((m + 1) >> 1) : (int)(m >> 1);
+            cur[x] = (uint16_t)(edge_predict(cur, prev, x, step, mid) + e);
+        }
+
+        if (br.pos > br.size + 8)
+        {
+            free(rows);
+            free(*out);
+            return 0;
+        }
+
+        if (bytes_per_sample == 2)
+            memcpy(*out + (size_t)y * width * 2, cur, (size_t)width * 2);
+        else
+            for (int x = 0; x < width; ++x)
+                (*out)[(size_t)y * width + x] = (unsigned char)cur[x];
+    }
+
+    free(rows);
+    *width_out = width;
+    *height_out = height;
+    *bits_out = bits;
+    return out_size;
+}
+
+/* Host-side round trip: encode a raw frame, decode it again and check it is bit-exact */
+int main(int argc, char **argv)
+{
+    if (argc != 5)
+    {
+        printf("Usage: %s <raw_image_file> <width> <height> <bits>\n", argv[0]);
+        return 1;
+    }
+
+    int width = atoi(argv[2]);
+    int height = atoi(argv[3]);
+    int bits = atoi(argv[4]);
+    size_t image_size = (size_t)width * height * (bits > 8 ? 2 : 1);
+
+    FILE *f = fopen(argv[1], "rb");
+    if (!f)
+    {
+        perror("Error opening input file");
+        return 1;
+    }
+
+    unsigned char *image_data = malloc(image_size);
+    if (!image_data || fread(image_data, 1, image_size, f) != image_size)
+    {
+        printf("Error: could not read %zu bytes\n", image_size);
+        fclose(f);
+        return 1;
+    }
+    fclose(f);
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    uint8_t *stream;
+    size_t stream_size = rawpred_encode(image_data, width, height, bits, 1, &stream);
+    double encode_ms = elapsed_ms(&start);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    unsigned char *decoded;
+    int dec_width, dec_height, dec_bits;
+    size_t decoded_size = rawpred_decode(stream, stream_size, &decoded, &dec_width, &dec_height, &dec_bits);
+    double decode_ms = elapsed_ms(&start);
+
+    int exact = decoded_size == image_size && memcmp(decoded, image_data, image_size) == 0;
+    printf("Encoded %zu -> %zu bytes (%.2f bits/sample), encode %.1f MB/s, decode %.1f MB/s, %s\n",
+           image_size, stream_size, 8.0 * stream_size / ((size_t)width * height),
+           image_size / encode_ms / 1e3, image_size / decode_ms / 1e3,
+           exact ? "bit-exact" : "MISMATCH");
+
+    free(image_data);
+    free(stream);
+    if (decoded_size > 0)
+        free(decoded);
+    return exact ? 0 : 1;
+}
+
+#endif
@@ -0,0 +1,514 @@
+#include "module.h"
+#include "util.h"
+
+#ifdef __ARM_NEON
+#include <arm_neon.h>
+#endif
+
+/* Define custom error codes */
+enum ERROR_CODE {
+    MALLOC_ERR = 1,
+    INVALID_INPUT = 2,
+    INVALID_PARAM = 3,
+};
+
+/* Sums of 16-bit samples stay below 2^31 and counts fit the rejection bookkeeping */
+#define STACK_MAX_FRAMES 255
+/* The clipping test compares a sample with the mean and variance of the other frames, so it needs two of them */
+#define CLIP_MIN_FRAMES 3
+/* Lower bound of the variance in the clipping test (DN^2), so flat noiseless regions are not clipped for 1 DN */
+#define CLIP_MIN_VARIANCE 1.0f
+/* Samples of the variance used to estimate the typical noise of a group */
+#define NOISE_SAMPLES 16384
+/* More rejections than this fraction of the group samples means the frames are not aligned (moving scene);
+   the group is then averaged without clipping */
+#define CLIP_MAX_REJECTED_FRACTION 0.01
+
+/* Sample rejected by the clipping test, by its deviation from the reference frame */
+typedef struct Rejection {
+    uint32_t index;
+    int32_t deviation;
+} Rejection;
+
+/*
+ * Accumulator of one group: deviations from the first frame of the group (the reference), so the sums stay
+ * small and the float sum of squares keeps its precision. Frames are read through zero-copy views, so the
+ * memory is 4 bytes per sample (8 when clipping) whatever the group size, plus the sparse rejections.
+ */
+typedef struct Stack {
+    size_t samples;
+    int frames;
+    int32_t *sum;        /* Sum of x - reference */
+    float *square;       /* Sum of (x - reference)^2, NULL without clipping */
+    Rejection *rejected;
+    uint32_t num_rejected;
+    uint32_t max_rejected;
+} Stack;
+
+static inline int32_t get_sample(const unsigned char *data, int wide, size_t index)
+{
+    return wide ? ((const uint16_t *)data)[index] : data[index];
+}
+
+static void init_stack(Stack *stack, size_t samples, int clip, int group_size)
+{
+    memset(stack, 0, sizeof(*stack));
+    stack->samples = samples;
+    stack->sum = (int32_t *)calloc(samples, sizeof(int32_t));
+    if (stack->sum == NULL)
+        signal_error_and_exit(MALLOC_ERR);
+    if (clip)
+    {
+        stack->square = (float *)calloc(samples, sizeof(float));
+        stack->max_rejected = (uint32_t)(CLIP_MAX_REJECTED_FRACTION * samples * group_size) + 1;
+        stack->rejected = (Rejection *)malloc(sizeof(Rejection) * stack->max_rejected);
+        if (stack->square == NULL || stack->rejected == NULL)
+            signal_error_and_exit(MALLOC_ERR);
+    }
+}
+
+static void free_stack(Stack *stack)
+{
+    free(stack->sum);
+    free(stack->square);
+    free(stack->rejected);
+}
+
+#ifdef __ARM_NEON
+/* Eight deviations from the reference, widened to 32 bits and added to the sums */
+static inline void accumulate_block(uint16x8_t x, uint16x8_t r, int32_t *sum, float *square)
+{
+    int32x4_t lo = vreinterpretq_s32_u32(vsubl_u16(vget_low_u16(x), vget_low_u16(r)));
+    int32x4_t hi = vreinterpretq_s32_u32(vsubl_u16(vget_high_u16(x), vget_high_u16(r)));
+    vst1q_s32(sum, vaddq_s32(vld1q_s32(sum), lo));
+    vst1q_s32(sum + 4, vaddq_s32(vld1q_s32(sum + 4), hi));
+    if (square != NULL)
+    {
+        float32x4_t flo = vcvtq_f32_s32(lo), fhi = vcvtq_f32_s32(hi);
+        vst1q_f32(square, vmlaq_f32(vld1q_f32(square), flo, flo));
+        vst1q_f32(square + 4, vmlaq_f32(vld1q_f32(square + 4), fhi, fhi));
+    }
+}
+#endif
+
+/* First pass: add one frame of the group (not the reference itself) to the sums */
+static void accumulate_frame(Stack *stack, const unsigned char *frame, const unsigned char *reference, int wide)
+{
+    size_t n = stack->samples;
+    size_t i = 0;
+#ifdef __ARM_NEON
+    if (wide)
+    {
+        const uint16_t *x = (const uint16_t *)frame, *r = (const uint16_t *)reference;
+        for (; i + 8 <= n; i += 8)
+            accumulate_block(vld1q_u16(x + i), vld1q_u16(r + i), stack->sum + i,
+                             stack->square != NULL ? stack->square + i : NULL);
+    }
+    else
+    {
+        for (; i + 8 <= n; i += 8)
+            accumulate_block(vmovl_u8(vld1_u8(frame + i)), vmovl_u8(vld1_u8(reference + i)), stack->sum + i,
+                             stack->square != NULL ? stack->square + i : NULL);
+    }
+#endif
+    for (; i < n; ++i)
+    {
+        int32_t d = get_sample(frame, wide, i) - get_sample(reference, wide, i);
+        stack->sum[i] += d;
+        if (stack->square != NULL)
+            stack->square[i] += (float)d * d;
+    }
+    stack->frames++;
+}
+
+static int compare_floats(const void *a, const void *b)
+{
+    float fa = *(const float *)a, fb = *(const float *)b;
+    return (fa > fb) - (fa < fb);
+}
+
+/* Median variance of the group over a grid of samples. The variance of a few frames is itself noisy, so the
+   clipping test uses at least this typical noise level and a low estimate alone does not reject a sample. */
+static float noise_floor(const Stack *stack)
+{
+    float variances[NOISE_SAMPLES];
+    size_t stride = stack->samples / NOISE_SAMPLES + 1;
+    size_t count = 0;
+    float n = (float)stack->frames;
+    for (size_t i = 0; i < stack->samples; i += stride)
+        variances[count++] = (stack->square[i] - (float)stack->sum[i] * stack->sum[i] / n) / (n - 1.0f);
+    qsort(variances, count, sizeof(float), compare_floats);
+    float floor = variances[count / 2];
+    return floor > CLIP_MIN_VARIANCE ? floor : CLIP_MIN_VARIANCE;
+}
+
+/*
+ * Leave-one-out test: is deviation d outside the kappa sigma prediction interval of the other frames? With
+ * m other frames, their unbiased variance and the uncertainty of their mean (factor 1 + 1/m) are used, so
+ * few frames do not make normal samples look like outliers. factor is kappa^2 (1 + 1/m), floor the
+ * noise floor of the group.
+ */
+static inline int is_outlier(const Stack *stack, size_t i, int32_t d, float inv_others, float inv_dof, float factor,
+                             float floor)
+{
+    float others = stack->sum[i] - d;
+    float mean = others * inv_others;
+    float variance = (stack->square[i] - (float)d * d - others * mean) * inv_dof;
+    if (variance < floor)
+        variance = floor;
+    float e = d - mean;
+    return e * e > factor * variance;
+}
+
+static inline int reject(Stack *stack, size_t i, int32_t d)
+{
+    if (stack->num_rejected == stack->max_rejected)
+        return -1;
+    stack->rejected[stack->num_rejected].index = (uint32_t)i;
+    stack->rejected[stack->num_rejected].deviation = d;
+    stack->num_rejected++;
+    return 0;
+}
+
+#ifdef __ARM_NEON
+/* is_outlier for four deviations, all ones in the lanes that may be outliers */
+static inline uint32x4_t outlier_block(uint32x4_t deviation, const int32_t *sum, const float *square,
+                                       float32x4_t inv_others, float32x4_t inv_dof, float32x4_t factor,
+                                       float32x4_t floor)
+{
+    float32x4_t d = vcvtq_f32_s32(vreinterpretq_s32_u32(deviation));
+    float32x4_t others = vsubq_f32(vcvtq_f32_s32(vld1q_s32(sum)), d);
+    float32x4_t mean = vmulq_f32(others, inv_others);
+    float32x4_t variance = vmulq_f32(vmlsq_f32(vmlsq_f32(vld1q_f32(square), d, d), others, mean), inv_dof);
+    float32x4_t e = vsubq_f32(d, mean);
+    return vcgtq_f32(vmulq_f32(e, e), vmulq_f32(factor, vmaxq_f32(variance, floor)));
+}
+#endif
+
+/* Second pass over one frame of the group, once all frames are accumulated. Rejections are rare, so the
+   vector path only tests eight samples at a time and leaves the bookkeeping of a hit to the scalar code.
+   Returns -1 when there are too many rejections for the group to be aligned. */
+static int clip_frame(Stack *stack, const unsigned char *frame, const unsigned char *reference, int wide,
+                      float kappa, float floor)
+{
+    size_t n = stack->samples;
+    int others = stack->frames - 1;
+    float inv_others = 1.0f / others;
+    float inv_dof = 1.0f / (others - 1);
+    float factor = kappa * kappa * (1.0f + inv_others);
+    size_t i = 0;
+#ifdef __ARM_NEON
+    float32x4_t inv_others_v = vdupq_n_f32(inv_others), inv_dof_v = vdupq_n_f32(inv_dof);
+    float32x4_t factor_v = vdupq_n_f32(factor), floor_v = vdupq_n_f32(floor);
+    for (; i + 8 <= n; i += 8)
+    {
+        uint16x8_t x = wide ? vld1q_u16((const uint16_t *)frame + i) : vmovl_u8(vld1_u8(frame + i));
+        uint16x8_t r = wide ? vld1q_u16((const uint16_t *)reference + i) : vmovl_u8(vld1_u8(reference + i));
+        uint32x4_t lo = outlier_block(vsubl_u16(vget_low_u16(x), vget_low_u16(r)), stack->sum + i, stack->square + i,
+                                      inv_others_v, inv_dof_v, factor_v, floor_v);
+        uint32x4_t hi = outlier_block(vsubl_u16(vget_high_u16(x), vget_high_u16(r)), stack->sum + i + 4,
+                                      stack->square + i + 4, inv_others_v, inv_dof_v, factor_v, floor_v);
+        uint32x4_t hit = vorrq_u32(lo, hi);
+        uint32x2_t any = vorr_u32(vget_low_u32(hit), vget_high_u32(hit));
+        if ((vget_lane_u32(any, 0) | vget_lane_u32(any, 1)) == 0)
+            continue;
+        for (size_t k = i; k < i + 8; ++k)
+        {
+            int32_t dk = get_sample(frame, wide, k) - get_sample(reference, wide, k);
+            if (is_outlier(stack, k, dk, inv_others, inv_dof, factor, floor) && reject(stack, k, dk) != 0)
+                return -1;
+        }
+    }
+#endif
+    for (; i < n; ++i)
+    {
+        int32_t d = get_sample(frame, wide, i) - get_sample(reference, wide, i);
+        if (is_outlier(stack, i, d, inv_others, inv_dof, factor, floor) && reject(stack, i, d) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+static int compare_rejections(const void *a, const void *b)
+{
+    uint32_t ia = ((const Rejection *)a)->index, ib = ((const Rejection *)b)->index;
+    return (ia > ib) - (ia < ib);
+}
+
+static inline void put_stacked(unsigned char *out, int wide, size_t i, int64_t total, int count, int scale,
+                               uint32_t max_value)
+{
+    int64_t value = (total * scale + count / 2) / count;
+    if (value > max_value)
+        value = max_value;
+    if (wide)
+        ((uint16_t *)out)[i] = (uint16_t)value;
+    else
+        out[i] = (unsigned char)value;
+}
+
+/* Write the mean (scale 1) or the sum (scale = frames) of the group, without the rejected samples */
+static void finish_stack(Stack *stack, const unsigned char *reference, int wide, int scale, uint32_t max_value,
+                         unsigned char *out, int output_wide)
+{
+    int frames = stack->frames;
+    for (size_t i = 0; i < stack->samples; ++i)
+        put_stacked(out, output_wide, i, (int64_t)frames * get_sample(reference, wide, i) + stack->sum[i], frames,
+                    scale, max_value);
+
+    /* Samples with rejections are written again from the sums of the frames that were kept */
+    qsort(stack->rejected, stack->num_rejected, sizeof(Rejection), compare_rejections);
+    for (uint32_t k = 0; k < stack->num_rejected;)
+    {
+        uint32_t i = stack->rejected[k].index;
+        int64_t reference_value = get_sample(reference, wide, i);
+        int64_t total = frames * reference_value + stack->sum[i];
+        int count = frames;
+        for (; k < stack->num_rejected && stack->rejected[k].index == i; ++k)
+        {
+            total -= reference_value + stack->rejected[k].deviation;
+            count--;
+        }
+        if (count > 0)
+            put_stacked(out, output_wide, i, total, count, scale, max_value);
+    }
+}
+
+/* Frames i .. end-1 are one group: consecutive frames of the same observation and geometry, at most group_size */
+static int group_end(int i, int num_images, int group_size)
+{
+    Metadata *first = get_metadata(i);
+    int end = i + 1;
+    while (end < num_images && end - i < group_size)
+    {
+        Metadata *meta = get_metadata(end);
+        if (meta->obid != first->obid || meta->width != first->width || meta->height != first->height
+            || meta->channels != first->channels || meta->bits_pixel != first->bits_pixel)
+            break;
+        end++;
+    }
+    return end;
+}
+
+/* START MODULE IMPLEMENTATION */
+void module()
+{
+    /* Get number of images in input batch */
+    int num_images = get_input_num_images();
+
+    int group_size = get_param_int("stack_frames");
+    const char *mode = get_param_string("stack_mode");
+    float kappa = get_param_float("clip_sigma");
+    int sum_mode = strcmp(mode, "sum") == 0;
+    if (group_size < 1 || group_size > STACK_MAX_FRAMES || (!sum_mode && strcmp(mode, "mean") != 0) || kappa < 0.0f)
+        signal_error_and_exit(INVALID_PARAM);
+
+    for (int i = 0; i < num_images;)
+    {
+        int end = group_end(i, num_images, group_size);
+        Metadata *input_meta = get_metadata(i);
+        int width = input_meta->width;
+        int height = input_meta->height;
+        int channels = input_meta->channels;
+        int bits = input_meta->bits_pixel;
+        int wide = bits > 8;
+        size_t samples = (size_t)width * height * channels;
+        size_t size = samples * (wide ? 2 : 1);
+
+        if (width <= 0 || height <= 0 || channels < 1 || bits < 1 || bits > 16)
+            signal_error_and_exit(INVALID_INPUT);
+
+        const unsigned char *reference;
+        if (get_image_view(i, &reference) != size)
+            signal_error_and_exit(INVALID_INPUT);
+
+        int frames = end - i;
+
+        /* A sum needs one more bit for every doubling of the frames, and must fit 16 bits so no sample saturates */
+        int output_bits = bits;
+        if (sum_mode)
+            while ((1 << (output_bits - bits)) < frames)
+                output_bits++;
+        if (output_bits > 16)
+            signal_error_and_exit(INVALID_PARAM);
+
+        int clip = kappa > 0.0f && frames >= CLIP_MIN_FRAMES;
+        Stack stack;
+        init_stack(&stack, samples, clip, frames);
+        stack.frames = 1;
+
+        for (int k = i + 1; k < end; ++k)
+        {
+            const unsigned char *frame;
+            if (get_image_view(k, &frame) != size)
+                signal_error_and_exit(INVALID_INPUT);
+            accumulate_frame(&stack, frame, reference, wide);
+        }
+
+        /* The reference is tested like the other frames, its deviation is zero */
+        float floor = clip ? noise_floor(&stack) : 0.0f;
+        for (int k = i; k < end && clip; ++k)
+        {
+            const unsigned char *frame;
+            get_image_view(k, &frame);
+            if (clip_frame(&stack, frame, reference, wide, kappa, floor) != 0)
+            {
+                stack.num_rejected = 0;
+                clip = 0;
+            }
+        }
+
+        int output_wide = output_bits > 8;
+        size_t output_size = samples * (output_wide ? 2 : 1);
+
+        /* Create image metadata before appending */
+        Metadata new_meta = METADATA__INIT;
+        new_meta.size = output_size;
+        new_meta.width = width;
+        new_meta.height = height;
+        new_meta.channels = channels;
+        new_meta.timestamp = input_meta->timestamp;
+        new_meta.bits_pixel = output_bits;
+        new_meta.camera = input_meta->camera;
+        new_meta.obid = input_meta->obid;
+        add_custom_metadata_int(&new_meta, "stacked_frames", frames);
+        add_custom_metadata_int(&new_meta, "stack_rejected", stack.num_rejected);
+        copy_custom_metadata(&new_meta, input_meta, NULL);
+
+        unsigned char *output_image_data = reserve_result_image(output_size, &new_meta);
+        if (output_image_data == NULL)
+            signal_error_and_exit(MALLOC_ERR);
+
+        /* An 8-bit sum that needs more than 8 bits is written as 16-bit samples */
+        finish_stack(&stack, reference, wide, sum_mode ? frames : 1, (1u << output_bits) - 1, output_image_data,
+                     output_wide);
+
+        free_stack(&stack);
+        i = end;
+    }
+}
+/* END MODULE IMPLEMENTATION */
+
+/* Main function of module (NO NEED TO MODIFY) */
+ImageBatch run(ImageBatch *input_batch, ModuleParameterList *module_parameter_list, int *ipc_error_pipe)
+{
+    ImageBatch result_batch;
+    result = &result_batch;
+    input = input_batch;
+    config = module_parameter_list;
+    error_pipe = ipc_error_pipe;
+    initialize();
+
+    module();
+
+    finalize();
+
+    return result_batch;
+}
+
+#ifdef TESTING_MODULE_STANDALONE
+
+#include <math.h>
+#include <time.h>
+
+/* Roughly normal noise with standard deviation sigma */
+static double noise(double sigma)
+{
+    double sum = 0;
+    for (int k = 0; k < 12; ++k)
+        sum += (double)rand() / RAND_MAX;
+    return (sum - 6.0) * sigma;
+}
+
+/* Host-side check: a burst of noisy 12-bit frames with cosmic ray hits is stacked into a mean with and
+   without clipping, and into a 16-bit sum */
+int main(void)
+{
+    const int width = 1232, height = 1028, frames = 8;
+    const double sigma = 20.0;
+    size_t samples = (size_t)width * height;
+    uint16_t *scene = malloc(sizeof(uint16_t) * samples);
+    uint16_t *burst = malloc(sizeof(uint16_t) * samples * frames);
+    uint16_t *mean = malloc(sizeof(uint16_t) * samples);
+    uint16_t *clipped = malloc(sizeof(uint16_t) * samples);
+    uint16_t *sum = malloc(sizeof(uint16_t) * samples);
+    uint8_t *pixel_hits = calloc(samples, 1);
+
+    for (size_t s = 0; s < samples; ++s)
+        scene[s] = 500 + (s % width * 3 + s / width * 2) % 3000;
+    int hits = 0;
+    for (int f = 0; f < frames; ++f)
+        for (size_t s = 0; s < samples; ++s)
+        {
+            double value = scene[s] + noise(sigma);
+            if (rand() % 2000 == 0)
+            {
+                value += 1500 + rand() % 2000;
+                pixel_hits[s]++;
+                hits++;
+            }
+            burst[f * samples + s] = (uint16_t)fmin(fmax(value, 0), 4095);
+        }
+
+    clock_t start = clock();
+    Stack stack;
+    init_stack(&stack, samples, 0, frames);
+    stack.frames = 1;
+    for (int f = 1; f < frames; ++f)
+        accumulate_frame(&stack, (unsigned char *)(burst + f * samples), (unsigned char *)burst, 1);
+    finish_stack(&stack, (unsigned char *)burst, 1, 1, 4095, (unsigned char *)mean, 1);
+    finish_stack(&stack, (unsigned char *)burst, 1, frames, 65535, (unsigned char *)sum, 1);
+    free_stack(&stack);
+    double mean_ms = 1000.0 * (clock() - start) / CLOCKS_PER_SEC;
+
+    start = clock();
+    init_stack(&stack, samples, 1, frames);
+    stack.frames = 1;
+    for (int f = 1; f < frames; ++f)
+        accumulate_frame(&stack, (unsigned char *)(burst + f * samples), (unsigned char *)burst, 1);
+    float floor = noise_floor(&stack);
+    int aligned = 1;
+    for (int f = 0; f < frames; ++f)
+        aligned &= clip_frame(&stack, (unsigned char *)(burst + f * samples), (unsigned char *)burst, 1, 3.0f,
+                              floor) == 0;
+    finish_stack(&stack, (unsigned char *)burst, 1, 1, 4095, (unsigned char *)clipped, 1);
+    uint32_t rejected = stack.num_rejected;
+    free_stack(&stack);
+    double clip_ms = 1000.0 * (clock() - start) / CLOCKS_PER_SEC;
+
+    double mean_rms = 0, clipped_rms = 0;
+    int mean_worst = 0, clipped_worst = 0, sum_errors = 0, missed = 0, double_hits = 0;
+    for (size_t s = 0; s < samples; ++s)
+    {
+        int e1 = abs(mean[s] - scene[s]), e2 = abs(clipped[s] - scene[s]);
+        mean_rms += e1 * e1;
+        clipped_rms += e2 * e2;
+        mean_worst = e1 > mean_worst ? e1 : mean_worst;
+        clipped_worst = e2 > clipped_worst ? e2 : clipped_worst;
+        missed += e2 > 60;
+        double_hits += pixel_hits[s] > 1;
+        uint32_t total = 0;
+        for (int f = 0; f < frames; ++f)
+            total += burst[f * samples + s];
+        sum_errors += sum[s] != total;
+    }
+    mean_rms = sqrt(mean_rms / samples);
+    clipped_rms = sqrt(clipped_rms / samples);
+
+    printf("%d cosmic ray hits (%d pixels hit twice), %u rejected samples, noise floor %.0f\n", hits, double_hits,
+           rejected, floor);
+    printf("mean: rms %.2f worst %d (%.1f ms), clipped mean: rms %.2f worst %d, %d missed (%.1f ms), sum errors %d\n",
+           mean_rms, mean_worst, mean_ms, clipped_rms, clipped_worst, missed, clip_ms, sum_errors);
+
+    free(scene);
+    free(burst);
+    free(mean);
+    free(clipped);
+    free(sum);
+    free(pixel_hits);
+    /* Noise of one frame is 20, of the mean 20 / sqrt(8) = 7. A second hit on a pixel inflates the variance
+       of the other frames, so only pixels hit twice may keep a hit. */
+    return !aligned || clipped_rms > 8.0 || missed > double_hits || sum_errors != 0;
+}
+
+#endif
@@ -1,4 +1,6 @@
 #include "module.h"
+#include <sys/resource.h>
+#include <time.h>
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
 #define STB_IMAGE_WRITE_IMPLEMENTATION
@@ -10,10 +12,23 @@
 #define FILENAME_OUTPUT "output"
 #define FILENAME_CONFIG "config.yaml"
 
+/* Find a custom metadata item of an unpacked metadata, or NULL */
+static MetadataItem *find_item(const Metadata *metadata, const char *key)
+{
+    for (size_t i = 0; i < metadata->n_items; i++)
+        if (strcmp(metadata->items[i]->key, key) == 0)
+            return metadata->items[i];
+    return NULL;
+}
+
 void save_images(const char *filename_base, const ImageBatch *batch)
 {
     uint32_t offset = 0;
     int image_index = 0;
+    int encoded_images = 0;
+    double encode_ms = 0;
+    double raw_bytes = 0;
+    char encoder[32] = "";
 
     while (image_index < batch->num_images && offset < batch->batch_size)
     {
@@ -22,30 +37,64 @@ void save_images(const char *filename_base, const ImageBatch *batch)
         Metadata *metadata = metadata__unpack(NULL, meta_size, batch->data + offset);
         offset += meta_size; // Move offset to start of image
 
-        char filename[20];
-        sprintf(filename, "%s%d.png", filename_base, image_index);
-
-        int stride = metadata->width * metadata->channels * sizeof(uint8_t);
-        int success = stbi_write_png(filename, metadata->width, metadata->height, metadata->channels, batch->data + offset, stride);
-        if (!success)
+        char filename[64];
+        MetadataItem *enc = find_item(metadata, "enc");
+        if (enc != NULL && enc->value_case == METADATA_ITEM__VALUE_STRING_VALUE)
         {
-            fprintf(stderr, "Error writing image to %s\n", filename);
+            /* Encoded images are saved as they are, and their encoder time is summed up */
+            sprintf(filename, "%s%d.%.16s", filename_base, image_index, enc->string_value);
+            FILE *f = fopen(filename, "wb");
+            int success = f != NULL && fwrite(batch->data + offset, 1, metadata->size, f) == metadata->size;
+            if (f != NULL)
+                fclose(f);
+            printf(success ? "Image saved as %s\n" : "Error writing image to %s\n", filename);
+
+            MetadataItem *ms = find_item(metadata, "encode_ms");
+            if (ms != NULL && ms->value_case == METADATA_ITEM__VALUE_FLOAT_VALUE)
+            {
+                snprintf(encoder, sizeof(encoder), "%s", enc->string_value);
+                encoded_images++;
+                encode_ms += ms->float_value;
+                raw_bytes += (double)metadata->width * metadata->height * metadata->channels * (metadata->bits_pixel > 8 ? 2 : 1);
+            }
         }
         else
         {
-            printf("Image saved as %s\n", filename);
+            sprintf(filename, "%s%d.png", filename_base, image_index);
+
+            int stride = metadata->width * metadata->channels * sizeof(uint8_t);
+            int success = stbi_write_png(filename, metadata->width, metadata->height, metadata->channels, batch->data + offset, stride);
+            if (!success)
+            {
+                fprintf(stderr, "Error writing image to %s\n", filename);
+            }
+            else
+            {
+                printf("Image saved as %s\n", filename);
+            }
         }
 
         offset += metadata->size; // Move the offset to the start of the next image block
+        metadata__free_unpacked(metadata, NULL);
 
         image_index++;
     }
+
+    /* Encoder throughput without the module overhead, to compare codecs (e.g. jpeg against jxl) */
+    if (encoded_images > 0 && encode_ms > 0)
+        printf("[test] Encoder %s: %d images, %.2f ms, %.2f MB/s of raw pixels\n",
+               encoder, encoded_images, encode_ms, raw_bytes / encode_ms / 1e3);
 }
 
 void load_image(const char *filename, ImageBatch *batch, int num_images)
 {
     int image_width, image_height, image_channels;
-    unsigned char *image_data = stbi_load(filename, &image_width, &image_height, &image_channels, STBI_rgb_alpha);
+    unsigned char *image_data = stbi_load(filename, &image_width, &image_height, &image_channels, 0);
+    if (image_data == NULL)
+    {
+        fprintf(stderr, "[test] Error: Unable to load %s.\n", filename);
+        exit(EXIT_FAILURE);
+    }
     batch->num_images = num_images;
     uint32_t image_size = image_height * image_width * image_channels;
     Metadata new_meta = METADATA__INIT;
@@ -79,6 +128,7 @@ void load_image(const char *filename, ImageBatch *batch, int num_images)
         memcpy(batch->data + offset, image_data, image_size);
         offset += image_size;
     }
+    stbi_image_free(image_data);
 }
 
 int main(int argc, char *argv[])
@@ -95,7 +145,20 @@ int main(int argc, char *argv[])
 	if (parse_module_yaml_file(FILENAME_CONFIG, &module_parameter_list) < 0)
 		return -1;
 
+    uint32_t input_size = batch.batch_size;
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
     ImageBatch result = run(&batch, &module_parameter_list, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("[test] Module time: %.2f ms, %.2f MB/s, input %u bytes, output %u bytes (%.2f%%)\n",
+           seconds * 1e3, input_size / seconds / 1e6, input_size, result.batch_size,
+           100.0 * result.batch_size / input_size);
+
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0)
+        printf("[test] Peak RSS: %ld KiB\n", usage.ru_maxrss);
 
     save_images(FILENAME_OUTPUT, &result);
     free(module_parameter_list.parameters);
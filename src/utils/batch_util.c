@@ -10,40 +10,48 @@ int get_input_num_images()
     return input->num_images;
 }
 
-size_t get_image_data(int index, unsigned char **out)
+static unsigned char *find_image(int index)
 {
-    Metadata *image_meta = get_metadata(index);
-    *out = (unsigned char *)malloc(image_meta->size);
-    if (out == NULL)
-    {
-        signal_error_and_exit(100);
-    }
-    
     // Calculate offset by parsing through previous images
     unsigned char *ptr = input->data;
-    for (int i = 0; i <= index; i++)
+    for (int i = 0; i < index; i++)
     {
         uint32_t meta_size;
         memcpy(&meta_size, ptr, sizeof(uint32_t));
-        ptr += sizeof(uint32_t);
-        
-        if (i == index)
-        {
-            // Skip metadata to get to image data
-            ptr += meta_size;
-            memcpy(*out, ptr, image_meta->size);
-            break;
-        }
         
         // Skip metadata and image data for this image
         Metadata *current_meta = get_metadata(i);
-        ptr += meta_size + current_meta->size;
+        ptr += sizeof(uint32_t) + meta_size + current_meta->size;
     }
+
+    // Skip metadata to get to image data
+    uint32_t meta_size;
+    memcpy(&meta_size, ptr, sizeof(uint32_t));
+    return ptr + sizeof(uint32_t) + meta_size;
+}
+
+size_t get_image_data(int index, unsigned char **out)
+{
+    Metadata *image_meta = get_metadata(index);
+    *out = (unsigned char *)malloc(image_meta->size);
+    if (*out == NULL)
+    {
+        signal_error_and_exit(100);
+    }
+    
+    memcpy(*out, find_image(index), image_meta->size);
     
     return image_meta->size;
 }
 
-void append_result_image(unsigned char *data, uint32_t data_size, Metadata *meta)
+size_t get_image_view(int index, const unsigned char **out)
+{
+    Metadata *image_meta = get_metadata(index);
+    *out = find_image(index);
+    return image_meta->size;
+}
+
+unsigned char *reserve_result_image(uint32_t data_size, Metadata *meta)
 {
     /* Pack new metadata */
     size_t meta_size = metadata__get_packed_size(meta);
@@ -83,18 +91,28 @@ void append_result_image(unsigned char *data, uint32_t data_size, Metadata *meta
     }
 
     if (result->data == NULL)
-        return;
+        return NULL;
 
-    /* Insert meta size, then the metadata, then the image data */
+    /* Insert meta size, then the metadata, the image data follows */
     unsigned char *ptr = result->data + result->batch_size;
     memcpy(ptr, &meta_size, sizeof(uint32_t));
     ptr += sizeof(uint32_t);
     memcpy(ptr, meta_buf, meta_size);
     ptr += meta_size;
-    memcpy(ptr, data, data_size);
 
     result->batch_size += block_size;
     result->num_images += 1;
+
+    return ptr;
+}
+
+void append_result_image(unsigned char *data, uint32_t data_size, Metadata *meta)
+{
+    unsigned char *ptr = reserve_result_image(data_size, meta);
+    if (ptr == NULL)
+        return;
+
+    memcpy(ptr, data, data_size);
 }
 
 static void attach()
@@ -109,6 +127,7 @@ static void attach()
 
 void initialize()
 {
+    result->data = NULL;
     result->batch_size = 0;
     result->num_images = 0;
     result->pipeline_id = input->pipeline_id;
@@ -0,0 +1,113 @@
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "cache.h"
+
+/*
+ * File layout: "DCCH" | version (u32) | key (u64) | size (u64) | padding up to 64 bytes | data.
+ * The data starts 64 bytes in, so it keeps the alignment of the page for any element type.
+ */
+#define CACHE_MAGIC "DCCH"
+#define CACHE_VERSION 1
+#define CACHE_HEADER_SIZE 64
+
+typedef struct CacheHeader {
+    char magic[4];
+    uint32_t version;
+    uint64_t key;
+    uint64_t size;
+} CacheHeader;
+
+uint64_t cache_hash(const void *data, size_t size, uint64_t seed)
+{
+    const uint8_t *bytes = (const uint8_t *)data;
+    uint64_t hash = seed != 0 ? seed : 14695981039346656037ull;
+    for (size_t i = 0; i < size; ++i)
+        hash = (hash ^ bytes[i]) * 1099511628211ull;
+    return hash;
+}
+
+static int map_cache(CacheFile *cache, int writable)
+{
+    cache->map = (unsigned char *)mmap(NULL, cache->map_size, writable ? PROT_READ | PROT_WRITE : PROT_READ,
+                                       MAP_SHARED, cache->fd, 0);
+    if (cache->map == MAP_FAILED)
+    {
+        cache->map = NULL;
+        return -1;
+    }
+    cache->data = cache->map + CACHE_HEADER_SIZE;
+    cache->writable = writable;
+    return 0;
+}
+
+int cache_open(CacheFile *cache, const char *path, uint64_t key, size_t size)
+{
+    memset(cache, 0, sizeof(*cache));
+    cache->fd = -1;
+    cache->size = size;
+    cache->map_size = CACHE_HEADER_SIZE + size;
+    snprintf(cache->path, sizeof(cache->path), "%s", path);
+    snprintf(cache->tmp_path, sizeof(cache->tmp_path), "%s.tmp", path);
+
+    /* Hit: a complete file for the same key and size */
+    cache->fd = open(path, O_RDONLY);
+    if (cache->fd >= 0)
+    {
+        struct stat st;
+        CacheHeader header;
+        if (fstat(cache->fd, &st) == 0 && (size_t)st.st_size == cache->map_size
+            && pread(cache->fd, &header, sizeof(header), 0) == sizeof(header)
+            && memcmp(header.magic, CACHE_MAGIC, 4) == 0 && header.version == CACHE_VERSION
+            && header.key == key && header.size == size && map_cache(cache, 0) == 0)
+            return 1;
+        close(cache->fd);
+    }
+
+    /* Miss: the data is built in a temporary file and renamed into place by cache_commit */
+    cache->fd = open(cache->tmp_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (cache->fd < 0)
+        return -1;
+    if (ftruncate(cache->fd, cache->map_size) != 0 || map_cache(cache, 1) != 0)
+    {
+        unlink(cache->tmp_path);
+        cache_close(cache);
+        return -1;
+    }
+
+    CacheHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CACHE_MAGIC, 4);
+    header.version = CACHE_VERSION;
+    header.key = key;
+    header.size = size;
+    memcpy(cache->map, &header, sizeof(header));
+    return 0;
+}
+
+int cache_commit(CacheFile *cache)
+{
+    if (!cache->writable)
+        return 0;
+    if (msync(cache->map, cache->map_size, MS_SYNC) != 0 || rename(cache->tmp_path, cache->path) != 0)
+        return -1;
+    cache->writable = 0;
+    return 0;
+}
+
+void cache_close(CacheFile *cache)
+{
+    if (cache->map != NULL)
+        munmap(cache->map, cache->map_size);
+    if (cache->fd >= 0)
+        close(cache->fd);
+    if (cache->writable)
+        unlink(cache->tmp_path);
+    cache->map = NULL;
+    cache->data = NULL;
+    cache->fd = -1;
+    cache->writable = 0;
+}
@@ -0,0 +1,369 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "calibration.h"
+#include "cache.h"
+
+/*
+ * File layout (little endian):
+ *   "CALB" | version (u32) | count (u32) | reserved (u32) | file size (u64) |
+ *   checksum (u64, FNV-1a of the directory and the data of each array) | padding up to 64 bytes |
+ *   count x CalibrationArray | data of each array, 64-byte aligned
+ */
+#define CALIBRATION_MAGIC "CALB"
+#define CALIBRATION_VERSION 1
+#define CALIBRATION_ALIGN 64
+
+typedef struct CalibrationHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t count;
+    uint32_t reserved;
+    uint64_t file_size;
+    uint64_t checksum;
+    unsigned char padding[32];
+} CalibrationHeader;
+
+size_t calibration_type_size(uint32_t type)
+{
+    switch (type)
+    {
+    case CALIBRATION_F64:
+        return sizeof(double);
+    case CALIBRATION_F32:
+        return sizeof(float);
+    case CALIBRATION_U16:
+        return sizeof(uint16_t);
+    default:
+        return 0;
+    }
+}
+
+static size_t array_size(const CalibrationArray *array)
+{
+    return (size_t)array->rows * array->cols * calibration_type_size(array->type);
+}
+
+static uint64_t align_offset(uint64_t offset)
+{
+    return (offset + CALIBRATION_ALIGN - 1) / CALIBRATION_ALIGN * CALIBRATION_ALIGN;
+}
+
+static uint64_t checksum(const CalibrationArray *arrays, const void *const *data, uint32_t count)
+{
+    uint64_t hash = cache_hash(arrays, sizeof(CalibrationArray) * count, 0);
+    for (uint32_t k = 0; k < count; ++k)
+        hash = cache_hash(data[k], array_size(&arrays[k]), hash);
+    return hash;
+}
+
+int calibration_open(CalibrationFile *file, const char *path)
+{
+    memset(file, 0, sizeof(*file));
+    file->fd = open(path, O_RDONLY);
+    if (file->fd < 0)
+        return -1;
+
+    struct stat st;
+    CalibrationHeader header;
+    if (fstat(file->fd, &st) != 0 || (size_t)st.st_size < sizeof(header)
+        || pread(file->fd, &header, sizeof(header), 0) != sizeof(header)
+        || memcmp(header.magic, CALIBRATION_MAGIC, 4) != 0 || header.version != CALIBRATION_VERSION
+        || header.file_size != (uint64_t)st.st_size
+        || sizeof(header) + sizeof(CalibrationArray) * (uint64_t)header.count > header.file_size)
+    {
+        calibration_close(file);
+        return -2;
+    }
+
+    file->map_size = st.st_size;
+    file->map = (unsigned char *)mmap(NULL, file->map_size, PROT_READ, MAP_SHARED, file->fd, 0);
+    if (file->map == MAP_FAILED)
+    {
+        file->map = NULL;
+        calibration_close(file);
+        return -2;
+    }
+    file->count = header.count;
+    file->arrays = (const CalibrationArray *)(file->map + sizeof(header));
+
+    /* Every array must lie inside the file before the checksum reads it */
+    const void **data = (const void **)malloc(sizeof(void *) * (header.count > 0 ? header.count : 1));
+    if (data == NULL)
+    {
+        calibration_close(file);
+        return -2;
+    }
+    int valid = 1;
+    for (uint32_t k = 0; k < file->count && valid; ++k)
+    {
+        const CalibrationArray *array = &file->arrays[k];
+        valid = calibration_type_size(array->type) != 0 && array->offset % CALIBRATION_ALIGN == 0
+            && array->offset + array_size(array) <= file->map_size
+            && memchr(array->name, '\0', sizeof(array->name)) != NULL;
+        data[k] = file->map + array->offset;
+    }
+    valid = valid && checksum(file->arrays, data, file->count) == header.checksum;
+    free(data);
+    if (!valid)
+    {
+        calibration_close(file);
+        return -2;
+    }
+    return 0;
+}
+
+int calibration_save(const char *path, const CalibrationArray *arrays, const void *const *data, uint32_t count)
+{
+    char tmp_path[4096];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+    CalibrationArray *directory = (CalibrationArray *)malloc(sizeof(CalibrationArray) * (count > 0 ? count : 1));
+    if (directory == NULL)
+        return -1;
+    uint64_t offset = align_offset(sizeof(CalibrationHeader) + sizeof(CalibrationArray) * count);
+    for (uint32_t k = 0; k < count; ++k)
+    {
+        directory[k] = arrays[k];
+        directory[k].reserved = 0;
+        directory[k].offset = offset;
+        offset = align_offset(offset + array_size(&arrays[k]));
+    }
+
+    CalibrationHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CALIBRATION_MAGIC, 4);
+    header.version = CALIBRATION_VERSION;
+    header.count = count;
+    header.file_size = offset;
+    header.checksum = checksum(directory, data, count);
+
+    int ok = 0;
+    FILE *f = fopen(tmp_path, "wb");
+    if (f != NULL)
+    {
+        ok = fwrite(&header, sizeof(header), 1, f) == 1
+            && fwrite(directory, sizeof(CalibrationArray), count, f) == count;
+        for (uint32_t k = 0; k < count && ok; ++k)
+        {
+            size_t size = array_size(&directory[k]);
+            ok = fseek(f, directory[k].offset, SEEK_SET) == 0 && fwrite(data[k], 1, size, f) == size;
+        }
+        /* The file size covers the padding after the last array */
+        ok = ok && fflush(f) == 0 && ftruncate(fileno(f), header.file_size) == 0 && fsync(fileno(f)) == 0;
+        ok = fclose(f) == 0 && ok;
+    }
+    free(directory);
+
+    if (!ok || rename(tmp_path, path) != 0)
+    {
+        remove(tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+/* Parse the values of a text array and convert them to the array type */
+static void *import_text(const CalibrationSource *source)
+{
+    FILE *f = fopen(source->path, "rb");
+    if (f == NULL)
+        return NULL;
+    fseek(f, 0, SEEK_END);
+    long length = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    char *text = (char *)malloc(length + 1);
+    size_t count = (size_t)source->rows * source->cols;
+    unsigned char *values = (unsigned char *)malloc(count * calibration_type_size(source->type) + 1);
+    if (text == NULL || values == NULL || fread(text, 1, length, f) != (size_t)length)
+    {
+        fclose(f);
+        free(text);
+        free(values);
+        return NULL;
+    }
+    fclose(f);
+    text[length] = '\0';
+
+    char *cursor = text;
+    size_t n = 0;
+    while (n < count)
+    {
+        while (*cursor == ',' || *cursor == ';' || *cursor == ' ' || *cursor == '\t' || *cursor == '\r'
+               || *cursor == '\n')
+            cursor++;
+        char *end;
+        double value = strtod(cursor, &end);
+        if (end == cursor)
+            break;
+        cursor = end;
+
+        if (source->type == CALIBRATION_F64)
+            ((double *)values)[n] = value;
+        else if (source->type == CALIBRATION_F32)
+            ((float *)values)[n] = (float)value;
+        else
+            ((uint16_t *)values)[n] = (uint16_t)(value < 0.0 ? 0.0 : value > 65535.0 ? 65535.0 : round(value));
+        n++;
+    }
+    free(text);
+
+    if (n < count)
+    {
+        free(values);
+        return NULL;
+    }
+    return values;
+}
+
+static int is_newer(const char *path, const struct stat *reference)
+{
+    struct stat st;
+    return stat(path, &st) == 0 && st.st_mtime > reference->st_mtime;
+}
+
+static int has_text(const CalibrationSource *source)
+{
+    return source->path != NULL && source->path[0] != '\0' && access(source->path, R_OK) == 0;
+}
+
+int calibration_load(CalibrationFile *file, const char *path, const CalibrationSource *sources, uint32_t count)
+{
+    /* The file is up to date if it holds every source and no text file changed since it was written */
+    struct stat st;
+    int open_status = stat(path, &st) == 0 ? calibration_open(file, path) : -1;
+    int stale = open_status != 0;
+    for (uint32_t k = 0; k < count && !stale; ++k)
+        stale = has_text(&sources[k])
+            && (is_newer(sources[k].path, &st) || calibration_find(file, sources[k].name) == NULL);
+    if (!stale)
+        return 0;
+    if (open_status == 0)
+        calibration_close(file);
+
+    /* Rebuild the file from the text sources and the arrays of the current file */
+    CalibrationFile current;
+    int have_current = open_status == 0 && calibration_open(&current, path) == 0;
+    uint32_t max_arrays = count + (have_current ? current.count : 0);
+    CalibrationArray *arrays = (CalibrationArray *)malloc(sizeof(CalibrationArray) * (max_arrays + 1));
+    const void **data = (const void **)malloc(sizeof(void *) * (max_arrays + 1));
+    void **imported = (void **)calloc(count + 1, sizeof(void *));
+    uint32_t num_arrays = 0;
+    int status = arrays != NULL && data != NULL && imported != NULL ? 0 : -1;
+
+    for (uint32_t k = 0; k < count && status == 0; ++k)
+    {
+        const CalibrationSource *source = &sources[k];
+        if (has_text(source))
+        {
+            imported[k] = import_text(source);
+            if (imported[k] == NULL || strlen(source->name) >= sizeof(arrays->name))
+            {
+                status = -2;
+                break;
+            }
+            memset(&arrays[num_arrays], 0, sizeof(CalibrationArray));
+            strcpy(arrays[num_arrays].name, source->name);
+            arrays[num_arrays].type = source->type;
+            arrays[num_arrays].rows = source->rows;
+            arrays[num_arrays].cols = source->cols;
+            data[num_arrays++] = imported[k];
+        }
+        else if (!have_current)
+            status = open_status;
+        else if (calibration_find(&current, source->name) == NULL)
+            status = -1;
+    }
+
+    /* Arrays that are not imported are kept as they are */
+    for (uint32_t k = 0; have_current && k < current.count && status == 0; ++k)
+    {
+        int replaced = 0;
+        for (uint32_t j = 0; j < count; ++j)
+            replaced |= has_text(&sources[j]) && strcmp(sources[j].name, current.arrays[k].name) == 0;
+        if (replaced)
+            continue;
+        arrays[num_arrays] = current.arrays[k];
+        data[num_arrays++] = calibration_data(&current, &current.arrays[k]);
+    }
+
+    if (status == 0 && calibration_save(path, arrays, data, num_arrays) != 0)
+        status = -1;
+
+    if (have_current)
+        calibration_close(&current);
+    for (uint32_t k = 0; imported != NULL && k < count; ++k)
+        free(imported[k]);
+    free(imported);
+    free(arrays);
+    free(data);
+
+    if (status != 0)
+    {
+        memset(file, 0, sizeof(*file));
+        file->fd = -1;
+        return status;
+    }
+    return calibration_open(file, path);
+}
+
+const CalibrationArray *calibration_find(const CalibrationFile *file, const char *name)
+{
+    for (uint32_t k = 0; k < file->count; ++k)
+        if (strcmp(file->arrays[k].name, name) == 0)
+            return &file->arrays[k];
+    return NULL;
+}
+
+const void *calibration_get(const CalibrationFile *file, const char *name, uint32_t type, uint32_t rows, uint32_t cols)
+{
+    const CalibrationArray *array = calibration_find(file, name);
+    if (array == NULL || array->type != type || array->rows != rows || array->cols != cols)
+        return NULL;
+    return calibration_data(file, array);
+}
+
+const void *calibration_data(const CalibrationFile *file, const CalibrationArray *array)
+{
+    return file->map + array->offset;
+}
+
+void calibration_close(CalibrationFile *file)
+{
+    if (file->map != NULL)
+        munmap(file->map, file->map_size);
+    if (file->fd >= 0)
+        close(file->fd);
+    file->map = NULL;
+    file->fd = -1;
+    file->count = 0;
+    file->arrays = NULL;
+}
+
+int calibration_load_camera(CameraCalibration *camera, const char *path, const char *matrix_path,
+                            const char *coeffs_path)
+{
+    CalibrationSource sources[2] = {
+        {"camera_matrix", matrix_path, CALIBRATION_F64, 3, 3},
+        {"distortion_coeffs", coeffs_path, CALIBRATION_F64, 1, 5},
+    };
+    CalibrationFile file;
+    if (calibration_load(&file, path, sources, 2) != 0)
+        return -1;
+
+    const double *K = (const double *)calibration_get(&file, "camera_matrix", CALIBRATION_F64, 3, 3);
+    const double *D = (const double *)calibration_get(&file, "distortion_coeffs", CALIBRATION_F64, 1, 5);
+    int status = K != NULL && D != NULL ? 0 : -2;
+    if (status == 0)
+    {
+        memcpy(camera->K, K, sizeof(camera->K));
+        memcpy(camera->D, D, sizeof(camera->D));
+    }
+    calibration_close(&file);
+    return status;
+}
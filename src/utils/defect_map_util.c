@@ -0,0 +1,184 @@
+#include <unistd.h>
+#include "util.h"
+#include "defect_map.h"
+
+/*
+ * File layout (little endian):
+ *   "DMAP" | version (u32) | width (u32) | height (u32) | generation (u32) | count (u32) |
+ *   checksum (u32, FNV-1a of the entries) | reserved (u32) | count x DefectEntry
+ */
+#define DEFECT_MAP_MAGIC "DMAP"
+#define DEFECT_MAP_VERSION 1
+
+typedef struct DefectMapHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t width;
+    uint32_t height;
+    uint32_t generation;
+    uint32_t count;
+    uint32_t checksum;
+    uint32_t reserved;
+} DefectMapHeader;
+
+static uint32_t fnv1a(const void *data, size_t size)
+{
+    const uint8_t *bytes = (const uint8_t *)data;
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < size; ++i)
+        hash = (hash ^ bytes[i]) * 16777619u;
+    return hash;
+}
+
+static void reserve_entries(DefectMap *map, uint32_t capacity)
+{
+    if (capacity <= map->capacity)
+        return;
+    DefectEntry *entries = (DefectEntry *)realloc(map->entries, sizeof(DefectEntry) * capacity);
+    if (entries == NULL)
+        signal_error_and_exit(101);
+    map->entries = entries;
+    map->capacity = capacity;
+}
+
+void defect_map_init(DefectMap *map, uint32_t width, uint32_t height)
+{
+    memset(map, 0, sizeof(*map));
+    map->width = width;
+    map->height = height;
+}
+
+void defect_map_free(DefectMap *map)
+{
+    free(map->entries);
+    map->entries = NULL;
+    map->count = map->capacity = 0;
+}
+
+int defect_map_load(const char *path, DefectMap *map)
+{
+    FILE *f = fopen(path, "rb");
+    if (f == NULL)
+        return -1;
+
+    DefectMapHeader header;
+    if (fread(&header, sizeof(header), 1, f) != 1 || memcmp(header.magic, DEFECT_MAP_MAGIC, 4) != 0
+        || header.version != DEFECT_MAP_VERSION || header.count > (uint64_t)header.width * header.height)
+    {
+        fclose(f);
+        return -2;
+    }
+
+    defect_map_init(map, header.width, header.height);
+    map->generation = header.generation;
+    reserve_entries(map, header.count > 0 ? header.count : 1);
+    if (fread(map->entries, sizeof(DefectEntry), header.count, f) != header.count
+        || fnv1a(map->entries, sizeof(DefectEntry) * header.count) != header.checksum)
+    {
+        fclose(f);
+        defect_map_free(map);
+        return -2;
+    }
+    fclose(f);
+    map->count = header.count;
+
+    /* Positions must be sorted and inside the frame for the binary search and the correction */
+    for (uint32_t k = 0; k < map->count; ++k)
+        if (map->entries[k].position >= map->width * map->height
+            || (k > 0 && map->entries[k].position <= map->entries[k - 1].position))
+        {
+            defect_map_free(map);
+            return -2;
+        }
+    return 0;
+}
+
+int defect_map_save(const char *path, DefectMap *map)
+{
+    char tmp_path[4096];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+    DefectMapHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, DEFECT_MAP_MAGIC, 4);
+    header.version = DEFECT_MAP_VERSION;
+    header.width = map->width;
+    header.height = map->height;
+    header.generation = map->generation + 1;
+    header.count = map->count;
+    header.checksum = fnv1a(map->entries, sizeof(DefectEntry) * map->count);
+
+    FILE *f = fopen(tmp_path, "wb");
+    if (f == NULL)
+        return -1;
+    int ok = fwrite(&header, sizeof(header), 1, f) == 1
+        && fwrite(map->entries, sizeof(DefectEntry), map->count, f) == map->count
+        && fflush(f) == 0 && fsync(fileno(f)) == 0;
+    ok = fclose(f) == 0 && ok;
+    if (!ok || rename(tmp_path, path) != 0)
+    {
+        remove(tmp_path);
+        return -1;
+    }
+
+    map->generation = header.generation;
+    return 0;
+}
+
+int defect_map_find(const DefectMap *map, uint32_t position)
+{
+    int lo = 0;
+    int hi = (int)map->count - 1;
+    while (lo <= hi)
+    {
+        int mid = lo + (hi - lo) / 2;
+        uint32_t p = map->entries[mid].position;
+        if (p == position)
+            return mid;
+        if (p < position)
+            lo = mid + 1;
+        else
+            hi = mid - 1;
+    }
+    return -1;
+}
+
+void defect_map_update(DefectMap *map, const DefectEntry *detected, uint32_t num_detected, uint16_t max_hits)
+{
+    /* Merge of two sorted lists into a new entry array */
+    uint32_t capacity = map->count + num_detected;
+    DefectEntry *merged = (DefectEntry *)malloc(sizeof(DefectEntry) * (capacity > 0 ? capacity : 1));
+    if (merged == NULL)
+        signal_error_and_exit(100);
+
+    uint32_t i = 0, j = 0, n = 0;
+    while (i < map->count || j < num_detected)
+    {
+        if (j == num_detected || (i < map->count && map->entries[i].position < detected[j].position))
+        {
+            /* Not detected this time */
+            DefectEntry entry = map->entries[i++];
+            if (--entry.hits > 0)
+                merged[n++] = entry;
+        }
+        else if (i == map->count || detected[j].position < map->entries[i].position)
+        {
+            DefectEntry entry = detected[j++];
+            entry.hits = 1;
+            entry.reserved = 0;
+            merged[n++] = entry;
+        }
+        else
+        {
+            DefectEntry entry = map->entries[i++];
+            entry.hits = entry.hits < max_hits ? entry.hits + 1 : max_hits;
+            entry.kind = detected[j++].kind;
+            merged[n++] = entry;
+        }
+    }
+
+    free(map->entries);
+    map->entries = merged;
+    map->count = n;
+    map->capacity = capacity > 0 ? capacity : 1;
+}
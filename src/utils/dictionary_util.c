@@ -0,0 +1,41 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "dictionary.h"
+
+int dictionary_load(const char *path, unsigned char **dict, size_t *dict_size)
+{
+    *dict = NULL;
+    *dict_size = 0;
+    if (path == NULL || path[0] == '\0')
+        return 0;
+
+    FILE *f = fopen(path, "rb");
+    if (f == NULL)
+        return -1;
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    if (size <= 0)
+    {
+        fclose(f);
+        return -1;
+    }
+
+    unsigned char *data = (unsigned char *)malloc(size);
+    if (data == NULL)
+    {
+        fclose(f);
+        return -2;
+    }
+    if (fread(data, 1, size, f) != (size_t)size)
+    {
+        free(data);
+        fclose(f);
+        return -1;
+    }
+    fclose(f);
+
+    *dict = data;
+    *dict_size = size;
+    return 0;
+}
@@ -0,0 +1,206 @@
+#include <stdlib.h>
+#include <string.h>
+#include "flat_field.h"
+
+#ifdef __ARM_NEON
+#include <arm_neon.h>
+#endif
+
+/* Bilinear weights are Q8 */
+#define WEIGHT_SHIFT 8
+#define WEIGHT_ONE (1 << WEIGHT_SHIFT)
+
+/* Node and Q8 weight of the next node for position p of n, with nodes nodes spanning the corners */
+static inline void node_position(int p, int n, int nodes, int32_t *index, uint16_t *weight)
+{
+    int64_t position = n > 1 ? (int64_t)p * (nodes - 1) * WEIGHT_ONE / (n - 1) : 0;
+    *index = (int32_t)(position >> WEIGHT_SHIFT);
+    *weight = (uint16_t)(position & (WEIGHT_ONE - 1));
+}
+
+static inline uint16_t blend(uint16_t a, uint16_t b, uint16_t weight)
+{
+    return (uint16_t)(((uint32_t)a * (WEIGHT_ONE - weight) + (uint32_t)b * weight + WEIGHT_ONE / 2) >> WEIGHT_SHIFT);
+}
+
+const uint16_t *flat_field_load(CalibrationFile *file, const char *path, const char *text_path, uint32_t text_rows,
+                                uint32_t text_cols, uint32_t *rows, uint32_t *cols)
+{
+    CalibrationSource source = {"flat_field", text_path, CALIBRATION_U16, text_rows, text_cols};
+    int has_source = text_path != NULL && text_path[0] != '\0';
+    if (calibration_load(file, path, &source, has_source ? 1 : 0) != 0)
+        return NULL;
+
+    const CalibrationArray *array = calibration_find(file, "flat_field");
+    if (array == NULL || array->type != CALIBRATION_U16)
+    {
+        calibration_close(file);
+        return NULL;
+    }
+    *rows = array->rows;
+    *cols = array->cols;
+    return (const uint16_t *)calibration_data(file, array);
+}
+
+int flat_field_init(FlatField *flat, const uint16_t *gains, uint32_t rows, uint32_t cols, int width, int height,
+                    int channels, int step)
+{
+    memset(flat, 0, sizeof(*flat));
+    int plane_width = (width + step - 1) / step;
+    int plane_height = (height + step - 1) / step;
+    if (rows == 0 || cols == 0 || rows % step != 0 || cols % (step * channels) != 0)
+        return -1;
+    int grid_width = cols / (step * channels);
+    int grid_height = rows / step;
+    if (grid_width > plane_width || grid_height > plane_height)
+        return -1;
+
+    flat->width = width;
+    flat->height = height;
+    flat->channels = channels;
+    flat->step = step;
+    flat->grid_width = grid_width;
+    flat->grid_height = grid_height;
+    flat->gains = gains;
+
+    flat->row_index = (int32_t *)malloc(sizeof(int32_t) * plane_height);
+    flat->row_weight = (uint16_t *)malloc(sizeof(uint16_t) * plane_height);
+    if (flat->row_index == NULL || flat->row_weight == NULL)
+    {
+        flat_field_free(flat);
+        return -2;
+    }
+    for (int yp = 0; yp < plane_height; ++yp)
+        node_position(yp, plane_height, grid_height, &flat->row_index[yp], &flat->row_weight[yp]);
+
+    /* A full width map is used in place, otherwise every map row is upsampled to the frame width once */
+    if (grid_width == plane_width)
+        return 0;
+    size_t row_length = (size_t)width * channels;
+    flat->rows = (uint16_t *)malloc(sizeof(uint16_t) * row_length * rows);
+    if (flat->rows == NULL)
+    {
+        flat_field_free(flat);
+        return -2;
+    }
+    for (int x = 0; x < width; ++x)
+    {
+        int32_t node;
+        uint16_t weight;
+        node_position(x / step, plane_width, grid_width, &node, &weight);
+        int next = node + 1 < grid_width ? node + 1 : node;
+        size_t column = ((size_t)node * step + x % step) * channels;
+        size_t next_column = ((size_t)next * step + x % step) * channels;
+        for (uint32_t r = 0; r < rows; ++r)
+        {
+            const uint16_t *gain_row = gains + (size_t)r * cols;
+            for (int c = 0; c < channels; ++c)
+                flat->rows[r * row_length + (size_t)x * channels + c] =
+                    blend(gain_row[column + c], gain_row[next_column + c], weight);
+        }
+    }
+    return 0;
+}
+
+static inline const uint16_t *gain_row(const FlatField *flat, int row)
+{
+    if (flat->rows != NULL)
+        return flat->rows + (size_t)row * flat->width * flat->channels;
+    return flat->gains + (size_t)row * flat->grid_width * flat->step * flat->channels;
+}
+
+/* Vertical blend of two upsampled gain rows */
+static void blend_rows(const uint16_t *a, const uint16_t *b, uint16_t weight, uint16_t *out, size_t n)
+{
+    size_t x = 0;
+#ifdef __ARM_NEON
+    uint16x4_t weight_a = vdup_n_u16(WEIGHT_ONE - weight);
+    uint16x4_t weight_b = vdup_n_u16(weight);
+    for (; x + 8 <= n; x += 8)
+    {
+        uint16x8_t va = vld1q_u16(a + x);
+        uint16x8_t vb = vld1q_u16(b + x);
+        uint32x4_t lo = vmlal_u16(vmull_u16(vget_low_u16(va), weight_a), vget_low_u16(vb), weight_b);
+        uint32x4_t hi = vmlal_u16(vmull_u16(vget_high_u16(va), weight_a), vget_high_u16(vb), weight_b);
+        vst1q_u16(out + x, vcombine_u16(vrshrn_n_u32(lo, WEIGHT_SHIFT), vrshrn_n_u32(hi, WEIGHT_SHIFT)));
+    }
+#endif
+    for (; x < n; ++x)
+        out[x] = blend(a[x], b[x], weight);
+}
+
+#ifdef __ARM_NEON
+/* 8 samples times their gains, rounded and saturated to 16 bits */
+static inline uint16x8_t apply_gain_u16(uint16x8_t samples, uint16x8_t gains)
+{
+    uint32x4_t lo = vmull_u16(vget_low_u16(samples), vget_low_u16(gains));
+    uint32x4_t hi = vmull_u16(vget_high_u16(samples), vget_high_u16(gains));
+    return vcombine_u16(vqrshrn_n_u32(lo, FLAT_FIELD_SHIFT), vqrshrn_n_u32(hi, FLAT_FIELD_SHIFT));
+}
+#endif
+
+void flat_field_apply_row(const FlatField *flat, int y, const void *src, void *dst, int bits_pixel,
+                          uint16_t *line)
+{
+    int step = flat->step;
+    int plane_row = y / step;
+    int node = flat->row_index[plane_row];
+    int next = node + 1 < flat->grid_height ? node + 1 : node;
+    uint16_t weight = flat->row_weight[plane_row];
+    size_t n = (size_t)flat->width * flat->channels;
+
+    const uint16_t *gains = gain_row(flat, node * step + y % step);
+    if (weight != 0)
+    {
+        blend_rows(gains, gain_row(flat, next * step + y % step), weight, line, n);
+        gains = line;
+    }
+
+    uint32_t max_value = (1u << bits_pixel) - 1;
+    size_t x = 0;
+    if (bits_pixel > 8)
+    {
+        const uint16_t *in = (const uint16_t *)src;
+        uint16_t *out = (uint16_t *)dst;
+#ifdef __ARM_NEON
+        uint16x8_t max_vector = vdupq_n_u16((uint16_t)max_value);
+        for (; x + 8 <= n; x += 8)
+            vst1q_u16(out + x, vminq_u16(apply_gain_u16(vld1q_u16(in + x), vld1q_u16(gains + x)), max_vector));
+#endif
+        for (; x < n; ++x)
+        {
+            uint32_t value = ((uint32_t)in[x] * gains[x] + FLAT_FIELD_ONE / 2) >> FLAT_FIELD_SHIFT;
+            out[x] = (uint16_t)(value < max_value ? value : max_value);
+        }
+    }
+    else
+    {
+        const uint8_t *in = (const uint8_t *)src;
+        uint8_t *out = (uint8_t *)dst;
+#ifdef __ARM_NEON
+        uint8x16_t max_vector = vdupq_n_u8((uint8_t)max_value);
+        for (; x + 16 <= n; x += 16)
+        {
+            uint8x16_t samples = vld1q_u8(in + x);
+            uint16x8_t lo = apply_gain_u16(vmovl_u8(vget_low_u8(samples)), vld1q_u16(gains + x));
+            uint16x8_t hi = apply_gain_u16(vmovl_u8(vget_high_u8(samples)), vld1q_u16(gains + x + 8));
+            vst1q_u8(out + x, vminq_u8(vcombine_u8(vqmovn_u16(lo), vqmovn_u16(hi)), max_vector));
+        }
+#endif
+        for (; x < n; ++x)
+        {
+            uint32_t value = ((uint32_t)in[x] * gains[x] + FLAT_FIELD_ONE / 2) >> FLAT_FIELD_SHIFT;
+            out[x] = (uint8_t)(value < max_value ? value : max_value);
+        }
+    }
+}
+
+void flat_field_free(FlatField *flat)
+{
+    free(flat->rows);
+    free(flat->row_index);
+    free(flat->row_weight);
+    flat->rows = NULL;
+    flat->row_index = NULL;
+    flat->row_weight = NULL;
+}
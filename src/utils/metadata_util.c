@@ -159,6 +159,42 @@ void add_custom_metadata_string(Metadata *data, char *key, char *val)
     item->string_value = strdup(val);
 }
 
+int has_custom_metadata(Metadata *data, char *key)
+{
+    return get_item(data, key) != NULL;
+}
+
+void copy_custom_metadata(Metadata *data, Metadata *src, const char *const *skip_keys)
+{
+    for (size_t i = 0; i < src->n_items; i++)
+    {
+        MetadataItem *item = src->items[i];
+        int skip = get_item(data, item->key) != NULL;
+        for (size_t k = 0; skip_keys != NULL && skip_keys[k] != NULL && !skip; k++)
+            skip = strcmp(item->key, skip_keys[k]) == 0;
+        if (skip)
+            continue;
+
+        switch (item->value_case)
+        {
+        case METADATA_ITEM__VALUE_BOOL_VALUE:
+            add_custom_metadata_bool(data, item->key, item->bool_value);
+            break;
+        case METADATA_ITEM__VALUE_INT_VALUE:
+            add_custom_metadata_int(data, item->key, item->int_value);
+            break;
+        case METADATA_ITEM__VALUE_FLOAT_VALUE:
+            add_custom_metadata_float(data, item->key, item->float_value);
+            break;
+        case METADATA_ITEM__VALUE_STRING_VALUE:
+            add_custom_metadata_string(data, item->key, item->string_value);
+            break;
+        default:
+            break;
+        }
+    }
+}
+
 int get_custom_metadata_bool(Metadata *data, char *key)
 {
     MetadataItem *found_item = get_item(data, key);
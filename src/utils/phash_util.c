@@ -0,0 +1,166 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "phash.h"
+
+#ifdef __ARM_NEON
+#include <arm_neon.h>
+#endif
+
+#define DHASH_WIDTH 9
+#define DHASH_HEIGHT 8
+#define PHASH_SIZE 32
+#define PHASH_COEFFS 8
+/* Samples read per grid cell in each direction, the hash only needs the cell means */
+#define CELL_SAMPLES 16
+
+/* Mean over all channels of each cell of a grid_width x grid_height grid. The sampling step
+   is odd, so on a raw CFA frame every colour of the 2x2 pattern is sampled equally. */
+static void downsample_luma(const unsigned char *data, int width, int height, int channels, int bits_pixel,
+                            int grid_width, int grid_height, float *grid)
+{
+    int wide = bits_pixel > 8;
+    size_t stride = (size_t)width * channels;
+
+    for (int gy = 0; gy < grid_height; ++gy)
+    {
+        int y0 = (int)((int64_t)gy * height / grid_height);
+        int y1 = (int)((int64_t)(gy + 1) * height / grid_height);
+        int step_y = ((y1 - y0) / CELL_SAMPLES) | 1;
+
+        for (int gx = 0; gx < grid_width; ++gx)
+        {
+            int x0 = (int)((int64_t)gx * width / grid_width);
+            int x1 = (int)((int64_t)(gx + 1) * width / grid_width);
+            int step_x = ((x1 - x0) / CELL_SAMPLES) | 1;
+
+            uint64_t sum = 0;
+            uint32_t count = 0;
+            for (int y = y0; y < y1; y += step_y)
+            {
+                size_t row = (size_t)y * stride;
+                for (int x = x0; x < x1; x += step_x)
+                {
+                    size_t index = row + (size_t)x * channels;
+                    for (int c = 0; c < channels; ++c)
+                        sum += wide ? ((const uint16_t *)data)[index + c] : data[index + c];
+                    count += channels;
+                }
+            }
+            grid[gy * grid_width + gx] = count > 0 ? (float)sum / count : 0.0f;
+        }
+    }
+}
+
+static int compare_float(const void *a, const void *b)
+{
+    float fa = *(const float *)a;
+    float fb = *(const float *)b;
+    return (fa > fb) - (fa < fb);
+}
+
+static uint64_t dhash(const float *grid)
+{
+    uint64_t hash = 0;
+    for (int y = 0; y < DHASH_HEIGHT; ++y)
+        for (int x = 0; x < DHASH_WIDTH - 1; ++x)
+            if (grid[y * DHASH_WIDTH + x] > grid[y * DHASH_WIDTH + x + 1])
+                hash |= 1ull << (y * (DHASH_WIDTH - 1) + x);
+    return hash;
+}
+
+static uint64_t phash(const float *grid)
+{
+    /* Only the lowest 8x8 DCT-II coefficients are needed, computed separably: rows first, then columns */
+    float basis[PHASH_COEFFS][PHASH_SIZE];
+    for (int u = 0; u < PHASH_COEFFS; ++u)
+        for (int x = 0; x < PHASH_SIZE; ++x)
+            basis[u][x] = cosf((float)M_PI * (2 * x + 1) * u / (2 * PHASH_SIZE));
+
+    float rows[PHASH_SIZE][PHASH_COEFFS];
+    for (int y = 0; y < PHASH_SIZE; ++y)
+        for (int u = 0; u < PHASH_COEFFS; ++u)
+        {
+            float sum = 0.0f;
+            for (int x = 0; x < PHASH_SIZE; ++x)
+                sum += grid[y * PHASH_SIZE + x] * basis[u][x];
+            rows[y][u] = sum;
+        }
+
+    float coeffs[PHASH_COEFFS * PHASH_COEFFS];
+    for (int v = 0; v < PHASH_COEFFS; ++v)
+        for (int u = 0; u < PHASH_COEFFS; ++u)
+        {
+            float sum = 0.0f;
+            for (int y = 0; y < PHASH_SIZE; ++y)
+                sum += rows[y][u] * basis[v][y];
+            coeffs[v * PHASH_COEFFS + u] = sum;
+        }
+
+    /* The DC coefficient only holds the mean brightness, it is left out of the median */
+    float sorted[PHASH_COEFFS * PHASH_COEFFS - 1];
+    memcpy(sorted, coeffs + 1, sizeof(sorted));
+    qsort(sorted, PHASH_COEFFS * PHASH_COEFFS - 1, sizeof(float), compare_float);
+    float median = sorted[(PHASH_COEFFS * PHASH_COEFFS - 1) / 2];
+
+    uint64_t hash = 0;
+    for (int k = 1; k < PHASH_COEFFS * PHASH_COEFFS; ++k)
+        if (coeffs[k] > median)
+            hash |= 1ull << k;
+    return hash;
+}
+
+uint64_t compute_perceptual_hash(const unsigned char *data, int width, int height, int channels, int bits_pixel,
+                                 PerceptualHashType type)
+{
+    if (type == HASH_PHASH)
+    {
+        float grid[PHASH_SIZE * PHASH_SIZE];
+        downsample_luma(data, width, height, channels, bits_pixel, PHASH_SIZE, PHASH_SIZE, grid);
+        return phash(grid);
+    }
+
+    float grid[DHASH_WIDTH * DHASH_HEIGHT];
+    downsample_luma(data, width, height, channels, bits_pixel, DHASH_WIDTH, DHASH_HEIGHT, grid);
+    return dhash(grid);
+}
+
+void hash_distances(uint64_t hash, const uint64_t *hashes, int count, uint8_t *distances)
+{
+    int i = 0;
+#ifdef __ARM_NEON
+    /* Two hashes per vector: byte popcounts, then pairwise widening adds up to one count per 64-bit lane */
+    uint64x2_t query = vdupq_n_u64(hash);
+    for (; i + 2 <= count; i += 2)
+    {
+        uint8x16_t bits = vcntq_u8(vreinterpretq_u8_u64(veorq_u64(vld1q_u64(hashes + i), query)));
+        uint64x2_t sums = vpaddlq_u32(vpaddlq_u16(vpaddlq_u8(bits)));
+        distances[i] = (uint8_t)vgetq_lane_u64(sums, 0);
+        distances[i + 1] = (uint8_t)vgetq_lane_u64(sums, 1);
+    }
+#endif
+    for (; i < count; ++i)
+        distances[i] = (uint8_t)hash_distance(hash, hashes[i]);
+}
+
+int nearest_hash(uint64_t hash, const uint64_t *hashes, int count, int *distance)
+{
+    int best = -1;
+    int best_distance = 65;
+    uint8_t distances[256];
+
+    for (int start = 0; start < count; start += 256)
+    {
+        int n = count - start < 256 ? count - start : 256;
+        hash_distances(hash, hashes + start, n, distances);
+        for (int k = 0; k < n; ++k)
+            if (distances[k] < best_distance)
+            {
+                best_distance = distances[k];
+                best = start + k;
+            }
+    }
+
+    *distance = best_distance;
+    return best;
+}
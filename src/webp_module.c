@@ -0,0 +1,174 @@
+#include "module.h"
+#include "util.h"
+#include <webp/encode.h>
+#include <time.h>
+
+/* Define custom error codes */
+enum ERROR_CODE {
+    MALLOC_ERR = 1,
+    WEBP_CONFIG = 2,
+    WEBP_PICTURE = 3,
+    WEBP_ENCODE = 4,
+    INVALID_INPUT = 5,
+};
+
+static double elapsed_ms(const struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1e3 + (now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+/* Luma of a gray sample, as libwebp computes it for r = g = b (limited range BT.601) */
+static inline uint8_t gray_to_luma(unsigned char v)
+{
+    return (uint8_t)(((16839 + 33059 + 6420) * v + (1 << 15) + (16 << 16)) >> 16);
+}
+
+/* Import pixels into the picture straight from the input view, without a conversion copy.
+   Lossless encoding works on ARGB, lossy encoding on YUV: picture->use_argb picks the one
+   the importers convert to, so the encoder does not convert the picture a second time. */
+static void import_picture(WebPPicture *picture, Metadata *meta, const unsigned char *data)
+{
+    int width = meta->width;
+    int height = meta->height;
+    int channels = meta->channels;
+    int stride = width * channels;
+    int bgr = has_custom_metadata(meta, "channel_order")
+        && strcmp(get_custom_metadata_string(meta, "channel_order"), "bgr") == 0;
+
+    picture->width = width;
+    picture->height = height;
+
+    int ok = 0;
+    if (channels == 3)
+        ok = bgr ? WebPPictureImportBGR(picture, data, stride) : WebPPictureImportRGB(picture, data, stride);
+    else if (channels == 4)
+        ok = bgr ? WebPPictureImportBGRA(picture, data, stride) : WebPPictureImportRGBA(picture, data, stride);
+    else if (channels == 1 && WebPPictureAlloc(picture))
+    {
+        /* Expand gray directly into the ARGB plane, or into the luma plane with neutral chroma */
+        for (int y = 0; y < height; ++y)
+        {
+            const unsigned char *src = data + (size_t)y * width;
+            if (picture->use_argb)
+            {
+                uint32_t *dst = picture->argb + (size_t)y * picture->argb_stride;
+                for (int x = 0; x < width; ++x)
+                    dst[x] = 0xff000000u | ((uint32_t)src[x] * 0x010101u);
+            }
+            else
+            {
+                uint8_t *dst = picture->y + (size_t)y * picture->y_stride;
+                for (int x = 0; x < width; ++x)
+                    dst[x] = gray_to_luma(src[x]);
+            }
+        }
+        if (!picture->use_argb)
+            for (int y = 0; y < (height + 1) / 2; ++y)
+            {
+                memset(picture->u + (size_t)y * picture->uv_stride, 128, (width + 1) / 2);
+                memset(picture->v + (size_t)y * picture->uv_stride, 128, (width + 1) / 2);
+            }
+        ok = 1;
+    }
+
+    if (!ok)
+        signal_error_and_exit(WEBP_PICTURE);
+}
+
+/* START MODULE IMPLEMENTATION */
+void module()
+{
+    /* Get number of images in input batch */
+    int num_images = get_input_num_images();
+
+    float quality = get_param_float("quality");
+    int method = get_param_int("method");
+    int lossless = get_param_bool("lossless");
+    int thread_level = get_param_int("thread_level");
+
+    WebPConfig webp_config;
+    if (!WebPConfigInit(&webp_config))
+        signal_error_and_exit(WEBP_CONFIG);
+
+    /* For lossless, quality and method trade encoder speed against size instead of fidelity */
+    webp_config.lossless = lossless;
+    webp_config.quality = quality;
+    webp_config.method = method;
+    webp_config.thread_level = thread_level;
+    webp_config.exact = lossless; // keep RGB values under transparent areas when lossless
+
+    if (!WebPValidateConfig(&webp_config))
+        signal_error_and_exit(WEBP_CONFIG);
+
+    for (int i = 0; i < num_images; ++i)
+    {
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        Metadata *input_meta = get_metadata(i);
+        if (input_meta->width <= 0 || input_meta->height <= 0 || input_meta->bits_pixel != 8
+            || (input_meta->channels != 1 && input_meta->channels != 3 && input_meta->channels != 4))
+            signal_error_and_exit(INVALID_INPUT);
+
+        const unsigned char *input_image_data;
+        size_t size = get_image_view(i, &input_image_data);
+        if (size != (size_t)input_meta->width * input_meta->height * input_meta->channels)
+            signal_error_and_exit(INVALID_INPUT);
+
+        WebPPicture picture;
+        if (!WebPPictureInit(&picture))
+            signal_error_and_exit(WEBP_PICTURE);
+
+        picture.use_argb = webp_config.lossless;
+        import_picture(&picture, input_meta, input_image_data);
+
+        /* Collect the encoded bitstream in memory, it is appended to the result batch as is */
+        WebPMemoryWriter writer;
+        WebPMemoryWriterInit(&writer);
+        picture.writer = WebPMemoryWrite;
+        picture.custom_ptr = &writer;
+
+        if (!WebPEncode(&webp_config, &picture))
+            signal_error_and_exit(picture.error_code == VP8_ENC_ERROR_OUT_OF_MEMORY ? MALLOC_ERR : WEBP_ENCODE);
+
+        /* Create image metadata before appending */
+        Metadata new_meta = METADATA__INIT;
+        new_meta.size = writer.size;
+        new_meta.width = input_meta->width;
+        new_meta.height = input_meta->height;
+        new_meta.channels = input_meta->channels;
+        new_meta.timestamp = input_meta->timestamp;
+        new_meta.bits_pixel = input_meta->bits_pixel;
+        new_meta.camera = input_meta->camera;
+        new_meta.obid = input_meta->obid;
+        add_custom_metadata_string(&new_meta, "enc", "webp");
+        add_custom_metadata_float(&new_meta, "encode_ms", elapsed_ms(&start));
+
+        /* Append the image to the result batch */
+        append_result_image(writer.mem, writer.size, &new_meta);
+
+        /* Remember to free any allocated memory */
+        WebPMemoryWriterClear(&writer);
+        WebPPictureFree(&picture);
+    }
+}
+/* END MODULE IMPLEMENTATION */
+
+/* Main function of module (NO NEED TO MODIFY) */
+ImageBatch run(ImageBatch *input_batch, ModuleParameterList *module_parameter_list, int *ipc_error_pipe)
+{
+    ImageBatch result_batch;
+    result = &result_batch;
+    input = input_batch;
+    config = module_parameter_list;
+    error_pipe = ipc_error_pipe;
+    initialize();
+
+    module();
+
+    finalize();
+
+    return result_batch;
+}